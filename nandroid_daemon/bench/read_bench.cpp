@@ -0,0 +1,169 @@
+// Measures the throughput of ReadHandle requests over loopback, with a ClientHandler serving them on the same machine.
+// Built twice by the Makefile in this directory: once as the daemon is normally built, which sends large reads with `sendfile`,
+// and once with NANDROID_NO_ZERO_COPY defined, which sends every read through a buffer as the daemon used to.
+//
+// Usage: read_bench [file size in MiB] [read length in KiB] [passes]
+
+#include "ClientHandler.hpp"
+#include "UnixException.hpp"
+#include "serialization.hpp"
+#include "requests.hpp"
+#include "responses.hpp"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace nandroidfs;
+
+// Buffer size for the DataReader and DataWriter, which matches the one used by the client.
+const int BUFFER_SIZE = 8192;
+
+// A Readable and Writable for a connected socket.
+class SocketStream : public Readable, public Writable {
+public:
+    int socket;
+
+    SocketStream(int socket) {
+        this->socket = socket;
+    }
+
+    virtual int read(uint8_t* buffer, int length) {
+        return throw_unless(recv(socket, buffer, length, 0));
+    }
+
+    virtual void write(const uint8_t* buffer, int length) {
+        while(length > 0) {
+            int bytes_sent = throw_unless(send(socket, buffer, length, MSG_NOSIGNAL));
+            length -= bytes_sent;
+            buffer += bytes_sent;
+        }
+    }
+};
+
+// Creates a file of `size` bytes at `path`, filled with data that does not compress.
+void create_test_file(const std::string& path, uint64_t size) {
+    int fd = throw_unless(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    std::vector<uint8_t> chunk(1024 * 1024);
+    uint64_t state = 0x9E3779B97F4A7C15;
+    for(uint8_t& byte : chunk) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        byte = (uint8_t) state;
+    }
+
+    uint64_t written = 0;
+    while(written < size) {
+        size_t len = std::min<uint64_t>(chunk.size(), size - written);
+        written += throw_unless(::write(fd, chunk.data(), len));
+    }
+    close(fd);
+}
+
+// Accepts a single connection on `server_sock` and handles its requests until it is closed.
+void serve_one_client(int server_sock) {
+    try
+    {
+        int client_sock = throw_unless(accept(server_sock, nullptr, nullptr));
+        ClientHandler handler(client_sock);
+        handler.handle_messages();
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "Daemon side failed: " << e.what() << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    signal(SIGPIPE, SIG_IGN);
+
+    uint64_t file_size = (argc > 1 ? std::stoull(argv[1]) : 256) * 1024 * 1024;
+    uint32_t read_len = (argc > 2 ? std::stoul(argv[2]) : 1024) * 1024;
+    int passes = argc > 3 ? std::stoi(argv[3]) : 4;
+
+    std::string file_path = "/tmp/nandroid_read_bench.dat";
+    create_test_file(file_path, file_size);
+
+    // Listen on an ephemeral loopback port, so the benchmark can run alongside a real daemon.
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = 0;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int server_sock = throw_unless(socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+    throw_unless(bind(server_sock, (sockaddr*) &addr, sizeof(addr)));
+    throw_unless(listen(server_sock, 1));
+    socklen_t addr_len = sizeof(addr);
+    throw_unless(getsockname(server_sock, (sockaddr*) &addr, &addr_len));
+    std::thread daemon_thread(serve_one_client, server_sock);
+
+    int client_sock = throw_unless(socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+    throw_unless(connect(client_sock, (sockaddr*) &addr, sizeof(addr)));
+    int no_delay = 1;
+    setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    SocketStream stream(client_sock);
+    DataReader reader(&stream, BUFFER_SIZE);
+    DataWriter writer(&stream, BUFFER_SIZE);
+
+    // Handshake, without compression or change notifications, so that only the path the data takes is measured.
+    writer.write_u32(0x1234);
+    writer.write_byte(0);
+    writer.flush();
+    reader.read_u32();
+    reader.read_byte();
+
+    REQUEST_ID next_id = 0;
+    writer.write_byte((uint8_t) RequestType::OpenHandle);
+    writer.write_u32(next_id++);
+    OpenHandleArgs(file_path, OpenMode::OpenOnly, true, false, AccessHint::Normal).write(writer);
+    writer.flush();
+    reader.read_u32();
+    ResponseStatus status = (ResponseStatus) reader.read_byte();
+    if(status != ResponseStatus::Success) {
+        std::cerr << "Failed to open test file: " << (int) status << std::endl;
+        return 1;
+    }
+    FILE_HANDLE handle = reader.read_u32();
+    reader.read_byte();
+    FileStat stat(reader);
+
+    std::vector<uint8_t> buffer(read_len);
+    // The first pass reads the file into the page cache, so that every pass after it measures the same thing.
+    for(int pass = 0; pass <= passes; pass++) {
+        auto start = std::chrono::steady_clock::now();
+        for(uint64_t offset = 0; offset < file_size; offset += read_len) {
+            writer.write_byte((uint8_t) RequestType::ReadHandle);
+            writer.write_u32(next_id++);
+            ReadHandleArgs(handle, read_len, offset).write(writer);
+            writer.flush();
+
+            reader.read_u32();
+            status = (ResponseStatus) reader.read_byte();
+            if(status != ResponseStatus::Success) {
+                std::cerr << "Read failed: " << (int) status << std::endl;
+                return 1;
+            }
+            uint32_t data_len = reader.read_u32();
+            reader.read_exact(buffer.data(), data_len);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        if(pass > 0) {
+            std::cout << "pass " << pass << ": " << (file_size / (1024.0 * 1024.0)) / elapsed.count() << " MiB/s" << std::endl;
+        }
+    }
+
+    close(client_sock);
+    daemon_thread.join();
+    close(server_sock);
+    unlink(file_path.c_str());
+}
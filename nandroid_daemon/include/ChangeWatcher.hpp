@@ -0,0 +1,61 @@
+#pragma once
+
+#include "requests.hpp"
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace nandroidfs {
+    // Watches the directories that a client has listed with inotify, and reports changes to their entries so that the client
+    // can keep its cached stats and listings until they change.
+    class ChangeWatcher {
+    public:
+        // `on_change` is called with each change, either on the watcher's own thread or on a thread calling `watch`.
+        // It is called with the watcher locked, so that changes to whether a directory is watched are reported in the order they happen,
+        // and so must not call `watch` itself.
+        // Throws a UnixException if inotify is unavailable.
+        ChangeWatcher(std::function<void(ChangeKind kind, const std::string& path)> on_change);
+        ~ChangeWatcher();
+
+        // Starts watching the entries of the directory at `path`, unless it is already watched.
+        // If the directory was not already watched, `on_change` is called with ChangeKind::Watching before this returns.
+        // If too many directories are watched, the one that was least recently passed to `watch` stops being watched first.
+        // Nothing is reported if the directory cannot be watched.
+        void watch(const std::string& path);
+    private:
+        struct Watch {
+            std::string path;
+            // The position of the watch in `watch_order`.
+            std::list<int>::iterator order_it;
+        };
+
+        std::function<void(ChangeKind kind, const std::string& path)> on_change;
+        int inotify_fd;
+        // Written to in order to stop the watcher thread.
+        int stop_fd;
+        std::thread thread;
+
+        // Protects the following state.
+        std::mutex mutex;
+        std::unordered_map<int, Watch> watches;
+        std::unordered_map<std::string, int> watches_by_path;
+        // The descriptors of the watches, from the least to the most recently passed to `watch`.
+        std::list<int> watch_order;
+        // Set if reading events failed, after which no directories are watched.
+        bool failed = false;
+
+        // Stops watching the directory that was least recently passed to `watch`, and reports that it is no longer watched.
+        // Returns false if no directories are watched. Does not lock `mutex`, caller must lock.
+        bool remove_oldest_watch();
+        // Forgets a watch that inotify has already removed, and reports that its directory is no longer watched.
+        // Does not lock `mutex`, caller must lock.
+        void forget_watch(int wd);
+        // Reads the events that inotify has queued and reports them with `on_change`.
+        void read_events();
+        // Entry point for the thread that waits for inotify events.
+        void thread_entry_point();
+    };
+}
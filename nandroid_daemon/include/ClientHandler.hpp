@@ -1,45 +1,163 @@
 #pragma once
 
 #include "serialization.hpp"
+#include "requests.hpp"
+#include "responses.hpp"
+#include "ChangeWatcher.hpp"
 #include <vector>
+#include <memory>
+#include <deque>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <variant>
+#include <sys/stat.h>
 
 namespace nandroidfs {
+    // A request received from the client, which is waiting for or being handled by a worker thread.
+    struct RequestContext {
+        REQUEST_ID id;
+        RequestType type;
+        // Whether the arguments of the request have been fully read from the socket.
+        // Once they have, the reader is handed over to the next request.
+        bool args_read = false;
+    };
+
     class ClientHandler : Readable, Writable {
     private:
         int socket;
         DataReader reader;
         DataWriter writer;
-        // All data read from a file is temporarily stored in this buffer.
-        // We need to read into a buffer first so that we know the length of the data read, which needs to be supplied before the response.
-        // Data read from the socket to be written to a file is also saved here.
-        // This could be skipped to avoid a buffering step - TODO
-        std::vector<uint8_t> rw_buffer;
+        // Whether file data and directory listings are compressed, which is negotiated in the handshake.
+        bool compression_enabled = false;
+        // Watches the directories that the client lists, if change notifications were negotiated in the handshake.
+        std::unique_ptr<ChangeWatcher> change_watcher;
+
+        // Only one request can read its arguments from the socket at a time.
+        // `reader_busy` is set while a worker is reading the arguments of a request, and the next request header
+        // is not read until the worker has finished.
+        std::mutex reader_mutex;
+        std::condition_variable reader_released;
+        bool reader_busy = false;
+        // Set if a worker failed while reading the arguments of a request.
+        // We can no longer tell where the next request starts, so the connection must be dropped.
+        bool reader_failed = false;
 
-        // Ensures that the read/write buffer length is at least the specified length (in bytes)
-        void ensure_rw_buffer_size(size_t size);
+        // Handles opened with an AccessHint that requires their pages to be dropped from the page cache once they are closed.
+        std::unordered_set<int> drop_on_close;
+        std::mutex drop_on_close_mutex;
+
+        // Held while writing a response, so that the responses to concurrent requests are never interleaved.
+        std::mutex writer_mutex;
+
+        // Requests that have been received but not yet picked up by a worker thread.
+        std::deque<RequestContext> request_queue;
+        std::mutex queue_mutex;
+        std::condition_variable queue_cv;
+        bool stopping = false;
+        std::vector<std::thread> workers;
 
         virtual int read(uint8_t* buffer, int length);
         virtual void write(const uint8_t* buffer, int length);
 
-        void handle_open_handle();
-        void handle_create_directory();
-        void handle_list_dir_stats();
-        void handle_move_entry();
-        void handle_check_remove_file();
-        void handle_check_remove_directory();
-        void handle_remove_file();
-        void handle_remove_directory();
-        void handle_read_file();
-        void handle_write_file();
-        void handle_truncate_file();
-        void handle_set_file_time();
-        void handle_get_disk_stats();
+        // Entry point for each worker thread. Handles requests from the queue until the handler is stopped.
+        void worker_entry_point();
+        void handle_request(RequestContext& ctx);
+
+        // Indicates that all of the arguments for the given request have been read,
+        // which allows the next request to be read from the socket.
+        // Does nothing if this has already been called for the request.
+        void finish_reading(RequestContext& ctx);
+        // Writes the response to the given request.
+        // `write_body` is invoked with exclusive access to `writer` after the request ID has been written,
+        // and the response is flushed once it returns.
+        template<typename F>
+        void respond(RequestContext& ctx, F write_body);
+        // Writes a Success response with a body written by `write_body`, which is invoked with the DataWriter to write the body to.
+        // If compression is enabled, the body is preceded by its length (uint32_t) and compressed.
+        template<typename F>
+        void respond_compressible(RequestContext& ctx, F write_body);
+        // Writes a response that consists of only the given status.
+        void respond_status(RequestContext& ctx, ResponseStatus status);
+        // Sends a change notification to the client. (see CHANGE_NOTIFICATION_ID)
+        void send_change(ChangeKind kind, const std::string& path);
+
+        // Sends `length` bytes of the file with descriptor `fd`, starting at `offset`, straight to the socket.
+        // The data is sent with `sendfile` where possible so that it is never copied into userspace.
+        // If the file is truncated while sending, the missing data is sent as zeros so the client still receives `length` bytes.
+        // `writer` must be flushed first.
+        void send_file_data(int fd, uint64_t offset, uint32_t length);
+        // Sends `length` bytes of the file with descriptor `fd`, starting at `offset`, as compressed blocks.
+        // Switches to sending the data raw with `send_file_data` if it does not compress.
+        void send_file_data_compressed(int fd, uint64_t offset, uint32_t length);
+
+        // Reads `length` bytes of data from the socket and writes them to the file with descriptor `fd`, starting at `offset`.
+        // The data is moved with `splice` where possible so that it is never copied into userspace.
+        // All `length` bytes are always read from the socket, even if writing to the file fails.
+        // Returns the status of the first failed write, or Success.
+        ResponseStatus receive_file_data(int fd, uint64_t offset, uint32_t length);
+        // Reads `length` bytes of compressed data from the socket and writes them to the file with descriptor `fd`, starting at `offset`.
+        // Raw blocks are passed to `receive_file_data`.
+        ResponseStatus receive_file_data_compressed(int fd, uint64_t offset, uint32_t length);
+        // Reads the data of a WriteHandle request with the given arguments from the socket and writes it to the file.
+        ResponseStatus receive_write(const WriteHandleInitArgs& args);
+
+        // Opens a handle as for an OpenHandle request.
+        // If successful, `out_fd` is set to the handle, `out_existed` to whether the file existed before it was opened
+        // and `out_stat` to the stat of the opened file.
+        ResponseStatus open_handle(const OpenHandleArgs& args, int& out_fd, bool& out_existed, struct stat& out_stat);
+        // Closes a handle opened with `open_handle`, dropping its pages from the page cache if its AccessHint requires it.
+        void close_handle(int fd);
+
+        // A step of a Compound request. Every step is read before any are run, so that the reader is not held while they run.
+        struct CompoundStep {
+            RequestType type;
+            bool continue_on_failure;
+            // The arguments of the step. Steps that only take a path have a std::string, and CloseHandle steps have a FILE_HANDLE.
+            std::variant<std::string, FILE_HANDLE, OpenHandleArgs, MoveEntryArgs, SetFileTimeArgs, TruncateHandleArgs, WriteHandleInitArgs> args;
+            // The data of a WriteHandle step.
+            std::vector<uint8_t> data;
+        };
+
+        // Reads the step of a Compound request with index `index`, including the data of a WriteHandle step.
+        CompoundStep read_compound_step(uint16_t index);
+        // Runs a step of a Compound request, and writes the status of the step and the rest of its response to `results`.
+        // The handle opened by the step, or -1 if it did not open one, is added to `opened_fds`, which holds the handles opened by earlier steps.
+        ResponseStatus run_compound_step(const CompoundStep& step, std::vector<int>& opened_fds, DataWriter& results);
+
+        void handle_stat_file(RequestContext& ctx);
+        void handle_stat_many(RequestContext& ctx);
+        void handle_open_handle(RequestContext& ctx);
+        void handle_close_handle(RequestContext& ctx);
+        void handle_create_directory(RequestContext& ctx);
+        void handle_list_dir_stats(RequestContext& ctx);
+        void handle_list_tree(RequestContext& ctx);
+        void handle_move_entry(RequestContext& ctx);
+        void handle_copy_entry(RequestContext& ctx);
+        void handle_check_remove_file(RequestContext& ctx);
+        void handle_check_remove_directory(RequestContext& ctx);
+        void handle_remove_file(RequestContext& ctx);
+        void handle_remove_directory(RequestContext& ctx);
+        void handle_remove_tree(RequestContext& ctx);
+        void handle_hash_range(RequestContext& ctx);
+        void handle_get_block_checksums(RequestContext& ctx);
+        void handle_write_delta(RequestContext& ctx);
+        void handle_read_file(RequestContext& ctx);
+        void handle_read_file_v(RequestContext& ctx);
+        void handle_write_file(RequestContext& ctx);
+        void handle_truncate_file(RequestContext& ctx);
+        void handle_set_file_time(RequestContext& ctx);
+        void handle_get_disk_stats(RequestContext& ctx);
+        void handle_compound(RequestContext& ctx);
     public:
         // Carries out a handshake to ensure the connection is working.
         ClientHandler(int socket);
+        // Waits for any requests still being handled, then closes the socket.
         ~ClientHandler();
 
-        // Continually handles messages and sends responses through the socket until EOF on read is reached.
+        // Continually reads requests until EOF on read is reached.
+        // Each request is handled on a pool of worker threads, so responses may be sent in a different order to the requests.
         void handle_messages();
     };
-}
\ No newline at end of file
+}
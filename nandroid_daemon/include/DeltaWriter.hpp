@@ -0,0 +1,70 @@
+#pragma once
+
+#include "responses.hpp"
+#include "delta.hpp"
+#include "hash_functions.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nandroidfs {
+    // Chooses a block size for the file at `path` and calculates the checksums of each whole block of it for a delta write.
+    ResponseStatus get_block_checksums(const std::string& path,
+        uint64_t& out_file_size,
+        uint32_t& out_block_size,
+        std::vector<BlockChecksum>& out_blocks);
+
+    // Builds the new contents of a file from blocks of the existing file and literal data, then replaces the existing file with them.
+    // The new contents are written to a uniquely named temporary file in the same directory, which is removed if the DeltaWriter is destroyed
+    // before `finish` succeeds. Temporary files left behind by delta writes that never finished are removed when the next one starts in the directory.
+    // Since the existing file is replaced by renaming the temporary file over it, the new file is owned by the daemon and is not linked
+    // to any other hard links of the existing file.
+    // Literal data is written to its place in the temporary file as it is received, while the blocks copied from the existing file
+    // are only recorded, and copied by `finish`, so that the request can be read without waiting for the existing file to be read.
+    // Once an op fails, the rest are ignored, so that the remainder of the request can still be read.
+    class DeltaWriter {
+    public:
+        DeltaWriter(const std::string& path, uint32_t block_size);
+        ~DeltaWriter();
+
+        // Adds `count` blocks from the existing file to the end of the new contents, starting with block `first_block`.
+        void copy_blocks(uint32_t first_block, uint32_t count);
+        // Adds `length` bytes of literal data to the end of the new contents.
+        // The caller must write the data to the file with descriptor `out_fd` at the returned offset, then pass the status to `literal_written`.
+        // If an op has already failed, `out_fd` is set to -1, so that writing the data fails without affecting any file.
+        uint64_t add_literal(uint32_t length, int& out_fd);
+        // Records the status of writing the data of the last literal.
+        void literal_written(ResponseStatus write_status);
+        // Copies the blocks from the existing file, and checks that the XXH3 hash of the new contents is `expected_hash`.
+        // If so, moves the new contents over the existing file.
+        // Returns the status of the first op that failed, or GenericFailure if the hash does not match.
+        ResponseStatus finish(uint64_t expected_hash);
+    private:
+        // A run of the new contents that comes from the same place.
+        struct Segment {
+            // Whether the run is copied from the existing file, rather than being literal data.
+            bool is_copy;
+            // The offset of the run within the new contents.
+            uint64_t offset;
+            uint64_t length;
+            // The offset of the run within the existing file, if it is copied.
+            uint64_t source_offset;
+        };
+
+        std::string path;
+        std::string temp_path;
+        uint32_t block_size;
+        int existing_fd = -1;
+        int temp_fd = -1;
+        uint64_t existing_size = 0;
+        // The length of the new contents so far.
+        uint64_t new_size = 0;
+        // The status of the first op that failed, or Success.
+        ResponseStatus status = ResponseStatus::Success;
+        std::vector<Segment> segments;
+        std::vector<uint8_t> copy_buffer;
+
+        // Adds a segment to the end of the new contents, combining it with the last segment where possible.
+        void add_segment(bool is_copy, uint64_t length, uint64_t source_offset);
+    };
+}
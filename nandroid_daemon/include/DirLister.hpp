@@ -0,0 +1,55 @@
+#pragma once
+
+#include "responses.hpp"
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+namespace nandroidfs {
+    // An entry in a directory, along with the result of statting it.
+    struct DirEntryStat {
+        ResponseStatus status;
+        std::string name;
+        // Only valid if `status` is Success.
+        FileStat stat;
+        // Whether the entry is a symbolic link. `stat` is that of the file it links to.
+        bool is_symlink;
+    };
+
+    // The entries in one of the directories within a tree.
+    struct TreeDirListing {
+        // The path of the directory relative to the root of the tree, or empty for the root itself.
+        std::string relative_path;
+        std::vector<DirEntryStat> entries;
+    };
+
+    // The result of removing a tree with `remove_tree`.
+    struct RemoveTreeResult {
+        // The status of the first entry that could not be removed, or Success.
+        ResponseStatus status = ResponseStatus::Success;
+        uint32_t files_removed = 0;
+        uint32_t directories_removed = 0;
+    };
+
+    // Converts the result of `stat` into the FileStat sent to the client.
+    FileStat to_file_stat(const struct stat& posix_stat);
+
+    // Lists the entries in the directory at `path` and stats each of them, adding them to `out_entries`.
+    // Returns the status of opening the directory, which is Success even if some of the entries could not be statted.
+    //
+    // Entries are read in bulk with `getdents64`, and each is statted relative to the directory rather than by its full path,
+    // so the kernel does not need to resolve the whole path again for every entry.
+    ResponseStatus list_directory(const char* path, std::vector<DirEntryStat>& out_entries);
+
+    // Lists every directory in the tree under `root_path`, adding each to `out_listings`, using a pool of threads.
+    // Directories more than `max_depth` below the root are not listed, and symbolic links to directories are not followed.
+    // Listing stops before the total number of entries would exceed `max_entries`, in which case `out_truncated` is set to true.
+    // Returns the status of listing the root directory. Other directories that cannot be listed are skipped.
+    ResponseStatus list_tree(const std::string& root_path, uint16_t max_depth, uint32_t max_entries,
+        std::vector<TreeDirListing>& out_listings, bool& out_truncated);
+
+    // Removes the file or directory at `path`, including everything within it.
+    // The tree is removed depth first, with each entry removed relative to its directory with `unlinkat`.
+    // Symbolic links are removed rather than followed. Entries that cannot be removed are skipped.
+    RemoveTreeResult remove_tree(const std::string& path);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "responses.hpp"
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace nandroidfs {
+    // Called while copying with the number of bytes of file data copied so far,
+    // and the number of files, directories and symbolic links that have been fully copied so far.
+    // The total is not known in advance, since that would mean walking the whole tree before copying it.
+    typedef std::function<void(uint64_t bytes_copied, uint64_t entries_copied)> CopyProgressCallback;
+
+    // Copies the file, directory or symbolic link at `from_path` to `to_path`, including everything within a directory.
+    // If `to_path` already exists, this fails with FileExists unless `replace_if_exists` is true,
+    // in which case existing files are overwritten and existing directories are copied into.
+    // File data is copied within the kernel with `copy_file_range` where possible, so it never passes through userspace.
+    // The access and write times of each file and directory are kept.
+    // `report_progress` is called at most every COPY_PROGRESS_INTERVAL while copying.
+    // Copying stops at the first failure, and the status of the failure is returned.
+    // `out_bytes_copied` is set to the number of bytes of file data copied.
+    ResponseStatus copy_entry(const std::string& from_path,
+        const std::string& to_path,
+        bool replace_if_exists,
+        CopyProgressCallback report_progress,
+        uint64_t& out_bytes_copied);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "requests.hpp"
+#include "responses.hpp"
+#include "hash_functions.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nandroidfs {
+    // Hashes the range of `length` bytes at `offset` in the file at `path` with the given algorithm.
+    // The range is cut short at the end of the file. (see RequestType::HashRange for how each algorithm is used)
+    // `out_digest` is set to the hash, and `out_bytes_hashed` to the length of the range after it was cut short.
+    ResponseStatus hash_file_range(const std::string& path,
+        uint64_t offset,
+        uint64_t length,
+        HashAlgorithm algorithm,
+        std::vector<uint8_t>& out_digest,
+        uint64_t& out_bytes_hashed);
+}
@@ -3,6 +3,7 @@
 #include <stdexcept>
 #include <errno.h>
 #include <string.h>
+#include "responses.hpp"
 
 namespace nandroidfs {
     // Exception used to wrap errors returned by unix socket APIs
@@ -21,4 +22,7 @@ namespace nandroidfs {
     // Otherwise, this will return `return_val`
     // Useful to wrap the result of a unix API call and turn it into an std::exception
     int throw_unless(int return_val);
+
+    // Gets the ResponseStatus that best represents the current value of `errno`.
+    ResponseStatus get_status_from_errno();
 }
@@ -0,0 +1,188 @@
+#include "ChangeWatcher.hpp"
+#include "UnixException.hpp"
+#include "path_utils.hpp"
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <chrono>
+#include <iostream>
+#include <unordered_set>
+#include <vector>
+
+namespace nandroidfs {
+    // The maximum number of directories watched for each client.
+    // Each connection has its own watcher, and the system limit on the number of watches is usually 8192 or more.
+    const size_t MAX_WATCHED_DIRECTORIES = 1024;
+    const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO
+        | IN_MOVE_SELF | IN_ONLYDIR;
+    // Once an event arrives, the watcher waits this long before reading the events, so that a burst of events,
+    // e.g. one for each write to a file being copied, is reported once.
+    const auto CHANGE_BATCH_DELAY = std::chrono::milliseconds(50);
+    const size_t EVENT_BUFFER_SIZE = 64 * 1024;
+
+    ChangeWatcher::ChangeWatcher(std::function<void(ChangeKind kind, const std::string& path)> on_change) {
+        this->on_change = on_change;
+        inotify_fd = throw_unless(inotify_init1(IN_CLOEXEC | IN_NONBLOCK));
+        stop_fd = eventfd(0, EFD_CLOEXEC);
+        if(stop_fd == -1) {
+            int err_num = errno;
+            close(inotify_fd);
+            throw UnixException(err_num);
+        }
+
+        thread = std::thread(&ChangeWatcher::thread_entry_point, this);
+    }
+
+    ChangeWatcher::~ChangeWatcher() {
+        uint64_t stop = 1;
+        write(stop_fd, &stop, sizeof(stop));
+        thread.join();
+
+        close(stop_fd);
+        close(inotify_fd);
+    }
+
+    void ChangeWatcher::watch(const std::string& path) {
+        std::lock_guard lock(mutex);
+        if(failed) {
+            return;
+        }
+
+        auto existing = watches_by_path.find(path);
+        if(existing != watches_by_path.end()) {
+            Watch& watch = watches[existing->second];
+            watch_order.splice(watch_order.end(), watch_order, watch.order_it);
+            return;
+        }
+
+        if(watches.size() >= MAX_WATCHED_DIRECTORIES) {
+            remove_oldest_watch();
+        }
+
+        int wd = inotify_add_watch(inotify_fd, path.c_str(), WATCH_MASK);
+        // The system limit may be lower than MAX_WATCHED_DIRECTORIES, or be shared with other processes.
+        while(wd == -1 && errno == ENOSPC && remove_oldest_watch()) {
+            wd = inotify_add_watch(inotify_fd, path.c_str(), WATCH_MASK);
+        }
+        if(wd == -1 || watches.contains(wd)) {
+            // The same directory may already be watched through a different path, in which case inotify gives the existing watch.
+            // Only the path it was first watched with is reported.
+            return;
+        }
+
+        watch_order.push_back(wd);
+        watches[wd] = Watch { path, std::prev(watch_order.end()) };
+        watches_by_path[path] = wd;
+        on_change(ChangeKind::Watching, path);
+    }
+
+    bool ChangeWatcher::remove_oldest_watch() {
+        if(watch_order.empty()) {
+            return false;
+        }
+
+        int wd = watch_order.front();
+        inotify_rm_watch(inotify_fd, wd);
+        // Forgetting the watch now means that the IN_IGNORED event inotify gives for it is not reported again.
+        forget_watch(wd);
+        return true;
+    }
+
+    void ChangeWatcher::forget_watch(int wd) {
+        auto watch = watches.find(wd);
+        if(watch == watches.end()) {
+            return;
+        }
+
+        std::string path = std::move(watch->second.path);
+        watch_order.erase(watch->second.order_it);
+        watches_by_path.erase(path);
+        watches.erase(watch);
+        on_change(ChangeKind::Unwatched, path);
+    }
+
+    void ChangeWatcher::read_events() {
+        alignas(inotify_event) uint8_t buffer[EVENT_BUFFER_SIZE];
+        // The same change is often reported by several events, e.g. IN_MODIFY for each write, so each change is only reported once.
+        std::unordered_set<std::string> reported[2];
+
+        while(true) {
+            ssize_t read_len = read(inotify_fd, buffer, EVENT_BUFFER_SIZE);
+            if(read_len == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }   else if(errno != EAGAIN)    {
+                    throw UnixException(errno);
+                }
+                return;
+            }
+
+            std::lock_guard lock(mutex);
+            for(ssize_t offset = 0; offset < read_len;) {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                offset += sizeof(inotify_event) + event->len;
+
+                if(event->mask & IN_Q_OVERFLOW) {
+                    on_change(ChangeKind::Overflow, "");
+                    continue;
+                }   else if(event->mask & (IN_IGNORED | IN_MOVE_SELF))   {
+                    // The directory was removed or moved, so its watch no longer matches its path.
+                    if(event->mask & IN_MOVE_SELF) {
+                        inotify_rm_watch(inotify_fd, event->wd);
+                    }
+                    forget_watch(event->wd);
+                    continue;
+                }
+
+                auto watch = watches.find(event->wd);
+                if(watch == watches.end() || event->len == 0) {
+                    continue;
+                }
+
+                // A directory that is removed or moved takes all of the entries within it along with it.
+                bool tree_changed = (event->mask & IN_ISDIR) && (event->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO));
+                ChangeKind kind = tree_changed ? ChangeKind::TreeChanged : ChangeKind::EntryChanged;
+                std::string path = get_full_path(watch->second.path, event->name);
+                if(reported[tree_changed].insert(path).second) {
+                    on_change(kind, path);
+                }
+            }
+        }
+    }
+
+    void ChangeWatcher::thread_entry_point() {
+        pollfd fds[2];
+        fds[0].fd = inotify_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = stop_fd;
+        fds[1].events = POLLIN;
+
+        try
+        {
+            while(true) {
+                if(poll(fds, 2, -1) == -1) {
+                    if(errno == EINTR) {
+                        continue;
+                    }
+                    throw UnixException(errno);
+                }
+
+                if(fds[1].revents & POLLIN) {
+                    return;
+                }   else if(fds[0].revents & POLLIN)    {
+                    std::this_thread::sleep_for(CHANGE_BATCH_DELAY);
+                    read_events();
+                }
+            }
+        }
+        catch(const std::exception& e)
+        {
+            // Changes can no longer be reported, so the client cannot rely on anything it has cached.
+            std::cerr << "Failed to read inotify events: " << e.what() << std::endl;
+            std::lock_guard lock(mutex);
+            failed = true;
+            while(remove_oldest_watch()) { }
+        }
+    }
+}
@@ -3,11 +3,19 @@
 #include "requests.hpp"
 #include "responses.hpp"
 #include "path_utils.hpp"
+#include "compression.hpp"
+#include "DirLister.hpp"
+#include "FileCopier.hpp"
+#include "Hashing.hpp"
+#include "DeltaWriter.hpp"
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/statvfs.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <stdexcept>
@@ -15,6 +23,7 @@
 #include <iostream>
 #include <string>
 #include <stdio.h>
+#include <algorithm>
 
 namespace nandroidfs {
     // Buffer size for the DataWriter and DataReader.
@@ -25,6 +34,80 @@ namespace nandroidfs {
     // i.e. the GetDiskStats RequestType will find the filesystem containing this file, and then
     // check how much free space there is *within that filesystem*.
     const char* FREE_SPACE_FS_PATH = "/sdcard/";
+    // Number of threads used to handle requests from each client.
+    const int WORKER_COUNT = 8;
+    // Reads shorter than this are read into a buffer rather than sent directly from the file with `sendfile`
+    // since the extra syscalls are not worth it to avoid copying a small amount of data.
+    // Defining NANDROID_NO_ZERO_COPY reads everything into a buffer, which the benchmark in bench/ compares against.
+#ifdef NANDROID_NO_ZERO_COPY
+    const uint32_t ZERO_COPY_MIN_READ_LEN = UINT32_MAX;
+#else
+    const uint32_t ZERO_COPY_MIN_READ_LEN = 16384;
+#endif
+    // Size of the chunks copied through a buffer when data cannot be moved directly between a file and the socket.
+    const uint32_t COPY_CHUNK_SIZE = 1048576;
+    // The read/write buffer of each worker thread is freed after a request that grows it beyond this. (see release_oversized_rw_buffer)
+    // No more than a chunk of this size is copied through the buffer at once, so most requests never need more.
+    const size_t MAX_KEPT_RW_BUFFER_SIZE = COPY_CHUNK_SIZE;
+    // ReadHandleV requests for more than this in total are sent straight from the file, rather than read into the buffer first.
+    const uint64_t MAX_BUFFERED_READ_V_LEN = COPY_CHUNK_SIZE;
+    // Size requested for the pipe used to splice data from the socket into a file.
+    const int SPLICE_PIPE_SIZE = 1048576;
+    // The protocol features that the daemon is able to use, if the client supports them.
+    const uint8_t SUPPORTED_FEATURES = FEATURE_COMPRESSION | FEATURE_CHANGE_NOTIFICATIONS;
+    // When sending compressed file data, once this many consecutive blocks have not compressed,
+    // the rest of the data is sent raw with `sendfile`.
+    const int MAX_INCOMPRESSIBLE_BLOCKS = 2;
+
+    // Data read from a file is temporarily stored in this buffer for small reads.
+    // We need to read into a buffer first so that we know the length of the data read, which needs to be supplied before the response.
+    // It is also used when data cannot be moved directly between a file and the socket.
+    // Each worker thread has its own buffer so that requests can be handled concurrently.
+    thread_local std::vector<uint8_t> rw_buffer;
+
+    // Ensures that the read/write buffer length is at least the specified length (in bytes)
+    void ensure_rw_buffer_size(size_t size) {
+        if(size > rw_buffer.size()) {
+            rw_buffer.resize(size);
+        }
+    }
+
+    // Frees the read/write buffer if a request has grown it beyond MAX_KEPT_RW_BUFFER_SIZE,
+    // so that a few large requests do not leave every worker thread holding on to a large buffer.
+    void release_oversized_rw_buffer() {
+        if(rw_buffer.size() > MAX_KEPT_RW_BUFFER_SIZE) {
+            std::vector<uint8_t>().swap(rw_buffer);
+        }
+    }
+
+    // A pipe used to splice data from the socket into a file.
+    // Created the first time each worker thread handles a write, and closed when the thread exits.
+    struct SplicePipe {
+        int read_fd = -1;
+        int write_fd = -1;
+
+        // Creates the pipe if it does not exist yet.
+        void ensure_open() {
+            if(read_fd != -1) {
+                return;
+            }
+
+            int fds[2];
+            throw_unless(pipe(fds));
+            read_fd = fds[0];
+            write_fd = fds[1];
+            // A larger pipe means fewer splice calls per write. If this fails, the default size still works.
+            fcntl(write_fd, F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+        }
+
+        ~SplicePipe() {
+            if(read_fd != -1) {
+                close(read_fd);
+                close(write_fd);
+            }
+        }
+    };
+    thread_local SplicePipe splice_pipe;
 
     ClientHandler::ClientHandler(int socket) : reader(DataReader(this, BUFFER_SIZE)), writer(DataWriter(this, BUFFER_SIZE)) {
         this->socket = socket;
@@ -32,11 +115,45 @@ namespace nandroidfs {
         // Basic handshake, echo some bytes back to the client to ensure we have 2-way communication
         uint32_t handshake_bytes = reader.read_u32();
         writer.write_u32(handshake_bytes);
+
+        // Use each of the optional features that both we and the client support.
+        uint8_t features = reader.read_byte() & SUPPORTED_FEATURES;
+        compression_enabled = (features & FEATURE_COMPRESSION) != 0;
+        if(features & FEATURE_CHANGE_NOTIFICATIONS) {
+            try
+            {
+                change_watcher = std::make_unique<ChangeWatcher>([this](ChangeKind kind, const std::string& path) {
+                    send_change(kind, path);
+                });
+            }
+            catch(const std::exception& e)
+            {
+                std::cerr << "Change notifications are unavailable: " << e.what() << std::endl;
+                features &= ~FEATURE_CHANGE_NOTIFICATIONS;
+            }
+        }
+        writer.write_byte(features);
         writer.flush();
         std::cout << "Handshake complete" << std::endl;
+
+        for(int i = 0; i < WORKER_COUNT; i++) {
+            workers.push_back(std::thread(&ClientHandler::worker_entry_point, this));
+        }
     }
 
     ClientHandler::~ClientHandler() {
+        {
+            std::lock_guard lock(queue_mutex);
+            stopping = true;
+        }
+        queue_cv.notify_all();
+
+        for(std::thread& worker : workers) {
+            worker.join();
+        }
+
+        // The watcher sends notifications to the socket, so must be stopped before the socket is closed.
+        change_watcher.reset();
         close(socket);
     }
 
@@ -47,140 +164,375 @@ namespace nandroidfs {
     void ClientHandler::write(const uint8_t* buffer, int length) {
         // Continue writing until all of the bytes provided have definitely been written.
         while(length > 0) {
-            int bytes_sent = throw_unless(send(socket, buffer, length, 0));
+            int bytes_sent = throw_unless(send(socket, buffer, length, MSG_NOSIGNAL));
 
             length -= bytes_sent;
             buffer += bytes_sent;
         }
     }
 
-    ResponseStatus get_status_from_errno() {
-        int err_num = errno;
-        switch(err_num) {
-            case EACCES:
-                return ResponseStatus::AccessDenied;
-            case ENOENT:
-                return ResponseStatus::FileNotFound;
-            case EEXIST:
-                return ResponseStatus::FileExists;
-            case ENOTDIR:
-                return ResponseStatus::NotADirectory;
-            case EISDIR:
-                return ResponseStatus::NotAFile;
-            case ENOTEMPTY:
-                return ResponseStatus::DirectoryNotEmpty;
-            default:
-                return ResponseStatus::GenericFailure;
-        }
-    }
-
     ResponseStatus stat_file(const char* path, FileStat* out_stat) {
         struct stat posix_stat;
         if(stat(path, &posix_stat) == -1) {
             return get_status_from_errno();
         }   else    {
-            FileStat result(posix_stat.st_mode,
-                posix_stat.st_size,
-                posix_stat.st_atime,
-                posix_stat.st_mtime);
-            *out_stat = result;
-
+            *out_stat = to_file_stat(posix_stat);
             return ResponseStatus::Success;
         }
     }
 
-    void ClientHandler::ensure_rw_buffer_size(size_t size) {
-        if(size > rw_buffer.size()) {
-            rw_buffer.resize(size);
+    void ClientHandler::finish_reading(RequestContext& ctx) {
+        if(ctx.args_read) {
+            return;
+        }
+
+        ctx.args_read = true;
+        {
+            std::lock_guard lock(reader_mutex);
+            reader_busy = false;
         }
+        reader_released.notify_one();
     }
 
-    void ClientHandler::handle_list_dir_stats() {
-        std::string directory_path = reader.read_utf8_string();
+    template<typename F>
+    void ClientHandler::respond(RequestContext& ctx, F write_body) {
+        finish_reading(ctx);
 
-        DIR* dir = opendir(directory_path.c_str());
-        if(!dir) {
-            writer.write_byte((uint8_t) get_status_from_errno());
+        std::lock_guard lock(writer_mutex);
+        writer.write_u32(ctx.id);
+        write_body();
+        writer.flush();
+    }
+
+    void ClientHandler::respond_status(RequestContext& ctx, ResponseStatus status) {
+        respond(ctx, [&]() {
+            writer.write_byte((uint8_t) status);
+        });
+    }
+
+    void ClientHandler::send_change(ChangeKind kind, const std::string& path) {
+        std::lock_guard lock(writer_mutex);
+        try
+        {
+            writer.write_u32(CHANGE_NOTIFICATION_ID);
+            writer.write_byte((uint8_t) kind);
+            writer.write_utf8_string(path);
+            writer.flush();
+        }
+        catch(const std::exception& e)
+        {
+            // The notification may have been cut short, so the socket is no longer usable. (see worker_entry_point)
+            std::cerr << "Failed to send change notification: " << e.what() << std::endl;
+            shutdown(socket, SHUT_RDWR);
+        }
+    }
+
+    template<typename F>
+    void ClientHandler::respond_compressible(RequestContext& ctx, F write_body) {
+        if(!compression_enabled) {
+            respond(ctx, [&]() {
+                writer.write_byte((uint8_t) ResponseStatus::Success);
+                write_body(writer);
+            });
             return;
         }
 
-        // First indicate the request succeeded.
-        writer.write_byte((uint8_t) ResponseStatus::Success);
+        // The body needs to be written to memory first, since its length is sent before it.
+        MemoryWritable body;
+        {
+            DataWriter body_writer(&body, BUFFER_SIZE);
+            write_body(body_writer);
+            body_writer.flush();
+        }
+
+        respond(ctx, [&]() {
+            writer.write_byte((uint8_t) ResponseStatus::Success);
+            writer.write_u32(body.data.size());
+            write_compressed(writer, body.data.data(), body.data.size());
+        });
+    }
+
+    // Writes the given directory entries with a DirEntryWriter.
+    void write_dir_entries(DataWriter& writer, std::vector<DirEntryStat>& entries) {
+        // Sorting the entries means that similar names, e.g. photos taken on the same day, are next to each other,
+        // so more of each name can be shared with the previous name.
+        std::sort(entries.begin(), entries.end(), [](const DirEntryStat& a, const DirEntryStat& b) {
+            return a.name < b.name;
+        });
 
-        // Then write all the directory stats until a nullptr reached.
-        dirent* current_entry = readdir(dir);
-        while(current_entry) {
-            std::string full_entry_path = get_full_path(directory_path, current_entry->d_name);
+        DirEntryWriter dir_writer(writer);
+        for(DirEntryStat& entry : entries) {
+            if(entry.status == ResponseStatus::Success) {
+                dir_writer.write_entry(entry.name, entry.stat);
+            }   else    {
+                dir_writer.write_failed_entry(entry.status);
+            }
+        }
+
+        dir_writer.finish();
+    }
 
-            FileStat stat;
-            ResponseStatus status = stat_file(full_entry_path.c_str(), &stat);
+    void ClientHandler::handle_stat_file(RequestContext& ctx) {
+        std::string file_path = reader.read_utf8_string();
+        finish_reading(ctx);
 
-            
+        FileStat stat;
+        ResponseStatus status = stat_file(file_path.c_str(), &stat);
+        respond(ctx, [&]() {
+            writer.write_byte((uint8_t) status);
             if(status == ResponseStatus::Success) {
-                writer.write_byte((uint8_t) ResponseStatus::Success);
-                writer.write_utf8_string(std::string_view(current_entry->d_name));
                 stat.write(writer);
-            }   else    {
-                writer.write_byte((uint8_t) status);
             }
+        });
+    }
+
+    void ClientHandler::handle_stat_many(RequestContext& ctx) {
+        StatManyArgs args(reader);
+        finish_reading(ctx);
 
-            current_entry = readdir(dir);
+        std::vector<ResponseStatus> statuses(args.paths.size());
+        std::vector<FileStat> stats(args.paths.size());
+        for(size_t i = 0; i < args.paths.size(); i++) {
+            statuses[i] = stat_file(args.paths[i].c_str(), &stats[i]);
         }
 
-        // Indicate that this is the end of the entries list.
-        writer.write_byte((uint8_t) ResponseStatus::NoMoreEntries);
+        respond(ctx, [&]() {
+            writer.write_byte((uint8_t) ResponseStatus::Success);
+            for(size_t i = 0; i < args.paths.size(); i++) {
+                writer.write_byte((uint8_t) statuses[i]);
+                if(statuses[i] == ResponseStatus::Success) {
+                    stats[i].write(writer);
+                }
+            }
+        });
+    }
 
-        closedir(dir);
+    void ClientHandler::handle_list_dir_stats(RequestContext& ctx) {
+        std::string directory_path = reader.read_utf8_string();
+        finish_reading(ctx);
+
+        // Watch the directory before listing it, so that no change made after it is listed can be missed.
+        if(change_watcher) {
+            change_watcher->watch(directory_path);
+        }
+
+        // Stat every entry before responding, so that the writer is not held while we wait on the filesystem.
+        std::vector<DirEntryStat> entries;
+        ResponseStatus status = list_directory(directory_path.c_str(), entries);
+        if(status != ResponseStatus::Success) {
+            respond_status(ctx, status);
+            return;
+        }
+
+        respond_compressible(ctx, [&](DataWriter& body_writer) {
+            write_dir_entries(body_writer, entries);
+        });
     }
 
-    void ClientHandler::handle_move_entry() {
-        MoveEntryArgs args(reader);
+    void ClientHandler::handle_list_tree(RequestContext& ctx) {
+        ListTreeArgs args(reader);
+        finish_reading(ctx);
+
+        std::vector<TreeDirListing> listings;
+        bool truncated;
+        ResponseStatus status = list_tree(args.path, args.max_depth, args.max_entries, listings, truncated);
+        if(status != ResponseStatus::Success) {
+            respond_status(ctx, status);
+            return;
+        }
+
+        respond_compressible(ctx, [&](DataWriter& body_writer) {
+            for(TreeDirListing& listing : listings) {
+                body_writer.write_byte((uint8_t) ResponseStatus::Success);
+                body_writer.write_utf8_string(listing.relative_path);
+                write_dir_entries(body_writer, listing.entries);
+            }
+
+            body_writer.write_byte((uint8_t) ResponseStatus::NoMoreEntries);
+            body_writer.write_byte(truncated);
+        });
+    }
 
+    // Gives the status of a syscall that returns -1 and sets `errno` on failure.
+    ResponseStatus status_of(int result) {
+        if(result == -1) {
+            return get_status_from_errno();
+        }   else    {
+            return ResponseStatus::Success;
+        }
+    }
+
+    ResponseStatus move_entry(const MoveEntryArgs& args) {
         // Check if the destination file exists
         struct stat existing_stat;
         if(stat(args.to_path.c_str(), &existing_stat) == -1) {
             if(errno != ENOENT) {
                 // Error occured that was not "file not found", return this.
-                writer.write_byte((uint8_t) get_status_from_errno());
-                return;
+                return get_status_from_errno();
             }
         }   else if(!args.overwrite) { // File DID exist and overwriting not allowed.
-            writer.write_byte((uint8_t) ResponseStatus::FileExists);
-            return;
+            return ResponseStatus::FileExists;
         }
 
-        if(rename(args.from_path.c_str(), args.to_path.c_str()) == -1) {
-            writer.write_byte((uint8_t) get_status_from_errno());
-        }   else    {
-            writer.write_byte((uint8_t) ResponseStatus::Success);
-        }
+        return status_of(rename(args.from_path.c_str(), args.to_path.c_str()));
+    }
+
+    void ClientHandler::handle_move_entry(RequestContext& ctx) {
+        MoveEntryArgs args(reader);
+        finish_reading(ctx);
+
+        respond_status(ctx, move_entry(args));
     }
 
-    void ClientHandler::handle_remove_file() {
+    void ClientHandler::handle_copy_entry(RequestContext& ctx) {
+        CopyEntryArgs args(reader);
+        finish_reading(ctx);
+
+        uint64_t bytes_copied;
+        ResponseStatus status = copy_entry(args.from_path, args.to_path, args.replace_if_exists,
+            [&](uint64_t copied, uint64_t entries_copied) {
+                respond(ctx, [&]() {
+                    writer.write_byte((uint8_t) ResponseStatus::InProgress);
+                    writer.write_u64(copied);
+                    writer.write_u64(entries_copied);
+                });
+            }, bytes_copied);
+
+        respond(ctx, [&]() {
+            writer.write_byte((uint8_t) status);
+            writer.write_u64(bytes_copied);
+        });
+    }
+
+    void ClientHandler::handle_remove_file(RequestContext& ctx) {
         std::string file_path = reader.read_utf8_string();
-        if(unlink(file_path.c_str()) == -1) {
-            writer.write_byte((uint8_t) get_status_from_errno());
-        }   else    {
-            writer.write_byte((uint8_t) ResponseStatus::Success);
-        }
+        finish_reading(ctx);
+
+        respond_status(ctx, status_of(unlink(file_path.c_str())));
     }
 
-    void ClientHandler::handle_remove_directory() {
+    void ClientHandler::handle_remove_directory(RequestContext& ctx) {
         std::string file_path = reader.read_utf8_string();
-        if(rmdir(file_path.c_str()) == -1) {
-            writer.write_byte((uint8_t) get_status_from_errno());
-        }   else    {
-            writer.write_byte((uint8_t) ResponseStatus::Success);
+        finish_reading(ctx);
+
+        respond_status(ctx, status_of(rmdir(file_path.c_str())));
+    }
+
+    void ClientHandler::handle_remove_tree(RequestContext& ctx) {
+        std::string path = reader.read_utf8_string();
+        finish_reading(ctx);
+
+        RemoveTreeResult result = remove_tree(path);
+        respond(ctx, [&]() {
+            writer.write_byte((uint8_t) result.status);
+            writer.write_u32(result.files_removed);
+            writer.write_u32(result.directories_removed);
+        });
+    }
+
+    void ClientHandler::handle_hash_range(RequestContext& ctx) {
+        HashRangeArgs args(reader);
+        finish_reading(ctx);
+
+        std::vector<uint8_t> digest;
+        uint64_t bytes_hashed;
+        ResponseStatus status = hash_file_range(args.path, args.offset, args.length, args.algorithm, digest, bytes_hashed);
+        respond(ctx, [&]() {
+            writer.write_byte((uint8_t) status);
+            writer.write_u64(bytes_hashed);
+            writer.write_byte((uint8_t) digest.size());
+            writer.write_exact(digest.data(), digest.size());
+        });
+    }
+
+    void ClientHandler::handle_get_block_checksums(RequestContext& ctx) {
+        std::string path = reader.read_utf8_string();
+        finish_reading(ctx);
+
+        uint64_t file_size;
+        uint32_t block_size;
+        std::vector<BlockChecksum> blocks;
+        ResponseStatus status = get_block_checksums(path, file_size, block_size, blocks);
+        respond(ctx, [&]() {
+            writer.write_byte((uint8_t) status);
+            if(status != ResponseStatus::Success) {
+                return;
+            }
+
+            writer.write_u64(file_size);
+            writer.write_u32(block_size);
+            writer.write_u32(blocks.size());
+            for(BlockChecksum& block : blocks) {
+                writer.write_u32(block.rolling);
+                writer.write_u64(block.strong);
+            }
+        });
+    }
+
+    void ClientHandler::handle_write_delta(RequestContext& ctx) {
+        std::string path = reader.read_utf8_string();
+        uint32_t block_size = reader.read_u32();
+
+        // The literal data is received straight into the temporary file, since the new contents may be far too large to hold in memory.
+        // The blocks from the existing file are copied once the whole request has been read, so that the reader is not held while they are.
+        DeltaWriter delta_writer(path, block_size);
+        uint64_t expected_hash;
+        while(true) {
+            DeltaOp op = (DeltaOp) reader.read_byte();
+            if(op == DeltaOp::CopyBlocks) {
+                uint32_t first_block = reader.read_u32();
+                uint32_t block_count = reader.read_u32();
+                delta_writer.copy_blocks(first_block, block_count);
+            }   else if(op == DeltaOp::Literal) {
+                uint32_t length = reader.read_u32();
+                int temp_fd;
+                uint64_t offset = delta_writer.add_literal(length, temp_fd);
+                delta_writer.literal_written(receive_write(WriteHandleInitArgs(temp_fd, offset, length)));
+            }   else if(op == DeltaOp::End) {
+                expected_hash = reader.read_u64();
+                break;
+            }   else    {
+                // The length of an unknown op is not known, so the rest of the request cannot be skipped.
+                throw std::runtime_error("Unknown delta op received");
+            }
         }
+        finish_reading(ctx);
+
+        respond_status(ctx, delta_writer.finish(expected_hash));
     }
 
-    void ClientHandler::handle_open_handle() {
-        OpenHandleArgs args(reader);
+    // Opens a file with `open`, and sets `out_existed` to whether the file existed before it was opened.
+    // If the flags allow a new file to be created, the file is first opened without O_CREAT, so that a file created by the open can be told apart.
+    int open_checking_existence(const char* path, int flags, bool& out_existed) {
+        if(!(flags & O_CREAT)) {
+            out_existed = true;
+            return open(path, flags);
+        }   else if(flags & O_EXCL) {
+            out_existed = false;
+            return open(path, flags, DEFAULT_FILE_MODE);
+        }
+
+        while(true) {
+            int fd = open(path, flags & ~O_CREAT);
+            if(fd != -1 || errno != ENOENT) {
+                out_existed = true;
+                return fd;
+            }
+
+            fd = open(path, flags | O_EXCL, DEFAULT_FILE_MODE);
+            if(fd != -1 || errno != EEXIST) {
+                out_existed = false;
+                return fd;
+            }
+            // Something else created the file between the two calls, so try again to open it as an existing file.
+        }
+    }
+
+    ResponseStatus ClientHandler::open_handle(const OpenHandleArgs& args, int& out_fd, bool& out_existed, struct stat& out_stat) {
         // Cannot open a handle with no read or write access, since this is useless.
         int creation_flags;
         if(!args.read_access && !args.write_access) {
-            writer.write_byte((uint8_t) ResponseStatus::GenericFailure);
-            return;
+            return ResponseStatus::GenericFailure;
         }   else if(args.read_access && !args.write_access) {
             creation_flags = O_RDONLY;
         }   else if(args.write_access && !args.read_access) {
@@ -207,29 +559,357 @@ namespace nandroidfs {
                 // OpenOnly is the default option for opening a file - no need for additional flags.
         }
 
-        int fd = open(args.path.c_str(), creation_flags, DEFAULT_FILE_MODE);
+        int fd = open_checking_existence(args.path.c_str(), creation_flags, out_existed);
         if(fd == -1) {
-            writer.write_byte((uint8_t) get_status_from_errno());
-        }   else    {
-            writer.write_byte((uint8_t) ResponseStatus::Success);
-            writer.write_u32(fd);
+            return get_status_from_errno();
+        }
+
+        // Give the stat of the file with the handle, so that the client does not need to stat it separately.
+        if(fstat(fd, &out_stat) == -1) {
+            ResponseStatus status = get_status_from_errno();
+            close(fd);
+            return status;
+        }   else if(S_ISDIR(out_stat.st_mode))    {
+            // Directories can be opened read only, but a handle to one is no use for reading or writing data.
+            close(fd);
+            return ResponseStatus::NotAFile;
         }
+
+        // The hint is only advice, so the handle is still usable if the kernel rejects it.
+        switch(args.hint) {
+            case AccessHint::Sequential:
+                posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                break;
+            case AccessHint::Random:
+                posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+                break;
+            case AccessHint::NoReuse:
+                posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+                break;
+            case AccessHint::Normal:
+                break;
+        }
+        if(args.hint == AccessHint::Sequential || args.hint == AccessHint::NoReuse) {
+            std::lock_guard lock(drop_on_close_mutex);
+            drop_on_close.insert(fd);
+        }
+
+        out_fd = fd;
+        return ResponseStatus::Success;
+    }
+
+    // Writes the body of a successful OpenHandle response.
+    void write_opened_handle(DataWriter& writer, int fd, bool existed, const struct stat& posix_stat) {
+        writer.write_u32(fd);
+        writer.write_byte(existed);
+        to_file_stat(posix_stat).write(writer);
+    }
+
+    void ClientHandler::handle_open_handle(RequestContext& ctx) {
+        OpenHandleArgs args(reader);
+        finish_reading(ctx);
+
+        int fd;
+        bool existed;
+        struct stat posix_stat;
+        ResponseStatus status = open_handle(args, fd, existed, posix_stat);
+        respond(ctx, [&]() {
+            writer.write_byte((uint8_t) status);
+            if(status == ResponseStatus::Success) {
+                write_opened_handle(writer, fd, existed, posix_stat);
+            }
+        });
+    }
+
+    void ClientHandler::close_handle(int handle) {
+        bool drop_pages;
+        {
+            std::lock_guard lock(drop_on_close_mutex);
+            drop_pages = drop_on_close.erase(handle) > 0;
+        }
+        if(drop_pages) {
+            // Only pages that have been written back can be dropped, so any data still being written stays cached.
+            posix_fadvise(handle, 0, 0, POSIX_FADV_DONTNEED);
+        }
+
+        close(handle);
+    }
+
+    void ClientHandler::handle_close_handle(RequestContext& ctx) {
+        int handle = reader.read_u32();
+        finish_reading(ctx);
+
+        close_handle(handle);
+        respond_status(ctx, ResponseStatus::Success);
     }
 
-    void ClientHandler::handle_create_directory() {
+    void ClientHandler::handle_create_directory(RequestContext& ctx) {
         std::string dir_path = reader.read_utf8_string();
-        if(mkdir(dir_path.c_str(), DEFAULT_DIRECTORY_MODE) == -1) {
-            writer.write_byte((uint8_t) get_status_from_errno());
-        }   else    {
-            writer.write_byte((uint8_t) ResponseStatus::Success);
+        finish_reading(ctx);
+
+        respond_status(ctx, status_of(mkdir(dir_path.c_str(), DEFAULT_DIRECTORY_MODE)));
+    }
+
+    void ClientHandler::send_file_data(int fd, uint64_t offset, uint32_t length) {
+        off_t file_offset = offset;
+        uint32_t remaining = length;
+        bool use_sendfile = true;
+        while(remaining > 0) {
+            ssize_t sent;
+            if(use_sendfile) {
+                sent = sendfile(socket, fd, &file_offset, remaining);
+                if(sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                    // The kernel cannot sendfile from this file, so read it into a buffer instead.
+                    use_sendfile = false;
+                    continue;
+                }
+            }   else    {
+                uint32_t chunk_len = std::min(remaining, COPY_CHUNK_SIZE);
+                ensure_rw_buffer_size(chunk_len);
+                sent = ::pread(fd, &rw_buffer[0], chunk_len, file_offset);
+                if(sent > 0) {
+                    write(&rw_buffer[0], sent);
+                    file_offset += sent;
+                }
+            }
+
+            if(sent == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                // The length has already been sent, so there is no way to report the error to the client.
+                throw UnixException(errno);
+            }
+
+            if(sent == 0) {
+                // The file was truncated after its length was checked.
+                // Send zeros in place of the missing data, so that the client still receives the length it was promised.
+                ensure_rw_buffer_size(remaining);
+                std::fill(rw_buffer.begin(), rw_buffer.begin() + remaining, 0);
+                write(&rw_buffer[0], remaining);
+                return;
+            }
+
+            remaining -= sent;
+        }
+    }
+
+    // Reads `length` bytes from the file with descriptor `fd`, starting at `offset`.
+    // If EOF is reached first, the rest of `into` is filled with zeros.
+    void read_all_at(int fd, uint8_t* into, size_t length, uint64_t offset) {
+        while(length > 0) {
+            ssize_t read_result = ::pread(fd, into, length, offset);
+            if(read_result == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                throw UnixException(errno);
+            }   else if(read_result == 0) {
+                std::fill(into, into + length, 0);
+                return;
+            }
+
+            into += read_result;
+            length -= read_result;
+            offset += read_result;
+        }
+    }
+
+    void ClientHandler::send_file_data_compressed(int fd, uint64_t offset, uint32_t length) {
+        int incompressible_blocks = 0;
+        while(length > 0) {
+            if(incompressible_blocks >= MAX_INCOMPRESSIBLE_BLOCKS) {
+                // The file does not seem to compress, e.g. it is an image or an archive.
+                // Send the rest of the data as a single raw block, so that it does not need to be copied through userspace.
+                writer.write_u32(length);
+                writer.flush();
+                send_file_data(fd, offset, length);
+                return;
+            }
+
+            uint32_t block_len = std::min(length, COMPRESSION_CHUNK_SIZE);
+            ensure_rw_buffer_size(block_len);
+            // The length has already been sent, so there is no way to report an error to the client.
+            read_all_at(fd, &rw_buffer[0], block_len, offset);
+            if(write_block(writer, &rw_buffer[0], block_len)) {
+                incompressible_blocks = 0;
+            }   else    {
+                incompressible_blocks++;
+            }
+
+            offset += block_len;
+            length -= block_len;
+        }
+    }
+
+    // Writes all of `data` to the file with descriptor `fd`, starting at `offset`.
+    ResponseStatus write_all_at(int fd, const uint8_t* data, size_t length, uint64_t offset) {
+        while(length > 0) {
+            ssize_t write_result = ::pwrite(fd, data, length, offset);
+            if(write_result == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return get_status_from_errno();
+            }
+
+            data += write_result;
+            length -= write_result;
+            offset += write_result;
+        }
+
+        return ResponseStatus::Success;
+    }
+
+    ResponseStatus ClientHandler::receive_file_data(int fd, uint64_t offset, uint32_t length) {
+        ResponseStatus status = ResponseStatus::Success;
+
+        // Some of the data may already have been read into the reader's buffer along with the request arguments.
+        while(length > 0) {
+            const uint8_t* buffered;
+            int buffered_len = reader.consume_buffered(buffered, length);
+            if(buffered_len == 0) {
+                break;
+            }
+
+            if(status == ResponseStatus::Success) {
+                status = write_all_at(fd, buffered, buffered_len, offset);
+            }
+            offset += buffered_len;
+            length -= buffered_len;
+        }
+
+        // The rest of the data is moved from the socket into a pipe, then from the pipe into the file, without copying it into userspace.
+        splice_pipe.ensure_open();
+        bool splice_to_file = true;
+        while(length > 0) {
+            ssize_t in_pipe = splice(socket, nullptr, splice_pipe.write_fd, nullptr,
+                std::min(length, COPY_CHUNK_SIZE), SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(in_pipe == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }   else if(errno == EINVAL || errno == ENOSYS) {
+                    break; // Cannot splice from the socket, so read the rest of the data through the reader.
+                }
+                throw UnixException(errno);
+            }   else if(in_pipe == 0) {
+                throw EOFException();
+            }
+            length -= in_pipe;
+
+            // Empty the pipe before the next splice from the socket.
+            while(in_pipe > 0) {
+                ssize_t moved;
+                if(splice_to_file && status == ResponseStatus::Success) {
+                    loff_t file_offset = offset;
+                    moved = splice(splice_pipe.read_fd, nullptr, fd, &file_offset, in_pipe, SPLICE_F_MOVE);
+                    if(moved == -1) {
+                        if(errno == EINVAL) {
+                            splice_to_file = false; // Cannot splice into this file.
+                        }   else if(errno != EINTR) {
+                            status = get_status_from_errno();
+                        }
+                        continue;
+                    }
+                }   else    {
+                    // Read the data out of the pipe instead, writing it to the file unless a write has already failed.
+                    // The data must still be removed from the pipe after a failure, since the rest of the request follows it.
+                    ensure_rw_buffer_size(std::min<size_t>(in_pipe, COPY_CHUNK_SIZE));
+                    moved = ::read(splice_pipe.read_fd, &rw_buffer[0], std::min<size_t>(in_pipe, rw_buffer.size()));
+                    if(moved == -1) {
+                        if(errno == EINTR) {
+                            continue;
+                        }
+                        throw UnixException(errno);
+                    }
+
+                    if(status == ResponseStatus::Success) {
+                        status = write_all_at(fd, &rw_buffer[0], moved, offset);
+                    }
+                }
+
+                offset += moved;
+                in_pipe -= moved;
+            }
+        }
+
+        // If splicing from the socket isn't possible, fall back to reading the data into a buffer.
+        while(length > 0) {
+            uint32_t chunk_len = std::min(length, COPY_CHUNK_SIZE);
+            ensure_rw_buffer_size(chunk_len);
+            reader.read_exact(&rw_buffer[0], chunk_len);
+
+            if(status == ResponseStatus::Success) {
+                status = write_all_at(fd, &rw_buffer[0], chunk_len, offset);
+            }
+            offset += chunk_len;
+            length -= chunk_len;
         }
+
+        return status;
     }
 
-    void ClientHandler::handle_read_file() {
+    ResponseStatus ClientHandler::receive_file_data_compressed(int fd, uint64_t offset, uint32_t length) {
+        ResponseStatus status = ResponseStatus::Success;
+        while(length > 0) {
+            uint32_t header = reader.read_u32();
+            uint32_t block_len;
+            ResponseStatus block_status;
+            if(header & COMPRESSED_BLOCK_FLAG) {
+                uint32_t compressed_len = header & ~COMPRESSED_BLOCK_FLAG;
+                if(compressed_len > COMPRESSION_CHUNK_SIZE) {
+                    throw std::runtime_error("Compressed block is too long");
+                }
+
+                // The compressed data is read into the start of the buffer, and decompressed to just after it.
+                block_len = std::min(length, COMPRESSION_CHUNK_SIZE);
+                ensure_rw_buffer_size(compressed_len + block_len);
+                reader.read_exact(&rw_buffer[0], compressed_len);
+                decompress_block(&rw_buffer[0], compressed_len, &rw_buffer[compressed_len], block_len);
+                block_status = write_all_at(fd, &rw_buffer[compressed_len], block_len, offset);
+            }   else    {
+                block_len = header;
+                if(block_len == 0 || block_len > length) {
+                    throw std::runtime_error("Raw block length is invalid");
+                }
+                block_status = receive_file_data(fd, offset, block_len);
+            }
+
+            if(status == ResponseStatus::Success) {
+                status = block_status;
+            }
+            offset += block_len;
+            length -= block_len;
+        }
+
+        return status;
+    }
+
+    void ClientHandler::handle_read_file(RequestContext& ctx) {
         ReadHandleArgs args(reader);
+        finish_reading(ctx);
+
+        // Large reads from regular files are sent straight from the file to the socket, avoiding copying them through userspace.
+        // Small reads use the buffered path below, as do files in procfs and sysfs, which report a size that is not the actual length of their data.
+        struct stat handle_stat;
+        if(args.data_len >= ZERO_COPY_MIN_READ_LEN && fstat(args.handle, &handle_stat) == 0
+            && S_ISREG(handle_stat.st_mode) && handle_stat.st_size >= ZERO_COPY_MIN_READ_LEN) {
+            // The length of the data must be sent before the data itself, so work it out from the file size.
+            // This still gives the full length requested unless EOF is reached, as windows requires (see below).
+            uint64_t file_size = handle_stat.st_size;
+            uint64_t available = file_size > args.offset ? file_size - args.offset : 0;
+            uint32_t data_len = static_cast<uint32_t>(std::min<uint64_t>(args.data_len, available));
 
-        if(::lseek(args.handle, args.offset, SEEK_SET) == -1) {
-            writer.write_byte((uint8_t) get_status_from_errno());
+            respond(ctx, [&]() {
+                writer.write_byte((uint8_t) ResponseStatus::Success);
+                writer.write_u32(data_len);
+                if(compression_enabled) {
+                    send_file_data_compressed(args.handle, args.offset, data_len);
+                }   else    {
+                    writer.flush();
+                    send_file_data(args.handle, args.offset, data_len);
+                }
+            });
             return;
         }
 
@@ -240,12 +920,14 @@ namespace nandroidfs {
         // It may seem like this is unnecessary: can't we just return fewer bytes than requested like most OS file reading functions?
         // However: When using memory mapped files, windows requires that the full buffer length provided is read from the file unless EOF has been reached
         // So to keep windows happy, we must keep reading until EOF or requested length.
+        //
+        // `pread` is used rather than `lseek` then `read` since other requests may be using the same handle concurrently.
         int total_read = 0;
         while(total_read < args.data_len) {
             // Read a maximum of the number of bytes remaining in the buffer.
-            ssize_t read_result = ::read(args.handle, &rw_buffer[total_read], (args.data_len - total_read));
+            ssize_t read_result = ::pread(args.handle, &rw_buffer[total_read], (args.data_len - total_read), args.offset + total_read);
             if(read_result == -1) {
-                writer.write_byte((uint8_t) get_status_from_errno());
+                respond_status(ctx, get_status_from_errno());
                 return;
             }
 
@@ -255,46 +937,166 @@ namespace nandroidfs {
             }
         }
 
-        writer.write_byte((uint8_t) ResponseStatus::Success);
-        writer.write_u32(total_read);
-        writer.write_exact(&rw_buffer[0], total_read);
+        respond(ctx, [&]() {
+            writer.write_byte((uint8_t) ResponseStatus::Success);
+            writer.write_u32(total_read);
+            if(compression_enabled) {
+                write_compressed(writer, &rw_buffer[0], total_read);
+            }   else    {
+                writer.write_exact(&rw_buffer[0], total_read);
+            }
+        });
     }
 
-    void ClientHandler::handle_write_file() {
-        WriteHandleInitArgs args(reader);
+    // Reads from the file with descriptor `fd` into the buffers in `buffers`, starting at `offset` and continuing until EOF or all buffers are full.
+    // The buffers are modified to exclude any data that has been read.
+    // Returns the number of bytes read, or -1 if reading fails.
+    ssize_t read_all_into(int fd, std::vector<iovec>& buffers, uint64_t offset) {
+        ssize_t total_read = 0;
+        size_t next_buffer = 0;
+        while(next_buffer < buffers.size()) {
+            int buffer_count = static_cast<int>(std::min<size_t>(buffers.size() - next_buffer, IOV_MAX));
+            ssize_t read_result = ::preadv(fd, &buffers[next_buffer], buffer_count, offset + total_read);
+            if(read_result == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }   else if(read_result == 0) { // EOF condition
+                break;
+            }
+            total_read += read_result;
+
+            // Skip past the buffers that have been filled, and the data that has been read into the next buffer.
+            while(read_result > 0) {
+                iovec& buffer = buffers[next_buffer];
+                if(static_cast<size_t>(read_result) >= buffer.iov_len) {
+                    read_result -= buffer.iov_len;
+                    next_buffer++;
+                }   else    {
+                    buffer.iov_base = static_cast<uint8_t*>(buffer.iov_base) + read_result;
+                    buffer.iov_len -= read_result;
+                    read_result = 0;
+                }
+            }
+        }
 
-        if(::lseek(args.handle, args.offset, SEEK_SET) == -1) {
-            writer.write_byte((uint8_t) get_status_from_errno());
+        return total_read;
+    }
+
+    void ClientHandler::handle_read_file_v(RequestContext& ctx) {
+        ReadHandleVArgs args(reader);
+        finish_reading(ctx);
+
+        uint64_t total_len = 0;
+        for(const ReadRange& range : args.ranges) {
+            total_len += range.data_len;
+        }
+        if(total_len > ReadHandleVArgs::MAX_TOTAL_LEN) {
+            respond_status(ctx, ResponseStatus::GenericFailure);
             return;
         }
 
-        ensure_rw_buffer_size(args.data_len);
-        reader.read_exact(&rw_buffer[0], args.data_len);
+        // Large requests are sent straight from the file, as large ReadHandle requests are, so that they do not need a buffer to hold every range.
+        // As with ReadHandle, this is only possible for regular files, since the length of each range is worked out from the file size.
+        struct stat handle_stat;
+        if(total_len > MAX_BUFFERED_READ_V_LEN && fstat(args.handle, &handle_stat) == 0 && S_ISREG(handle_stat.st_mode)) {
+            uint64_t file_size = handle_stat.st_size;
+            respond(ctx, [&]() {
+                writer.write_byte((uint8_t) ResponseStatus::Success);
+                for(const ReadRange& range : args.ranges) {
+                    uint64_t available = file_size > range.offset ? file_size - range.offset : 0;
+                    uint32_t data_len = static_cast<uint32_t>(std::min<uint64_t>(range.data_len, available));
+                    writer.write_u32(data_len);
+                    if(compression_enabled) {
+                        send_file_data_compressed(args.handle, range.offset, data_len);
+                    }   else    {
+                        writer.flush();
+                        send_file_data(args.handle, range.offset, data_len);
+                    }
+                }
+            });
+            return;
+        }
 
-        // Keep writing until the entire buffer has been written.
-        int total_written = 0;
-        while(total_written < args.data_len) {
-            ssize_t write_result = ::write(args.handle, &rw_buffer[total_written], (args.data_len - total_written));
-            if(write_result == -1) {
-                writer.write_byte((uint8_t) get_status_from_errno());
+        // Each range is read into its own part of the buffer.
+        ensure_rw_buffer_size(total_len);
+        std::vector<size_t> buffer_offsets(args.ranges.size());
+        std::vector<uint32_t> lengths_read(args.ranges.size());
+        size_t buffer_offset = 0;
+        for(size_t i = 0; i < args.ranges.size(); i++) {
+            buffer_offsets[i] = buffer_offset;
+            buffer_offset += args.ranges[i].data_len;
+        }
+
+        // Ranges that follow on from each other in the file are read with a single `preadv`, which scatters the data into the buffer of each range.
+        std::vector<iovec> buffers;
+        size_t first_range = 0;
+        while(first_range < args.ranges.size()) {
+            size_t end_range = first_range + 1;
+            uint64_t extent_end = args.ranges[first_range].offset + args.ranges[first_range].data_len;
+            while(end_range < args.ranges.size() && args.ranges[end_range].offset == extent_end) {
+                extent_end += args.ranges[end_range].data_len;
+                end_range++;
+            }
+
+            buffers.clear();
+            for(size_t i = first_range; i < end_range; i++) {
+                buffers.push_back(iovec { &rw_buffer[buffer_offsets[i]], args.ranges[i].data_len });
+            }
+
+            ssize_t extent_read = read_all_into(args.handle, buffers, args.ranges[first_range].offset);
+            if(extent_read == -1) {
+                respond_status(ctx, get_status_from_errno());
                 return;
             }
 
-            total_written += write_result;
+            // If EOF was reached, the ranges after it are only partly read, or not read at all.
+            for(size_t i = first_range; i < end_range; i++) {
+                uint32_t range_len = args.ranges[i].data_len;
+                lengths_read[i] = static_cast<uint32_t>(std::clamp<ssize_t>(extent_read, 0, range_len));
+                extent_read -= range_len;
+            }
+
+            first_range = end_range;
         }
 
-        writer.write_byte((uint8_t) ResponseStatus::Success);
+        respond(ctx, [&]() {
+            writer.write_byte((uint8_t) ResponseStatus::Success);
+            for(size_t i = 0; i < args.ranges.size(); i++) {
+                writer.write_u32(lengths_read[i]);
+                if(compression_enabled) {
+                    write_compressed(writer, &rw_buffer[buffer_offsets[i]], lengths_read[i]);
+                }   else    {
+                    writer.write_exact(&rw_buffer[buffer_offsets[i]], lengths_read[i]);
+                }
+            }
+        });
     }
 
-    void ClientHandler::handle_truncate_file() {
-        TruncateHandleArgs args(reader);
-        if(ftruncate(args.handle, args.new_length) == -1) {
-            writer.write_byte((uint8_t) get_status_from_errno());
+    ResponseStatus ClientHandler::receive_write(const WriteHandleInitArgs& args) {
+        if(compression_enabled) {
+            return receive_file_data_compressed(args.handle, args.offset, args.data_len);
         }   else    {
-            writer.write_byte((uint8_t) ResponseStatus::Success);
+            return receive_file_data(args.handle, args.offset, args.data_len);
         }
     }
 
+    void ClientHandler::handle_write_file(RequestContext& ctx) {
+        WriteHandleInitArgs args(reader);
+        ResponseStatus status = receive_write(args);
+        finish_reading(ctx);
+
+        respond_status(ctx, status);
+    }
+
+    void ClientHandler::handle_truncate_file(RequestContext& ctx) {
+        TruncateHandleArgs args(reader);
+        finish_reading(ctx);
+
+        respond_status(ctx, status_of(ftruncate(args.handle, args.new_length)));
+    }
+
     // Gets a timespec from the provided timestamp (unix file timestamp in seconds, from Jan 1st 1970)
     // If the timestamp is -1, this will create a timespec that leaves the time unchanged.
     timespec get_timspec_from_timestamp(int64_t timestamp) {
@@ -312,37 +1114,43 @@ namespace nandroidfs {
         return spec;
     }
 
-    void ClientHandler::handle_set_file_time() {
-        SetFileTimeArgs args(reader);
+    ResponseStatus set_file_time(const SetFileTimeArgs& args) {
         timespec timespecs[2];
         timespecs[0] = get_timspec_from_timestamp(args.access_time);
         timespecs[1] = get_timspec_from_timestamp(args.write_time);
 
-        if(utimensat(/* ignored with absolute path */ 0, args.path.c_str(), timespecs, 0)) {
-            writer.write_byte((uint8_t) get_status_from_errno());
-        }   else    {
-            writer.write_byte((uint8_t) ResponseStatus::Success);
-        }
+        return status_of(utimensat(/* ignored with absolute path */ 0, args.path.c_str(), timespecs, 0));
     }
 
-    void ClientHandler::handle_get_disk_stats() {
+    void ClientHandler::handle_set_file_time(RequestContext& ctx) {
+        SetFileTimeArgs args(reader);
+        finish_reading(ctx);
+
+        respond_status(ctx, set_file_time(args));
+    }
+
+    void ClientHandler::handle_get_disk_stats(RequestContext& ctx) {
+        finish_reading(ctx); // No arguments
+
         struct statvfs vfs_info;
         if(statvfs(FREE_SPACE_FS_PATH, &vfs_info) == -1) {
-            writer.write_byte((uint8_t) get_status_from_errno());
+            respond_status(ctx, get_status_from_errno());
         }   else    {
-            writer.write_byte((uint8_t) ResponseStatus::Success);
             uint64_t block_size = vfs_info.f_bsize;
             DiskStats stats(block_size * vfs_info.f_bfree,
                 block_size * vfs_info.f_favail,
                 block_size * vfs_info.f_blocks);
-            stats.write(writer);
+            respond(ctx, [&]() {
+                writer.write_byte((uint8_t) ResponseStatus::Success);
+                stats.write(writer);
+            });
         }
     }
 
     // Finds the parent directory of the given entry path.
     // Returns ResponseStatus::Success if the parent directory has read, write and execute permissions allowed for the current process.
     // Gives ResponseStatus::AccessDenied if any of these permissions are missing.
-    ResponseStatus can_remove_directory_entry(std::string& path) {
+    ResponseStatus can_remove_directory_entry(const std::string& path) {
         std::optional<std::string> parent_dir_path = get_parent_path(path);
         if(!parent_dir_path.has_value()) { // Trying to delete the root
             return ResponseStatus::AccessDenied; // Obviously a bad idea, deny access.
@@ -356,26 +1164,25 @@ namespace nandroidfs {
         }
     }
 
-    void ClientHandler::handle_check_remove_file() {
+    void ClientHandler::handle_check_remove_file(RequestContext& ctx) {
         // Whether or not we can remove a file only relies on having the right permissions on the parent directory
         // ... in order to `unlink` it.
         std::string file_path = reader.read_utf8_string();
-        writer.write_byte((uint8_t) can_remove_directory_entry(file_path));
+        finish_reading(ctx);
+
+        respond_status(ctx, can_remove_directory_entry(file_path));
     }
 
-    void ClientHandler::handle_check_remove_directory() {
+    ResponseStatus can_remove_directory(const std::string& dir_path) {
         // To remove a directory, there is a secondary requirement: it needs to be empty.
-        std::string dir_path = reader.read_utf8_string();
         ResponseStatus can_rem_entry = can_remove_directory_entry(dir_path);
         if(can_rem_entry != ResponseStatus::Success) {
-            writer.write_byte((uint8_t) can_rem_entry);
-            return;
+            return can_rem_entry;
         }
         
         DIR* dir = opendir(dir_path.c_str());
         if(!dir) {
-            writer.write_byte((uint8_t) get_status_from_errno());
-            return;
+            return get_status_from_errno();
         }
 
         // Check if the directory is empty.
@@ -394,18 +1201,364 @@ namespace nandroidfs {
         closedir(dir);
 
         if(has_entry)  {
-            writer.write_byte((uint8_t) ResponseStatus::DirectoryNotEmpty);
+            return ResponseStatus::DirectoryNotEmpty;
         }   else    {
+            return ResponseStatus::Success;
+        }
+    }
+
+    void ClientHandler::handle_check_remove_directory(RequestContext& ctx) {
+        std::string dir_path = reader.read_utf8_string();
+        finish_reading(ctx);
+
+        respond_status(ctx, can_remove_directory(dir_path));
+    }
+
+    // Checks that a FILE_HANDLE in the arguments of the step of a Compound request with index `index` does not refer to the handle
+    // of that step or a later one, which can never have been opened.
+    void check_step_handle(FILE_HANDLE handle, uint16_t index) {
+        if((handle & COMPOUND_STEP_HANDLE_FLAG) && (handle & ~COMPOUND_STEP_HANDLE_FLAG) >= index) {
+            throw std::runtime_error("Compound step refers to the handle of a later step");
+        }
+    }
+
+    // Gets the file descriptor given by a FILE_HANDLE in the arguments of a step of a Compound request.
+    // `opened_fds` holds the handle opened by each earlier step, or -1 if the step did not open one.
+    int resolve_step_handle(FILE_HANDLE handle, const std::vector<int>& opened_fds) {
+        if(!(handle & COMPOUND_STEP_HANDLE_FLAG)) {
+            return handle;
+        }
+
+        return opened_fds[handle & ~COMPOUND_STEP_HANDLE_FLAG];
+    }
+
+    ClientHandler::CompoundStep ClientHandler::read_compound_step(uint16_t index) {
+        RequestType type = (RequestType) reader.read_byte();
+        bool continue_on_failure = reader.read_byte();
+        switch(type) {
+            case RequestType::StatFile:
+            case RequestType::CreateDirectory:
+            case RequestType::CheckRemoveFile:
+            case RequestType::CheckRemoveDirectory:
+            case RequestType::RemoveFile:
+            case RequestType::RemoveDirectory:
+                return CompoundStep { type, continue_on_failure, reader.read_utf8_string() };
+            case RequestType::OpenHandle:
+                return CompoundStep { type, continue_on_failure, OpenHandleArgs(reader) };
+            case RequestType::MoveEntry:
+                return CompoundStep { type, continue_on_failure, MoveEntryArgs(reader) };
+            case RequestType::SetFileTime:
+                return CompoundStep { type, continue_on_failure, SetFileTimeArgs(reader) };
+            case RequestType::CloseHandle:
+            {
+                FILE_HANDLE handle = reader.read_u32();
+                check_step_handle(handle, index);
+                return CompoundStep { type, continue_on_failure, handle };
+            }
+            case RequestType::TruncateHandle:
+            {
+                TruncateHandleArgs args(reader);
+                check_step_handle(args.handle, index);
+                return CompoundStep { type, continue_on_failure, args };
+            }
+            case RequestType::WriteHandle:
+            {
+                WriteHandleInitArgs args(reader);
+                check_step_handle(args.handle, index);
+                // The data is held in memory until the step runs.
+                // Write steps are only used to send buffered writes, so each is at most the size of the client's write buffer.
+                std::vector<uint8_t> data(args.data_len);
+                if(compression_enabled) {
+                    read_compressed(reader, data.data(), args.data_len);
+                }   else    {
+                    reader.read_exact(data.data(), args.data_len);
+                }
+                return CompoundStep { type, continue_on_failure, args, std::move(data) };
+            }
+            default:
+                throw std::runtime_error("Request type cannot be a step of a compound request");
+        }
+    }
+
+    ResponseStatus ClientHandler::run_compound_step(const CompoundStep& step,
+        std::vector<int>& opened_fds,
+        DataWriter& results) {
+        ResponseStatus status;
+        int opened_fd = -1;
+        switch(step.type) {
+            case RequestType::StatFile:
+            {
+                FileStat stat;
+                status = stat_file(std::get<std::string>(step.args).c_str(), &stat);
+
+                results.write_byte((uint8_t) status);
+                if(status == ResponseStatus::Success) {
+                    stat.write(results);
+                }
+                opened_fds.push_back(-1);
+                return status;
+            }
+            case RequestType::OpenHandle:
+            {
+                bool existed;
+                struct stat posix_stat;
+                status = open_handle(std::get<OpenHandleArgs>(step.args), opened_fd, existed, posix_stat);
+
+                results.write_byte((uint8_t) status);
+                if(status == ResponseStatus::Success) {
+                    write_opened_handle(results, opened_fd, existed, posix_stat);
+                }
+                opened_fds.push_back(opened_fd);
+                return status;
+            }
+            case RequestType::CreateDirectory:
+                status = status_of(mkdir(std::get<std::string>(step.args).c_str(), DEFAULT_DIRECTORY_MODE));
+                break;
+            case RequestType::CheckRemoveFile:
+                status = can_remove_directory_entry(std::get<std::string>(step.args));
+                break;
+            case RequestType::CheckRemoveDirectory:
+                status = can_remove_directory(std::get<std::string>(step.args));
+                break;
+            case RequestType::RemoveFile:
+                status = status_of(unlink(std::get<std::string>(step.args).c_str()));
+                break;
+            case RequestType::RemoveDirectory:
+                status = status_of(rmdir(std::get<std::string>(step.args).c_str()));
+                break;
+            case RequestType::MoveEntry:
+                status = move_entry(std::get<MoveEntryArgs>(step.args));
+                break;
+            case RequestType::SetFileTime:
+                status = set_file_time(std::get<SetFileTimeArgs>(step.args));
+                break;
+            case RequestType::CloseHandle:
+            {
+                int fd = resolve_step_handle(std::get<FILE_HANDLE>(step.args), opened_fds);
+                if(fd == -1) {
+                    status = ResponseStatus::GenericFailure;
+                    break;
+                }
+
+                close_handle(fd);
+                // The descriptor may be reused once it is closed, so later steps must not be able to refer to it.
+                std::replace(opened_fds.begin(), opened_fds.end(), fd, -1);
+                status = ResponseStatus::Success;
+                break;
+            }
+            case RequestType::TruncateHandle:
+            {
+                const TruncateHandleArgs& args = std::get<TruncateHandleArgs>(step.args);
+                int fd = resolve_step_handle(args.handle, opened_fds);
+                status = fd == -1 ? ResponseStatus::GenericFailure : status_of(ftruncate(fd, args.new_length));
+                break;
+            }
+            case RequestType::WriteHandle:
+            {
+                const WriteHandleInitArgs& args = std::get<WriteHandleInitArgs>(step.args);
+                int fd = resolve_step_handle(args.handle, opened_fds);
+                if(fd == -1) {
+                    status = ResponseStatus::GenericFailure;
+                }   else    {
+                    status = write_all_at(fd, step.data.data(), step.data.size(), args.offset);
+                }
+                break;
+            }
+            default:
+                // Only steps that can be read by `read_compound_step` are ever run.
+                throw std::runtime_error("Request type cannot be a step of a compound request");
+        }
+
+        results.write_byte((uint8_t) status);
+        opened_fds.push_back(-1);
+        return status;
+    }
+
+    void ClientHandler::handle_compound(RequestContext& ctx) {
+        uint16_t step_count = reader.read_u16();
+
+        // Every step is read before any are run, so that the reader is not held while the steps use the disk.
+        std::vector<CompoundStep> steps;
+        steps.reserve(step_count);
+        for(uint16_t i = 0; i < step_count; i++) {
+            steps.push_back(read_compound_step(i));
+        }
+        finish_reading(ctx);
+
+        // The results are kept until every step has run.
+        MemoryWritable results;
+        DataWriter results_writer(&results, BUFFER_SIZE);
+        // The handle opened by each step so far, or -1 if the step did not open one.
+        std::vector<int> opened_fds;
+        opened_fds.reserve(step_count);
+        // If the chain is stopped early, the handles opened by its steps are closed, since the steps that would have closed them
+        // or used them never run. The same goes if a step throws.
+        auto close_opened_fds = [this, &opened_fds]() {
+            for(int fd : opened_fds) {
+                if(fd != -1) {
+                    close_handle(fd);
+                }
+            }
+            opened_fds.clear();
+        };
+
+        bool stopped = false;
+        try
+        {
+            for(const CompoundStep& step : steps) {
+                if(stopped) {
+                    results_writer.write_byte((uint8_t) ResponseStatus::Skipped);
+                    opened_fds.push_back(-1);
+                    continue;
+                }
+
+                ResponseStatus status = run_compound_step(step, opened_fds, results_writer);
+                if(status != ResponseStatus::Success && !step.continue_on_failure) {
+                    stopped = true;
+                }
+            }
+        }
+        catch(...)
+        {
+            close_opened_fds();
+            throw;
+        }
+        if(stopped) {
+            close_opened_fds();
+        }
+        results_writer.flush();
+
+        respond(ctx, [&]() {
             writer.write_byte((uint8_t) ResponseStatus::Success);
+            writer.write_exact(results.data.data(), results.data.size());
+        });
+    }
+
+    void ClientHandler::handle_request(RequestContext& ctx) {
+        switch(ctx.type) {
+            case RequestType::StatFile:
+                handle_stat_file(ctx);
+                break;
+            case RequestType::ListDirectory:
+                handle_list_dir_stats(ctx);
+                break;
+            case RequestType::MoveEntry:
+                handle_move_entry(ctx);
+                break;
+            case RequestType::RemoveFile:
+                handle_remove_file(ctx);
+                break;
+            case RequestType::RemoveDirectory:
+                handle_remove_directory(ctx);
+                break;
+            case RequestType::CreateDirectory:
+                handle_create_directory(ctx);
+                break;
+            case RequestType::OpenHandle:
+                handle_open_handle(ctx);
+                break;
+            case RequestType::ReadHandle:
+                handle_read_file(ctx);
+                break;
+            case RequestType::WriteHandle:
+                handle_write_file(ctx);
+                break;
+            case RequestType::CloseHandle:
+                handle_close_handle(ctx);
+                break;
+            case RequestType::TruncateHandle:
+                handle_truncate_file(ctx);
+                break;
+            case RequestType::SetFileTime:
+                handle_set_file_time(ctx);
+                break;
+            case RequestType::GetDiskStats:
+                handle_get_disk_stats(ctx);
+                break;
+            case RequestType::CheckRemoveFile:
+                handle_check_remove_file(ctx);
+                break;
+            case RequestType::CheckRemoveDirectory:
+                handle_check_remove_directory(ctx);
+                break;
+            case RequestType::StatMany:
+                handle_stat_many(ctx);
+                break;
+            case RequestType::ListTree:
+                handle_list_tree(ctx);
+                break;
+            case RequestType::ReadHandleV:
+                handle_read_file_v(ctx);
+                break;
+            case RequestType::CopyEntry:
+                handle_copy_entry(ctx);
+                break;
+            case RequestType::RemoveTree:
+                handle_remove_tree(ctx);
+                break;
+            case RequestType::HashRange:
+                handle_hash_range(ctx);
+                break;
+            case RequestType::GetBlockChecksums:
+                handle_get_block_checksums(ctx);
+                break;
+            case RequestType::WriteDelta:
+                handle_write_delta(ctx);
+                break;
+            case RequestType::Compound:
+                handle_compound(ctx);
+                break;
+            default:
+                std::cerr << "Unknown request type " << std::to_string((uint8_t) ctx.type) << std::endl;
+                throw std::runtime_error("Unknown request type received!");
+                break;
+        }
+    }
+
+    void ClientHandler::worker_entry_point() {
+        while(true) {
+            RequestContext ctx;
+            {
+                std::unique_lock lock(queue_mutex);
+                queue_cv.wait(lock, [this] { return stopping || !request_queue.empty(); });
+                if(request_queue.empty()) { // Only possible if stopping
+                    return;
+                }
+
+                ctx = request_queue.front();
+                request_queue.pop_front();
+            }
+
+            try
+            {
+                handle_request(ctx);
+            }
+            catch(const std::exception& e)
+            {
+                std::cerr << "Failed to handle request: " << e.what() << std::endl;
+                if(!ctx.args_read) {
+                    // We do not know how much of the request was read, so the next request cannot be found.
+                    std::lock_guard lock(reader_mutex);
+                    reader_failed = true;
+                    reader_busy = false;
+                    reader_released.notify_one();
+                }   else    {
+                    // Failed to write the response, so the socket is no longer usable.
+                    // Shutting it down causes the thread reading requests to reach EOF.
+                    shutdown(socket, SHUT_RDWR);
+                }
+            }
+            release_oversized_rw_buffer();
         }
     }
 
     void ClientHandler::handle_messages() {
-        RequestType req_type;
         while(true) {
+            RequestContext ctx;
             try
             {
-                req_type = (RequestType) reader.read_byte();
+                ctx.type = (RequestType) reader.read_byte();
+                ctx.id = reader.read_u32();
             }
             catch(const EOFException&)
             {
@@ -413,72 +1566,23 @@ namespace nandroidfs {
                 return;
             }
 
-            switch(req_type) {
-                case RequestType::StatFile:
-                {
-                    std::string file_path = reader.read_utf8_string();
-                    FileStat stat;
-                    ResponseStatus status = stat_file(file_path.c_str(), &stat);
-
-                    writer.write_byte((uint8_t) status);
-                    if(status == ResponseStatus::Success) {
-                        stat.write(writer); 
-                    }
-
-                    break;
-                }
-                case RequestType::ListDirectory:
-                    handle_list_dir_stats();
-                    break;
-                case RequestType::MoveEntry:
-                    handle_move_entry();
-                    break;
-                case RequestType::RemoveFile:
-                    handle_remove_file();
-                    break;
-                case RequestType::RemoveDirectory:
-                    handle_remove_directory();
-                    break;
-                case RequestType::CreateDirectory:
-                    handle_create_directory();
-                    break;
-                case RequestType::OpenHandle:
-                    handle_open_handle();
-                    break;
-                case RequestType::ReadHandle:
-                    handle_read_file();
-                    break;
-                case RequestType::WriteHandle:
-                    handle_write_file();
-                    break;
-                case RequestType::CloseHandle: {
-                    int handle = reader.read_u32();
-                    close(handle);
-                    writer.write_byte((uint8_t) ResponseStatus::Success);
-                    break;
-                }
-                case RequestType::TruncateHandle:
-                    handle_truncate_file();
-                    break;
-                case RequestType::SetFileTime:
-                    handle_set_file_time();
-                    break;
-                case RequestType::GetDiskStats:
-                    handle_get_disk_stats();
-                    break;
-                case RequestType::CheckRemoveFile:
-                    handle_check_remove_file();
-                    break;
-                case RequestType::CheckRemoveDirectory:
-                    handle_check_remove_directory();
-                    break;
-                default:
-                    std::cerr << "Unknown request type " << std::to_string((uint8_t) req_type) << std::endl;
-                    throw std::runtime_error("Unknown request type received!");
-                    break;
+            // Pass the request to a worker thread, which will read the arguments and then handle it.
+            {
+                std::lock_guard lock(reader_mutex);
+                reader_busy = true;
             }
+            {
+                std::lock_guard lock(queue_mutex);
+                request_queue.push_back(ctx);
+            }
+            queue_cv.notify_one();
 
-            writer.flush();
+            // The next request cannot be read until the worker has finished reading the arguments.
+            std::unique_lock lock(reader_mutex);
+            reader_released.wait(lock, [this] { return !reader_busy; });
+            if(reader_failed) {
+                throw std::runtime_error("Failed to read request arguments");
+            }
         }
     }
 }
\ No newline at end of file
@@ -0,0 +1,290 @@
+#include "DeltaWriter.hpp"
+#include "UnixException.hpp"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <cmath>
+
+namespace nandroidfs {
+    // Block sizes are chosen to be roughly the square root of the file size, as with rsync, so that larger files have fewer
+    // blocks to checksum, but each change to a smaller file only requires a short block to be sent again.
+    // Sizes are rounded down to a multiple of the minimum size.
+    const uint32_t MIN_DELTA_BLOCK_SIZE = 2048;
+    const uint32_t MAX_DELTA_BLOCK_SIZE = 128 * 1024;
+    // Data is read from the existing file in runs of whole blocks up to this length.
+    const uint32_t DELTA_READ_LEN = 1024 * 1024;
+    // The start of the name of each temporary file that the new contents of a file are written to, which is followed by random characters.
+    // It is created in the same directory as the file so that it can be renamed over it, and starts with a dot to hide it from media scanners.
+    const char* DELTA_TEMP_PREFIX = ".nandroid-delta-";
+    // Temporary files that are not locked are only removed once they are at least this old, since a new file is locked just after it is created.
+    const time_t STALE_DELTA_TEMP_AGE_SECS = 60;
+
+    uint32_t choose_delta_block_size(uint64_t file_size) {
+        uint64_t block_size = static_cast<uint64_t>(std::sqrt(static_cast<double>(file_size)));
+        block_size = std::clamp<uint64_t>(block_size, MIN_DELTA_BLOCK_SIZE, MAX_DELTA_BLOCK_SIZE);
+        return block_size - block_size % MIN_DELTA_BLOCK_SIZE;
+    }
+
+    // Reads exactly `length` bytes at `offset` in the file.
+    // Returns false and leaves `errno` set if reading fails. If the file ends first, `errno` is set to EIO.
+    bool read_exactly(int fd, uint8_t* buffer, size_t length, uint64_t offset) {
+        size_t total_read = 0;
+        while(total_read < length) {
+            ssize_t bytes_read = pread(fd, buffer + total_read, length - total_read, offset + total_read);
+            if(bytes_read == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }   else if(bytes_read == 0) {
+                errno = EIO;
+                return false;
+            }
+            total_read += bytes_read;
+        }
+        return true;
+    }
+
+    ResponseStatus get_block_checksums(const std::string& path,
+        uint64_t& out_file_size,
+        uint32_t& out_block_size,
+        std::vector<BlockChecksum>& out_blocks) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd == -1) {
+            return get_status_from_errno();
+        }
+
+        struct stat posix_stat;
+        if(fstat(fd, &posix_stat) == -1) {
+            ResponseStatus status = get_status_from_errno();
+            close(fd);
+            return status;
+        }   else if(!S_ISREG(posix_stat.st_mode))   {
+            close(fd);
+            return ResponseStatus::NotAFile;
+        }
+
+        uint64_t file_size = posix_stat.st_size;
+        uint32_t block_size = choose_delta_block_size(file_size);
+        uint64_t block_count = file_size / block_size;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        uint32_t blocks_per_read = std::max<uint32_t>(DELTA_READ_LEN / block_size, 1);
+        std::vector<uint8_t> buffer(blocks_per_read * block_size);
+        out_blocks.clear();
+        out_blocks.reserve(block_count);
+        while(out_blocks.size() < block_count) {
+            uint32_t read_blocks = std::min<uint64_t>(blocks_per_read, block_count - out_blocks.size());
+            if(!read_exactly(fd, buffer.data(), read_blocks * block_size, out_blocks.size() * block_size)) {
+                ResponseStatus status = get_status_from_errno();
+                close(fd);
+                return status;
+            }
+
+            for(uint32_t i = 0; i < read_blocks; i++) {
+                const uint8_t* block = buffer.data() + i * block_size;
+                RollingChecksum rolling;
+                rolling.reset(block, block_size);
+                Xxh3Hasher strong;
+                strong.update(block, block_size);
+                out_blocks.push_back(BlockChecksum { rolling.value(), strong.digest() });
+            }
+        }
+
+        close(fd);
+        out_file_size = file_size;
+        out_block_size = block_size;
+        return ResponseStatus::Success;
+    }
+
+    // Removes the temporary files left in the directory at `dir_path` by delta writes that never finished, e.g. because the daemon was killed.
+    // Each DeltaWriter holds a lock on its temporary file until it is done with it, so files that are still being written are left alone.
+    void remove_stale_delta_temps(const std::string& dir_path) {
+        DIR* dir = opendir(dir_path.c_str());
+        if(dir == nullptr) {
+            return;
+        }
+
+        size_t prefix_len = strlen(DELTA_TEMP_PREFIX);
+        time_t now = time(nullptr);
+        while(dirent* entry = readdir(dir)) {
+            if(strncmp(entry->d_name, DELTA_TEMP_PREFIX, prefix_len) != 0) {
+                continue;
+            }
+
+            int fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if(fd == -1) {
+                continue;
+            }
+
+            struct stat posix_stat;
+            if(fstat(fd, &posix_stat) == 0
+                && S_ISREG(posix_stat.st_mode)
+                && now - posix_stat.st_mtime >= STALE_DELTA_TEMP_AGE_SECS
+                && flock(fd, LOCK_EX | LOCK_NB) == 0) {
+                unlinkat(dirfd(dir), entry->d_name, 0);
+            }
+            close(fd);
+        }
+        closedir(dir);
+    }
+
+    DeltaWriter::DeltaWriter(const std::string& path, uint32_t block_size) {
+        this->path = path;
+        this->block_size = block_size;
+
+        struct stat posix_stat;
+        existing_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(existing_fd == -1 || fstat(existing_fd, &posix_stat) == -1) {
+            status = get_status_from_errno();
+            return;
+        }   else if(!S_ISREG(posix_stat.st_mode) || block_size == 0)  {
+            status = ResponseStatus::NotAFile;
+            return;
+        }
+        existing_size = posix_stat.st_size;
+
+        size_t last_slash = path.rfind('/');
+        std::string dir_path = last_slash == std::string::npos ? "." : path.substr(0, std::max<size_t>(last_slash, 1));
+        remove_stale_delta_temps(dir_path);
+
+        // The name is unique so that two delta writes to the same file cannot use the same temporary file.
+        // It is opened for reading and writing, since the literal data is read back from it to hash it.
+        std::string temp_template = dir_path + "/" + DELTA_TEMP_PREFIX + "XXXXXX";
+        temp_fd = mkostemp(temp_template.data(), O_CLOEXEC);
+        if(temp_fd == -1) {
+            status = get_status_from_errno();
+            return;
+        }
+        temp_path = temp_template;
+
+        if(flock(temp_fd, LOCK_EX) == -1 || fchmod(temp_fd, posix_stat.st_mode & 07777) == -1) {
+            status = get_status_from_errno();
+        }
+    }
+
+    DeltaWriter::~DeltaWriter() {
+        if(existing_fd != -1) {
+            close(existing_fd);
+        }
+        if(temp_fd != -1) {
+            close(temp_fd);
+            unlink(temp_path.c_str());
+        }
+    }
+
+    void DeltaWriter::add_segment(bool is_copy, uint64_t length, uint64_t source_offset) {
+        if(!segments.empty()) {
+            Segment& last = segments.back();
+            if(last.is_copy == is_copy && (!is_copy || last.source_offset + last.length == source_offset)) {
+                last.length += length;
+                new_size += length;
+                return;
+            }
+        }
+
+        segments.push_back(Segment { is_copy, new_size, length, source_offset });
+        new_size += length;
+    }
+
+    void DeltaWriter::copy_blocks(uint32_t first_block, uint32_t count) {
+        if(status != ResponseStatus::Success) {
+            return;
+        }   else if(((uint64_t) first_block + count) * block_size > existing_size)  {
+            status = ResponseStatus::GenericFailure;
+            return;
+        }
+
+        add_segment(true, (uint64_t) count * block_size, (uint64_t) first_block * block_size);
+    }
+
+    uint64_t DeltaWriter::add_literal(uint32_t length, int& out_fd) {
+        if(length > MAX_DELTA_LITERAL_LEN) {
+            status = ResponseStatus::GenericFailure;
+        }
+        if(status != ResponseStatus::Success) {
+            out_fd = -1;
+            return 0;
+        }
+
+        uint64_t offset = new_size;
+        add_segment(false, length, 0);
+        out_fd = temp_fd;
+        return offset;
+    }
+
+    void DeltaWriter::literal_written(ResponseStatus write_status) {
+        if(status == ResponseStatus::Success) {
+            status = write_status;
+        }
+    }
+
+    // Writes all of `data` to the file with descriptor `fd`, starting at `offset`.
+    // Returns false and leaves `errno` set if writing fails.
+    bool write_exactly(int fd, const uint8_t* data, size_t length, uint64_t offset) {
+        size_t written = 0;
+        while(written < length) {
+            ssize_t result = pwrite(fd, data + written, length - written, offset + written);
+            if(result == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            written += result;
+        }
+        return true;
+    }
+
+    ResponseStatus DeltaWriter::finish(uint64_t expected_hash) {
+        if(status != ResponseStatus::Success) {
+            return status;
+        }
+
+        // Go through the new contents in order, so that they can be hashed.
+        // Copied runs are hashed as they are copied, and the literal data is read back from the temporary file.
+        posix_fadvise(existing_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        copy_buffer.resize(std::max<uint32_t>(DELTA_READ_LEN / block_size, 1) * block_size);
+        Xxh3Hasher hasher;
+        for(const Segment& segment : segments) {
+            uint64_t done = 0;
+            while(done < segment.length) {
+                size_t chunk_len = std::min<uint64_t>(copy_buffer.size(), segment.length - done);
+                if(segment.is_copy) {
+                    if(!read_exactly(existing_fd, copy_buffer.data(), chunk_len, segment.source_offset + done)
+                        || !write_exactly(temp_fd, copy_buffer.data(), chunk_len, segment.offset + done)) {
+                        return get_status_from_errno();
+                    }
+                }   else if(!read_exactly(temp_fd, copy_buffer.data(), chunk_len, segment.offset + done))   {
+                    return get_status_from_errno();
+                }
+
+                hasher.update(copy_buffer.data(), chunk_len);
+                done += chunk_len;
+            }
+        }
+
+        if(hasher.digest() != expected_hash) {
+            // The existing file changed after its checksums were taken, so the wrong data may have been copied.
+            return ResponseStatus::GenericFailure;
+        }
+
+        // Make sure the new contents are on disk before they replace the existing file.
+        if(fsync(temp_fd) == -1) {
+            return get_status_from_errno();
+        }
+        if(rename(temp_path.c_str(), path.c_str()) == -1) {
+            return get_status_from_errno();
+        }
+
+        close(temp_fd);
+        temp_fd = -1;
+        return ResponseStatus::Success;
+    }
+}
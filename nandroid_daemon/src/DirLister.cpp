@@ -0,0 +1,304 @@
+#include "DirLister.hpp"
+#include "UnixException.hpp"
+#include "path_utils.hpp"
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace nandroidfs {
+    // Size of the buffer that directory entries are read into by each call to `getdents64`.
+    const size_t DIRENT_BUFFER_SIZE = 65536;
+    // Number of threads used to list the directories in a tree, including the thread that requested the listing.
+    const int TREE_WALK_THREADS = 4;
+
+    // The layout of each entry returned by the `getdents64` syscall.
+    struct LinuxDirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        uint16_t d_reclen;
+        uint8_t d_type;
+        char d_name[];
+    };
+
+    // An entry read from a directory that has not yet been statted.
+    struct RawDirEntry {
+        uint64_t inode;
+        uint8_t type;
+        std::string name;
+    };
+
+    FileStat to_file_stat(const struct stat& posix_stat) {
+        return FileStat(posix_stat.st_mode,
+            posix_stat.st_size,
+            posix_stat.st_atime,
+            posix_stat.st_mtime);
+    }
+
+    // Reads every entry in the directory with the given file descriptor.
+    // Returns false and leaves `errno` set if reading fails.
+    bool read_dir_entries(int dir_fd, std::vector<RawDirEntry>& out_entries) {
+        std::vector<uint8_t> buffer(DIRENT_BUFFER_SIZE);
+        while(true) {
+            long bytes_read = syscall(SYS_getdents64, dir_fd, buffer.data(), buffer.size());
+            if(bytes_read == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }   else if(bytes_read == 0) {
+                return true;
+            }
+
+            long position = 0;
+            while(position < bytes_read) {
+                LinuxDirent64* entry = reinterpret_cast<LinuxDirent64*>(&buffer[position]);
+                out_entries.push_back(RawDirEntry { entry->d_ino, entry->d_type, entry->d_name });
+                position += entry->d_reclen;
+            }
+        }
+    }
+
+    ResponseStatus list_directory(const char* path, std::vector<DirEntryStat>& out_entries) {
+        int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(dir_fd == -1) {
+            return get_status_from_errno();
+        }
+
+        std::vector<RawDirEntry> raw_entries;
+        if(!read_dir_entries(dir_fd, raw_entries)) {
+            ResponseStatus status = get_status_from_errno();
+            close(dir_fd);
+            return status;
+        }
+
+        // Stat the entries in inode order, since on ext4 and f2fs this roughly matches the order of the inodes on disk.
+        std::sort(raw_entries.begin(), raw_entries.end(), [](const RawDirEntry& a, const RawDirEntry& b) {
+            return a.inode < b.inode;
+        });
+
+        out_entries.reserve(out_entries.size() + raw_entries.size());
+        for(RawDirEntry& raw_entry : raw_entries) {
+            DirEntryStat entry;
+            entry.is_symlink = raw_entry.type == DT_LNK;
+            struct stat posix_stat;
+            int result;
+            if(raw_entry.name == ".") {
+                // This is the directory itself, which we already have open.
+                result = fstat(dir_fd, &posix_stat);
+            }   else if(raw_entry.type == DT_UNKNOWN)    {
+                // The filesystem does not report the entry type, so we need to check whether it is a symbolic link.
+                result = fstatat(dir_fd, raw_entry.name.c_str(), &posix_stat, AT_SYMLINK_NOFOLLOW);
+                if(result == 0 && S_ISLNK(posix_stat.st_mode)) {
+                    entry.is_symlink = true;
+                    result = fstatat(dir_fd, raw_entry.name.c_str(), &posix_stat, 0);
+                }
+            }   else    {
+                // Only symbolic links need to be followed.
+                result = fstatat(dir_fd, raw_entry.name.c_str(), &posix_stat, entry.is_symlink ? 0 : AT_SYMLINK_NOFOLLOW);
+            }
+
+            if(result == -1) {
+                entry.status = get_status_from_errno();
+            }   else    {
+                entry.status = ResponseStatus::Success;
+                entry.stat = to_file_stat(posix_stat);
+            }
+            entry.name = std::move(raw_entry.name);
+            out_entries.push_back(std::move(entry));
+        }
+
+        close(dir_fd);
+        return ResponseStatus::Success;
+    }
+
+    // The state of a tree listing, shared between the threads listing it.
+    struct TreeWalk {
+        std::string root_path;
+        uint16_t max_depth;
+        uint32_t max_entries;
+        std::vector<TreeDirListing>& listings;
+
+        std::mutex mutex;
+        // Notified when a directory is queued, or once there is nothing left to do.
+        std::condition_variable work_changed;
+        // The relative path and depth of each directory that has been found but not yet listed.
+        std::deque<std::pair<std::string, uint16_t>> pending;
+        // The number of threads currently listing a directory.
+        int busy_threads = 0;
+        uint32_t total_entries = 0;
+        bool truncated = false;
+
+        TreeWalk(const std::string& root_path, uint16_t max_depth, uint32_t max_entries, std::vector<TreeDirListing>& listings)
+            : root_path(root_path), max_depth(max_depth), max_entries(max_entries), listings(listings) { }
+
+        // Adds the listing of a directory to the results, and queues its subdirectories to be listed.
+        // `mutex` must be held.
+        void add_listing(std::string relative_path, uint16_t depth, std::vector<DirEntryStat> entries) {
+            if(truncated) {
+                return;
+            }
+            if(total_entries + entries.size() > max_entries) {
+                // Only complete directories are returned, so stop here rather than returning part of this one.
+                truncated = true;
+                pending.clear();
+                return;
+            }
+            total_entries += entries.size();
+
+            if(depth < max_depth) {
+                for(DirEntryStat& entry : entries) {
+                    if(entry.status == ResponseStatus::Success && S_ISDIR(entry.stat.mode) && !entry.is_symlink
+                        && entry.name != "." && entry.name != "..") {
+                        std::string child_path = relative_path.empty() ? entry.name : get_full_path(relative_path, entry.name);
+                        pending.push_back(std::make_pair(std::move(child_path), depth + 1));
+                    }
+                }
+            }
+
+            listings.push_back(TreeDirListing { std::move(relative_path), std::move(entries) });
+        }
+
+        // Lists directories from `pending` until every directory in the tree has been listed.
+        void thread_entry_point() {
+            std::unique_lock lock(mutex);
+            while(true) {
+                work_changed.wait(lock, [this] { return !pending.empty() || busy_threads == 0; });
+                if(pending.empty()) {
+                    // No directories are left to list, and none are being listed that might contain more.
+                    return;
+                }
+
+                auto [relative_path, depth] = std::move(pending.front());
+                pending.pop_front();
+                busy_threads++;
+                lock.unlock();
+
+                std::vector<DirEntryStat> entries;
+                ResponseStatus status = list_directory(get_full_path(root_path, relative_path).c_str(), entries);
+
+                lock.lock();
+                busy_threads--;
+                if(status == ResponseStatus::Success) {
+                    add_listing(std::move(relative_path), depth, std::move(entries));
+                }
+                work_changed.notify_all();
+            }
+        }
+    };
+
+    ResponseStatus list_tree(const std::string& root_path, uint16_t max_depth, uint32_t max_entries,
+        std::vector<TreeDirListing>& out_listings, bool& out_truncated) {
+        std::vector<DirEntryStat> root_entries;
+        ResponseStatus status = list_directory(root_path.c_str(), root_entries);
+        if(status != ResponseStatus::Success) {
+            return status;
+        }
+
+        TreeWalk walk(root_path, max_depth, max_entries, out_listings);
+        walk.add_listing("", 0, std::move(root_entries));
+
+        // No other threads are running yet, so there is no need to lock.
+        if(!walk.pending.empty()) {
+            std::vector<std::thread> threads;
+            for(int i = 1; i < TREE_WALK_THREADS; i++) {
+                threads.push_back(std::thread(&TreeWalk::thread_entry_point, &walk));
+            }
+            walk.thread_entry_point();
+
+            for(std::thread& thread : threads) {
+                thread.join();
+            }
+        }
+
+        out_truncated = walk.truncated;
+        return ResponseStatus::Success;
+    }
+
+    // Saves `status` as the result of removing a tree, unless an earlier failure has already been saved.
+    void record_remove_failure(RemoveTreeResult& result, ResponseStatus status) {
+        if(result.status == ResponseStatus::Success) {
+            result.status = status;
+        }
+    }
+
+    // Removes every entry in the directory with descriptor `dir_fd`, then closes it.
+    void remove_dir_contents(int dir_fd, RemoveTreeResult& result) {
+        std::vector<RawDirEntry> entries;
+        if(!read_dir_entries(dir_fd, entries)) {
+            record_remove_failure(result, get_status_from_errno());
+            close(dir_fd);
+            return;
+        }
+
+        for(RawDirEntry& entry : entries) {
+            if(entry.name == "." || entry.name == "..") {
+                continue;
+            }
+
+            bool is_directory = entry.type == DT_DIR;
+            if(entry.type == DT_UNKNOWN) {
+                struct stat posix_stat;
+                is_directory = fstatat(dir_fd, entry.name.c_str(), &posix_stat, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(posix_stat.st_mode);
+            }
+
+            if(is_directory) {
+                int child_fd = openat(dir_fd, entry.name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if(child_fd == -1) {
+                    record_remove_failure(result, get_status_from_errno());
+                    continue;
+                }
+                remove_dir_contents(child_fd, result);
+
+                if(unlinkat(dir_fd, entry.name.c_str(), AT_REMOVEDIR) == -1) {
+                    record_remove_failure(result, get_status_from_errno());
+                }   else    {
+                    result.directories_removed++;
+                }
+            }   else if(unlinkat(dir_fd, entry.name.c_str(), 0) == -1)    {
+                record_remove_failure(result, get_status_from_errno());
+            }   else    {
+                result.files_removed++;
+            }
+        }
+
+        close(dir_fd);
+    }
+
+    RemoveTreeResult remove_tree(const std::string& path) {
+        RemoveTreeResult result;
+        struct stat posix_stat;
+        if(lstat(path.c_str(), &posix_stat) == -1) {
+            result.status = get_status_from_errno();
+            return result;
+        }
+
+        if(!S_ISDIR(posix_stat.st_mode)) {
+            if(unlink(path.c_str()) == -1) {
+                result.status = get_status_from_errno();
+            }   else    {
+                result.files_removed++;
+            }
+            return result;
+        }
+
+        int dir_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if(dir_fd == -1) {
+            result.status = get_status_from_errno();
+            return result;
+        }
+        remove_dir_contents(dir_fd, result);
+
+        if(rmdir(path.c_str()) == -1) {
+            record_remove_failure(result, get_status_from_errno());
+        }   else    {
+            result.directories_removed++;
+        }
+        return result;
+    }
+}
@@ -0,0 +1,272 @@
+#include "FileCopier.hpp"
+#include "DirLister.hpp"
+#include "UnixException.hpp"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <chrono>
+#include <vector>
+
+namespace nandroidfs {
+    // Maximum length copied by each call to `copy_file_range`, so that progress is reported regularly.
+    const size_t COPY_RANGE_CHUNK_SIZE = 16 * 1024 * 1024;
+    // Size of the buffer used to copy files when `copy_file_range` is not supported.
+    const size_t COPY_BUFFER_SIZE = 1024 * 1024;
+    // Minimum time between calls to the progress callback.
+    const std::chrono::milliseconds COPY_PROGRESS_INTERVAL(500);
+
+    // The state of a copy, shared by the functions copying each entry.
+    struct CopyState {
+        bool replace_if_exists;
+        CopyProgressCallback report_progress;
+        uint64_t bytes_copied = 0;
+        uint64_t entries_copied = 0;
+        std::chrono::steady_clock::time_point last_report;
+        // Cleared once `copy_file_range` is found not to work, so that it is not attempted for every file.
+        bool use_copy_range = true;
+        std::vector<uint8_t> buffer;
+    };
+
+    // Reports the progress of the copy, unless it has been reported recently.
+    void report_progress_if_due(CopyState& state) {
+        auto now = std::chrono::steady_clock::now();
+        if(now - state.last_report >= COPY_PROGRESS_INTERVAL) {
+            state.last_report = now;
+            state.report_progress(state.bytes_copied, state.entries_copied);
+        }
+    }
+
+    // Adds `length` to the number of bytes copied.
+    void add_progress(CopyState& state, uint64_t length) {
+        state.bytes_copied += length;
+        report_progress_if_due(state);
+    }
+
+    // Adds an entry that has been fully copied to the number of entries copied.
+    void add_entry_copied(CopyState& state) {
+        state.entries_copied++;
+        report_progress_if_due(state);
+    }
+
+    // Copies the data of the file with descriptor `from_fd` to `to_fd` with `copy_file_range`.
+    // Returns false and leaves `errno` set if copying fails.
+    // `state.use_copy_range` is cleared if the kernel cannot copy between the files, in which case nothing has been copied.
+    bool copy_data_in_kernel(CopyState& state, int from_fd, int to_fd) {
+        while(true) {
+            long copied = syscall(SYS_copy_file_range, from_fd, nullptr, to_fd, nullptr, COPY_RANGE_CHUNK_SIZE, 0);
+            if(copied == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }   else if(errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)    {
+                    // Only possible before anything is copied, since the same files are used for every call.
+                    state.use_copy_range = false;
+                }
+                return false;
+            }   else if(copied == 0) {
+                return true;
+            }
+
+            add_progress(state, copied);
+        }
+    }
+
+    // Copies the data of the file with descriptor `from_fd` to `to_fd` through a buffer.
+    // Returns false and leaves `errno` set if copying fails.
+    bool copy_data_buffered(CopyState& state, int from_fd, int to_fd) {
+        state.buffer.resize(COPY_BUFFER_SIZE);
+        while(true) {
+            ssize_t bytes_read = read(from_fd, state.buffer.data(), state.buffer.size());
+            if(bytes_read == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }   else if(bytes_read == 0) {
+                return true;
+            }
+
+            ssize_t written = 0;
+            while(written < bytes_read) {
+                ssize_t result = write(to_fd, state.buffer.data() + written, bytes_read - written);
+                if(result == -1) {
+                    if(errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                written += result;
+            }
+
+            add_progress(state, bytes_read);
+        }
+    }
+
+    ResponseStatus copy_file(CopyState& state, const std::string& from_path, const std::string& to_path) {
+        int from_fd = open(from_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(from_fd == -1) {
+            return get_status_from_errno();
+        }
+
+        // The listing the file was found in has its stat, but only with the precision sent to the client.
+        // Statting the open file is cheap, since its inode has already been found, and gives the times to the nanosecond.
+        struct stat from_stat;
+        if(fstat(from_fd, &from_stat) == -1) {
+            ResponseStatus status = get_status_from_errno();
+            close(from_fd);
+            return status;
+        }
+
+        int to_flags = O_WRONLY | O_CREAT | O_CLOEXEC | (state.replace_if_exists ? O_TRUNC : O_EXCL);
+        int to_fd = open(to_path.c_str(), to_flags, from_stat.st_mode & 07777);
+        if(to_fd == -1) {
+            ResponseStatus status = get_status_from_errno();
+            close(from_fd);
+            return status;
+        }
+
+        // The copy is sequential and the source is unlikely to be read again soon.
+        posix_fadvise(from_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        bool copied = false;
+        if(state.use_copy_range) {
+            copied = copy_data_in_kernel(state, from_fd, to_fd);
+        }
+        if(!copied && !state.use_copy_range) {
+            copied = copy_data_buffered(state, from_fd, to_fd);
+        }
+
+        ResponseStatus status = ResponseStatus::Success;
+        if(!copied) {
+            status = get_status_from_errno();
+        }   else    {
+            // Keep the times of the original file, as windows does when copying.
+            struct timespec times[2] = { from_stat.st_atim, from_stat.st_mtim };
+            futimens(to_fd, times);
+        }
+
+        close(from_fd);
+        if(close(to_fd) == -1 && status == ResponseStatus::Success) {
+            status = get_status_from_errno();
+        }
+        return status;
+    }
+
+    ResponseStatus copy_symlink(CopyState& state, const std::string& from_path, const std::string& to_path) {
+        std::vector<char> target(PATH_MAX);
+        ssize_t target_len = readlink(from_path.c_str(), target.data(), target.size() - 1);
+        if(target_len == -1) {
+            return get_status_from_errno();
+        }
+        target[target_len] = '\0';
+
+        if(state.replace_if_exists && unlink(to_path.c_str()) == -1 && errno != ENOENT) {
+            return get_status_from_errno();
+        }
+        if(symlink(target.data(), to_path.c_str()) == -1) {
+            return get_status_from_errno();
+        }
+        return ResponseStatus::Success;
+    }
+
+    ResponseStatus copy_tree(CopyState& state, const std::string& from_path, const std::string& to_path, mode_t from_mode, bool is_symlink);
+
+    // Copies the directory at `from_path`, which has the mode `from_mode`, and everything within it to `to_path`.
+    // Each directory is listed once, and the stats in the listing are used to copy its entries, so no entry is statted again by its path.
+    ResponseStatus copy_directory(CopyState& state, const std::string& from_path, const std::string& to_path, mode_t from_mode) {
+        if(mkdir(to_path.c_str(), from_mode & 07777) == -1) {
+            if(errno != EEXIST) {
+                return get_status_from_errno();
+            }
+
+            // Only copy into the existing entry if it is a directory.
+            struct stat to_stat;
+            if(!state.replace_if_exists || stat(to_path.c_str(), &to_stat) == -1 || !S_ISDIR(to_stat.st_mode)) {
+                return ResponseStatus::FileExists;
+            }
+        }
+
+        std::vector<DirEntryStat> entries;
+        ResponseStatus status = list_directory(from_path.c_str(), entries);
+        if(status != ResponseStatus::Success) {
+            return status;
+        }
+
+        const DirEntryStat* dir_entry = nullptr;
+        for(DirEntryStat& entry : entries) {
+            if(entry.name == ".") {
+                dir_entry = &entry;
+                continue;
+            }   else if(entry.name == "..")    {
+                continue;
+            }   else if(entry.status != ResponseStatus::Success)    {
+                return entry.status;
+            }
+
+            status = copy_tree(state, from_path + "/" + entry.name, to_path + "/" + entry.name, entry.stat.mode, entry.is_symlink);
+            if(status != ResponseStatus::Success) {
+                return status;
+            }
+        }
+
+        // Keep the times of the original directory, as is done for files. This must be done last, since copying the entries changes them.
+        // The times are only known to the second, which is the precision the client works with.
+        if(dir_entry && dir_entry->status == ResponseStatus::Success) {
+            struct timespec times[2] = {
+                { static_cast<time_t>(dir_entry->stat.access_time), 0 },
+                { static_cast<time_t>(dir_entry->stat.write_time), 0 }
+            };
+            utimensat(AT_FDCWD, to_path.c_str(), times, 0);
+        }
+
+        return ResponseStatus::Success;
+    }
+
+    // Copies the entry at `from_path`, which has the mode `from_mode`, to `to_path`.
+    // If `is_symlink` is true, the link itself is copied, and `from_mode` is ignored.
+    ResponseStatus copy_tree(CopyState& state, const std::string& from_path, const std::string& to_path, mode_t from_mode, bool is_symlink) {
+        ResponseStatus status;
+        if(is_symlink) {
+            status = copy_symlink(state, from_path, to_path);
+        }   else if(S_ISREG(from_mode))  {
+            status = copy_file(state, from_path, to_path);
+        }   else if(S_ISDIR(from_mode))    {
+            status = copy_directory(state, from_path, to_path, from_mode);
+        }   else    {
+            return ResponseStatus::NotAFile;
+        }
+
+        if(status == ResponseStatus::Success) {
+            add_entry_copied(state);
+        }
+        return status;
+    }
+
+    ResponseStatus copy_entry(const std::string& from_path,
+        const std::string& to_path,
+        bool replace_if_exists,
+        CopyProgressCallback report_progress,
+        uint64_t& out_bytes_copied) {
+        out_bytes_copied = 0;
+
+        // Copying a directory into itself would never finish.
+        if(to_path == from_path || to_path.starts_with(from_path + "/")) {
+            return ResponseStatus::GenericFailure;
+        }
+
+        struct stat from_stat;
+        if(lstat(from_path.c_str(), &from_stat) == -1) {
+            return get_status_from_errno();
+        }
+
+        CopyState state;
+        state.replace_if_exists = replace_if_exists;
+        state.report_progress = report_progress;
+        state.last_report = std::chrono::steady_clock::now();
+
+        ResponseStatus status = copy_tree(state, from_path, to_path, from_stat.st_mode, S_ISLNK(from_stat.st_mode));
+        out_bytes_copied = state.bytes_copied;
+        return status;
+    }
+}
@@ -0,0 +1,160 @@
+#include "Hashing.hpp"
+#include "UnixException.hpp"
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace nandroidfs {
+    // Size of the buffer each file is read into while hashing.
+    const size_t HASH_READ_BUFFER_SIZE = 1024 * 1024;
+    // The maximum number of threads used to hash the chunks of a Sha256Tree hash.
+    const unsigned int MAX_HASH_THREADS = 4;
+
+    // Reads exactly `length` bytes at `offset` in the file, unless the end of the file is reached first.
+    // Returns the number of bytes read, or -1 with `errno` set if reading fails.
+    ssize_t read_fully(int fd, uint8_t* buffer, size_t length, uint64_t offset) {
+        size_t total_read = 0;
+        while(total_read < length) {
+            ssize_t bytes_read = pread(fd, buffer + total_read, length - total_read, offset + total_read);
+            if(bytes_read == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }   else if(bytes_read == 0) {
+                break;
+            }
+            total_read += bytes_read;
+        }
+        return total_read;
+    }
+
+    ResponseStatus hash_xxh3(int fd, uint64_t offset, uint64_t length, std::vector<uint8_t>& out_digest, uint64_t& out_bytes_hashed) {
+        std::vector<uint8_t> buffer(std::min<uint64_t>(length, HASH_READ_BUFFER_SIZE));
+        Xxh3Hasher hasher;
+
+        uint64_t hashed = 0;
+        while(hashed < length) {
+            ssize_t bytes_read = read_fully(fd, buffer.data(), std::min<uint64_t>(length - hashed, buffer.size()), offset + hashed);
+            if(bytes_read == -1) {
+                return get_status_from_errno();
+            }   else if(bytes_read == 0) {
+                // The file was truncated while it was being hashed.
+                break;
+            }
+
+            hasher.update(buffer.data(), bytes_read);
+            hashed += bytes_read;
+        }
+
+        // Written big endian, which is the canonical form of an XXH3 hash.
+        uint64_t hash = hasher.digest();
+        out_digest.resize(sizeof(hash));
+        for(size_t i = 0; i < sizeof(hash); i++) {
+            out_digest[i] = (uint8_t) (hash >> (56 - 8 * i));
+        }
+        out_bytes_hashed = hashed;
+        return ResponseStatus::Success;
+    }
+
+    ResponseStatus hash_sha256_tree(int fd, uint64_t offset, uint64_t length, std::vector<uint8_t>& out_digest, uint64_t& out_bytes_hashed) {
+        size_t chunk_count = (length + HASH_TREE_CHUNK_SIZE - 1) / HASH_TREE_CHUNK_SIZE;
+        std::vector<uint8_t> chunk_digests(chunk_count * Sha256Hasher::DIGEST_LEN);
+
+        // Each thread takes the next chunk that has not been hashed until none are left.
+        std::atomic_size_t next_chunk = 0;
+        std::atomic<ResponseStatus> status = ResponseStatus::Success;
+        auto hash_chunks = [&]() {
+            std::vector<uint8_t> buffer(std::min<uint64_t>(length, HASH_READ_BUFFER_SIZE));
+            size_t chunk;
+            while(status == ResponseStatus::Success && (chunk = next_chunk++) < chunk_count) {
+                uint64_t chunk_offset = (uint64_t) chunk * HASH_TREE_CHUNK_SIZE;
+                uint64_t chunk_len = std::min<uint64_t>(length - chunk_offset, HASH_TREE_CHUNK_SIZE);
+
+                Sha256Hasher hasher;
+                uint64_t hashed = 0;
+                while(hashed < chunk_len) {
+                    ssize_t bytes_read = read_fully(fd, buffer.data(), std::min<uint64_t>(chunk_len - hashed, buffer.size()),
+                        offset + chunk_offset + hashed);
+                    if(bytes_read <= 0) {
+                        // The chunks are hashed out of order, so a file truncated while hashing cannot be cut short cleanly.
+                        status = bytes_read == -1 ? get_status_from_errno() : ResponseStatus::GenericFailure;
+                        return;
+                    }
+
+                    hasher.update(buffer.data(), bytes_read);
+                    hashed += bytes_read;
+                }
+                hasher.digest(chunk_digests.data() + chunk * Sha256Hasher::DIGEST_LEN);
+            }
+        };
+
+        unsigned int thread_count = std::clamp<unsigned int>(std::thread::hardware_concurrency(), 1, MAX_HASH_THREADS);
+        thread_count = std::min<size_t>(thread_count, chunk_count);
+        std::vector<std::thread> threads;
+        // The calling thread hashes chunks too.
+        for(unsigned int i = 1; i < thread_count; i++) {
+            threads.emplace_back(hash_chunks);
+        }
+        hash_chunks();
+        for(std::thread& thread : threads) {
+            thread.join();
+        }
+
+        if(status != ResponseStatus::Success) {
+            return status;
+        }
+
+        Sha256Hasher root_hasher;
+        root_hasher.update(chunk_digests.data(), chunk_digests.size());
+        out_digest.resize(Sha256Hasher::DIGEST_LEN);
+        root_hasher.digest(out_digest.data());
+        out_bytes_hashed = length;
+        return ResponseStatus::Success;
+    }
+
+    ResponseStatus hash_file_range(const std::string& path,
+        uint64_t offset,
+        uint64_t length,
+        HashAlgorithm algorithm,
+        std::vector<uint8_t>& out_digest,
+        uint64_t& out_bytes_hashed) {
+        out_bytes_hashed = 0;
+        if(algorithm != HashAlgorithm::Xxh3 && algorithm != HashAlgorithm::Sha256Tree) {
+            return ResponseStatus::GenericFailure;
+        }
+
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd == -1) {
+            return get_status_from_errno();
+        }
+
+        struct stat posix_stat;
+        if(fstat(fd, &posix_stat) == -1) {
+            ResponseStatus status = get_status_from_errno();
+            close(fd);
+            return status;
+        }   else if(S_ISDIR(posix_stat.st_mode))    {
+            close(fd);
+            return ResponseStatus::NotAFile;
+        }
+
+        uint64_t file_size = posix_stat.st_size;
+        length = offset >= file_size ? 0 : std::min(length, file_size - offset);
+        // The range is read once from start to end, so the kernel should read ahead as far as it can.
+        posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+
+        ResponseStatus status;
+        if(algorithm == HashAlgorithm::Xxh3) {
+            status = hash_xxh3(fd, offset, length, out_digest, out_bytes_hashed);
+        }   else    {
+            status = hash_sha256_tree(fd, offset, length, out_digest, out_bytes_hashed);
+        }
+
+        close(fd);
+        return status;
+    }
+}
@@ -20,4 +20,24 @@ namespace nandroidfs {
             return return_val;
         }
     }
+
+    ResponseStatus get_status_from_errno() {
+        int err_num = errno;
+        switch(err_num) {
+            case EACCES:
+                return ResponseStatus::AccessDenied;
+            case ENOENT:
+                return ResponseStatus::FileNotFound;
+            case EEXIST:
+                return ResponseStatus::FileExists;
+            case ENOTDIR:
+                return ResponseStatus::NotADirectory;
+            case EISDIR:
+                return ResponseStatus::NotAFile;
+            case ENOTEMPTY:
+                return ResponseStatus::DirectoryNotEmpty;
+            default:
+                return ResponseStatus::GenericFailure;
+        }
+    }
 }
\ No newline at end of file
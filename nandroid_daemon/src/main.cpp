@@ -4,24 +4,93 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <signal.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
 #include "UnixException.hpp"
 #include "ClientHandler.hpp"
 #include "requests.hpp"
 
 using namespace nandroidfs;
 
+// Maximum number of connections waiting to be accepted.
+// The client opens a pool of connections at once, so this should be at least the size of that pool.
+const int MAX_PENDING_CONNECTIONS = 16;
+
+// Once the last client disconnects, the daemon shuts down if no client connects within this time.
+// The client opens its pool of connections one after the other, so the first of them closing, e.g. because its handshake failed,
+// must not shut the daemon down while the rest are still connecting.
+// This is shorter than the time the client waits for the daemon to exit after unmounting, before killing it.
+const auto IDLE_SHUTDOWN_DELAY = std::chrono::milliseconds(1000);
+
 int server_sock = -1;
+
+// Number of clients currently being handled.
+// Once no clients have been connected for IDLE_SHUTDOWN_DELAY, the daemon shuts down.
+std::mutex clients_mutex;
+std::condition_variable clients_changed;
+int connected_clients = 0;
+// Whether any client has connected yet. The daemon waits for the first client for as long as it takes.
+bool had_client = false;
+// Set once no more clients are being accepted.
+bool server_stopped = false;
+
 void handle_client(int client_sock) {
+	// The handler closes the socket once it has been created, but if creating it fails, e.g. as the handshake failed, the socket is closed here.
+	bool handler_created = false;
 	try
 	{
 		ClientHandler handler(client_sock);
+		handler_created = true;
 		handler.handle_messages();
-		std::cout << "Goodbye, handled connection so shutting down" << std::endl;
 	}
 	catch(const std::exception& e)
 	{
 		std::cerr << "Disconnected from client due to an error: " << e.what() << std::endl;
+		if(!handler_created) {
+			close(client_sock);
+		}
+	}
+
+	{
+		std::lock_guard lock(clients_mutex);
+		connected_clients--;
+	}
+	clients_changed.notify_all();
+}
+
+// Entry point for a thread that shuts down the server once no clients have been connected for IDLE_SHUTDOWN_DELAY.
+void idle_shutdown_entry_point() {
+	std::unique_lock lock(clients_mutex);
+	while(true) {
+		clients_changed.wait(lock, [] { return server_stopped || (had_client && connected_clients == 0); });
+		if(server_stopped) {
+			return;
+		}
+
+		// Wait to see if another client connects before giving up.
+		bool reconnected = clients_changed.wait_for(lock, IDLE_SHUTDOWN_DELAY, [] { return server_stopped || connected_clients > 0; });
+		if(!reconnected) {
+			break;
+		}
+	}
+
+	std::cout << "Goodbye, all clients disconnected so shutting down" << std::endl;
+	// Causes the `accept` call in `start_server` to fail, so that no more clients are accepted.
+	shutdown(server_sock, SHUT_RDWR);
+}
+
+// Stops the thread running `idle_shutdown_entry_point`, if it has not already shut down the server.
+void stop_idle_shutdown(std::thread& idle_shutdown_thread) {
+	{
+		std::lock_guard lock(clients_mutex);
+		server_stopped = true;
 	}
+	clients_changed.notify_all();
+	idle_shutdown_thread.join();
 }
 
 void start_server() {
@@ -30,27 +99,62 @@ void start_server() {
 	addr.sin_port = htons(AGENT_PORT);
 	addr.sin_addr.s_addr = inet_addr("0.0.0.0");
 	server_sock = throw_unless(socket(AF_INET, SOCK_STREAM, IPPROTO_TCP));
+	std::vector<std::thread> client_threads;
+	std::thread idle_shutdown_thread;
 	try
 	{
-		throw_unless(bind(server_sock, (struct sockaddr*) &addr, sizeof(addr)) == -1);
-		throw_unless(listen(server_sock, 1) == -1);
+		throw_unless(bind(server_sock, (struct sockaddr*) &addr, sizeof(addr)));
+		throw_unless(listen(server_sock, MAX_PENDING_CONNECTIONS));
 
 		std::cout << "Binded successfully to port, awaiting connection" << std::endl;
 		std::cout << AGENT_READY_MSG << std::endl;
 
-		// Keep accepting requests continuously
-		int client_sock = throw_unless(accept(server_sock, nullptr, nullptr));
-		handle_client(client_sock);
+		idle_shutdown_thread = std::thread(idle_shutdown_entry_point);
+		// Keep accepting connections until the daemon has been idle for IDLE_SHUTDOWN_DELAY.
+		// Each connection is handled on its own thread.
+		while(true) {
+			int client_sock = accept(server_sock, nullptr, nullptr);
+			if(client_sock == -1) {
+				if(errno == EINTR || errno == ECONNABORTED) {
+					continue;
+				}
+				if(errno != EINVAL) { // EINVAL indicates that the server socket was shut down.
+					std::cerr << "Failed to accept connection: " << strerror(errno) << std::endl;
+				}
+				break;
+			}
+
+			{
+				std::lock_guard lock(clients_mutex);
+				connected_clients++;
+				had_client = true;
+			}
+			clients_changed.notify_all();
+			client_threads.push_back(std::thread(handle_client, client_sock));
+		}
 	}
 	catch(const std::exception& e)
 	{
 		// Ensure the socket is closed, even if an exception is thrown.
+		if(idle_shutdown_thread.joinable()) {
+			stop_idle_shutdown(idle_shutdown_thread);
+		}
 		close(server_sock);
 		throw;
 	}
+
+	stop_idle_shutdown(idle_shutdown_thread);
+	for(std::thread& client_thread : client_threads) {
+		client_thread.join();
+	}
+	close(server_sock);
 }
 
 int main() {
+	// Writing to a socket after the client has disconnected should fail with EPIPE rather than killing the daemon.
+	// `sendfile` has no equivalent to the MSG_NOSIGNAL flag, so the signal is ignored for the whole process.
+	signal(SIGPIPE, SIG_IGN);
+
 	try
 	{
 		start_server();
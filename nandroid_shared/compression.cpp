@@ -0,0 +1,296 @@
+#include "compression.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace nandroidfs
+{
+    // The block format is that of LZ4: a series of sequences, each made up of a token byte, literals, then a match.
+    // The top 4 bits of the token give the literal length and the bottom 4 bits give the match length minus MIN_MATCH.
+    // If either is 15, it is continued in the following bytes, each of which is added to the length until one is not 255.
+    // The match is a 2 byte little endian offset back into the decompressed data. The last sequence has no match.
+    const uint32_t MIN_MATCH = 4;
+    // The last match must start at least this many bytes before the end of the block.
+    const uint32_t MATCH_START_LIMIT = 12;
+    // The last this many bytes of the block are always literals.
+    const uint32_t LAST_LITERALS = 5;
+    const uint32_t MAX_OFFSET = 65535;
+    const int HASH_BITS = 12;
+
+    // Blocks shorter than this are always sent raw.
+    const uint32_t MIN_COMPRESS_LEN = 64;
+    // is_worth_compressing samples this many runs of bytes, spread evenly across the data.
+    const uint32_t SAMPLE_RUNS = 16;
+    const uint32_t SAMPLE_RUN_LEN = 64;
+    // Data with a sampled entropy (in bits per byte) at or above this is not worth compressing.
+    // Random data sampled this way measures roughly 7.7 bits per byte.
+    const double MAX_COMPRESSIBLE_ENTROPY = 7.0;
+
+    // Scratch space used to hold compressed blocks.
+    thread_local std::vector<uint8_t> compression_buffer;
+
+    uint32_t read_u32_unaligned(const uint8_t* ptr) {
+        uint32_t result;
+        memcpy(&result, ptr, 4);
+        return result;
+    }
+
+    uint32_t hash_sequence(uint32_t sequence) {
+        return (sequence * 2654435761U) >> (32 - HASH_BITS);
+    }
+
+    // Gets the number of bytes needed to encode a length in a token, given the number of bits available in the token.
+    uint32_t length_extension_size(uint32_t length) {
+        return length >= 15 ? (length - 15) / 255 + 1 : 0;
+    }
+
+    void write_length_extension(uint8_t*& out, uint32_t length) {
+        if(length < 15) {
+            return;
+        }
+
+        length -= 15;
+        while(length >= 255) {
+            *out++ = 255;
+            length -= 255;
+        }
+        *out++ = static_cast<uint8_t>(length);
+    }
+
+    // Writes a sequence with the given literals, followed by a match unless `match_len` is 0.
+    // Returns false if there is not enough space before `out_end`.
+    bool write_sequence(uint8_t*& out, uint8_t* out_end, const uint8_t* literals, uint32_t literal_len, uint32_t offset, uint32_t match_len) {
+        bool has_match = match_len > 0;
+        uint32_t required = 1 + length_extension_size(literal_len) + literal_len;
+        if(has_match) {
+            match_len -= MIN_MATCH;
+            required += 2 + length_extension_size(match_len);
+        }
+        if(required > out_end - out) {
+            return false;
+        }
+
+        *out++ = static_cast<uint8_t>((std::min(literal_len, 15U) << 4) | std::min(match_len, 15U));
+        write_length_extension(out, literal_len);
+        memcpy(out, literals, literal_len);
+        out += literal_len;
+
+        if(has_match) {
+            *out++ = static_cast<uint8_t>(offset);
+            *out++ = static_cast<uint8_t>(offset >> 8);
+            write_length_extension(out, match_len);
+        }
+        return true;
+    }
+
+    uint32_t compress_block(const uint8_t* data, uint32_t length, uint8_t* out, uint32_t capacity) {
+        if(length < MIN_COMPRESS_LEN) {
+            return 0;
+        }
+
+        // The position of the last occurrence of each hashed 4 byte sequence.
+        uint16_t positions[1 << HASH_BITS] = { 0 };
+
+        const uint8_t* data_end = data + length;
+        const uint8_t* match_start_limit = data_end - MATCH_START_LIMIT;
+        const uint8_t* match_end_limit = data_end - LAST_LITERALS;
+        uint8_t* out_start = out;
+        uint8_t* out_end = out + capacity;
+
+        const uint8_t* literals_start = data;
+        const uint8_t* current = data + 1;
+        while(current < match_start_limit) {
+            uint32_t sequence = read_u32_unaligned(current);
+            uint32_t hash = hash_sequence(sequence);
+            const uint8_t* candidate = data + positions[hash];
+            positions[hash] = static_cast<uint16_t>(current - data);
+
+            if(candidate >= current || current - candidate > MAX_OFFSET || read_u32_unaligned(candidate) != sequence) {
+                // Skip ahead faster the longer we go without finding a match, since the data is probably not very compressible.
+                current += 1 + ((current - literals_start) >> 6);
+                continue;
+            }
+
+            // Extend the match backwards into the literals, then forwards as far as possible.
+            while(current > literals_start && candidate > data && current[-1] == candidate[-1]) {
+                current--;
+                candidate--;
+            }
+            const uint8_t* match_end = current + MIN_MATCH;
+            const uint8_t* candidate_end = candidate + MIN_MATCH;
+            while(match_end < match_end_limit && *match_end == *candidate_end) {
+                match_end++;
+                candidate_end++;
+            }
+
+            if(!write_sequence(out, out_end, literals_start, current - literals_start, current - candidate, match_end - current)) {
+                return 0;
+            }
+            current = match_end;
+            literals_start = current;
+        }
+
+        if(!write_sequence(out, out_end, literals_start, data_end - literals_start, 0, 0)) {
+            return 0;
+        }
+        return out - out_start;
+    }
+
+    // Reads the continuation of a length from a token.
+    uint32_t read_length_extension(const uint8_t*& data, const uint8_t* data_end, uint32_t length) {
+        if(length < 15) {
+            return length;
+        }
+
+        uint8_t next;
+        do {
+            if(data == data_end) {
+                throw std::runtime_error("Compressed block ended in the middle of a length");
+            }
+            next = *data++;
+            length += next;
+        } while(next == 255);
+
+        return length;
+    }
+
+    void decompress_block(const uint8_t* data, uint32_t compressed_len, uint8_t* out, uint32_t length) {
+        const uint8_t* data_end = data + compressed_len;
+        uint8_t* out_start = out;
+        uint8_t* out_end = out + length;
+
+        while(true) {
+            if(data == data_end) {
+                throw std::runtime_error("Compressed block ended before its last sequence");
+            }
+            uint8_t token = *data++;
+
+            uint32_t literal_len = read_length_extension(data, data_end, token >> 4);
+            if(literal_len > data_end - data || literal_len > out_end - out) {
+                throw std::runtime_error("Literals in compressed block are out of bounds");
+            }
+            memcpy(out, data, literal_len);
+            data += literal_len;
+            out += literal_len;
+
+            // The last sequence has no match.
+            if(data == data_end) {
+                break;
+            }
+
+            if(data_end - data < 2) {
+                throw std::runtime_error("Compressed block ended in the middle of a match offset");
+            }
+            uint32_t offset = data[0] | (data[1] << 8);
+            data += 2;
+            uint32_t match_len = read_length_extension(data, data_end, token & 15) + MIN_MATCH;
+            if(offset == 0 || offset > out - out_start || match_len > out_end - out) {
+                throw std::runtime_error("Match in compressed block is out of bounds");
+            }
+
+            const uint8_t* match = out - offset;
+            if(offset >= match_len) {
+                memcpy(out, match, match_len);
+                out += match_len;
+            }   else    {
+                // The match overlaps the data being written, so must be copied one byte at a time.
+                for(uint32_t i = 0; i < match_len; i++) {
+                    *out++ = *match++;
+                }
+            }
+        }
+
+        if(out != out_end) {
+            throw std::runtime_error("Compressed block did not decompress to the expected length");
+        }
+    }
+
+    bool is_worth_compressing(const uint8_t* data, uint32_t length) {
+        if(length < MIN_COMPRESS_LEN) {
+            return false;
+        }
+
+        uint32_t counts[256] = { 0 };
+        uint32_t sampled = 0;
+        if(length <= SAMPLE_RUNS * SAMPLE_RUN_LEN) {
+            for(uint32_t i = 0; i < length; i++) {
+                counts[data[i]]++;
+            }
+            sampled = length;
+        }   else    {
+            uint32_t stride = length / SAMPLE_RUNS;
+            for(uint32_t run = 0; run < SAMPLE_RUNS; run++) {
+                const uint8_t* run_start = data + run * stride;
+                for(uint32_t i = 0; i < SAMPLE_RUN_LEN; i++) {
+                    counts[run_start[i]]++;
+                }
+            }
+            sampled = SAMPLE_RUNS * SAMPLE_RUN_LEN;
+        }
+
+        // Estimate the Shannon entropy of the data from the frequency of each byte in the sample.
+        double entropy = 0.0;
+        for(uint32_t count : counts) {
+            if(count > 0) {
+                double probability = static_cast<double>(count) / sampled;
+                entropy -= probability * std::log2(probability);
+            }
+        }
+
+        return entropy < MAX_COMPRESSIBLE_ENTROPY;
+    }
+
+    bool write_block(DataWriter& writer, const uint8_t* data, uint32_t length) {
+        if(is_worth_compressing(data, length)) {
+            // Only use the compressed block if it is actually smaller.
+            compression_buffer.resize(COMPRESSION_CHUNK_SIZE);
+            uint32_t compressed_len = compress_block(data, length, &compression_buffer[0], length - 1);
+            if(compressed_len > 0) {
+                writer.write_u32(compressed_len | COMPRESSED_BLOCK_FLAG);
+                writer.write_exact(&compression_buffer[0], compressed_len);
+                return true;
+            }
+        }
+
+        writer.write_u32(length);
+        writer.write_exact(data, length);
+        return false;
+    }
+
+    void write_compressed(DataWriter& writer, const uint8_t* data, uint32_t length) {
+        while(length > 0) {
+            uint32_t block_len = std::min(length, COMPRESSION_CHUNK_SIZE);
+            write_block(writer, data, block_len);
+            data += block_len;
+            length -= block_len;
+        }
+    }
+
+    void read_compressed(DataReader& reader, uint8_t* into, uint32_t length) {
+        while(length > 0) {
+            uint32_t header = reader.read_u32();
+            uint32_t block_len;
+            if(header & COMPRESSED_BLOCK_FLAG) {
+                uint32_t compressed_len = header & ~COMPRESSED_BLOCK_FLAG;
+                if(compressed_len > COMPRESSION_CHUNK_SIZE) {
+                    throw std::runtime_error("Compressed block is too long");
+                }
+
+                compression_buffer.resize(COMPRESSION_CHUNK_SIZE);
+                reader.read_exact(&compression_buffer[0], compressed_len);
+                block_len = std::min(length, COMPRESSION_CHUNK_SIZE);
+                decompress_block(&compression_buffer[0], compressed_len, into, block_len);
+            }   else    {
+                block_len = header;
+                if(block_len == 0 || block_len > length) {
+                    throw std::runtime_error("Raw block length is invalid");
+                }
+                reader.read_exact(into, block_len);
+            }
+
+            into += block_len;
+            length -= block_len;
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "serialization.hpp"
+#include <cstdint>
+
+// Compression of data sent over the connection, which is enabled if both sides support it (see requests.hpp).
+// Compressed data is sent as a series of blocks, each beginning with a u32 header:
+// - If the COMPRESSED_BLOCK_FLAG bit is set, the rest of the header gives the length of the compressed block that follows,
+//   which decompresses to the next COMPRESSION_CHUNK_SIZE bytes of the data (or fewer, if less data remains).
+// - Otherwise, the header gives the length of the raw data that follows, which may be any length up to the length of the data remaining.
+// Blocks are compressed with an LZ4-style codec, and data that is unlikely to compress is sent raw without attempting to compress it.
+
+namespace nandroidfs
+{
+    // The maximum length of the data in a single compressed block.
+    // Must be no larger than 64KiB, since match offsets are 16 bits.
+    const uint32_t COMPRESSION_CHUNK_SIZE = 65536;
+    // Set in the header of a block if the block is compressed.
+    const uint32_t COMPRESSED_BLOCK_FLAG = 0x80000000;
+
+    // Compresses `length` bytes of `data` into `out`, which has space for `capacity` bytes.
+    // Returns the compressed length, or 0 if the data could not be compressed into `capacity` bytes.
+    // `length` must be no larger than COMPRESSION_CHUNK_SIZE.
+    uint32_t compress_block(const uint8_t* data, uint32_t length, uint8_t* out, uint32_t capacity);
+    // Decompresses the `compressed_len` bytes at `data` into `out`, which must decompress to exactly `length` bytes.
+    // Throws a runtime_error if the compressed data is invalid.
+    void decompress_block(const uint8_t* data, uint32_t compressed_len, uint8_t* out, uint32_t length);
+
+    // Checks a sample of the given data to estimate whether it is worth attempting to compress it.
+    // Data that is already compressed, such as images and APKs, will generally fail this check.
+    bool is_worth_compressing(const uint8_t* data, uint32_t length);
+
+    // Writes a single block containing `length` bytes of `data`, which must be no larger than COMPRESSION_CHUNK_SIZE.
+    // The block is compressed unless the data is not worth compressing or would not shrink.
+    // Returns true if the block was compressed.
+    bool write_block(DataWriter& writer, const uint8_t* data, uint32_t length);
+    // Writes `length` bytes of `data` as a series of blocks.
+    void write_compressed(DataWriter& writer, const uint8_t* data, uint32_t length);
+    // Reads `length` bytes of data written with `write_compressed` into `into`.
+    void read_compressed(DataReader& reader, uint8_t* into, uint32_t length);
+}
@@ -0,0 +1,14 @@
+#include "delta.hpp"
+
+namespace nandroidfs
+{
+    void RollingChecksum::reset(const uint8_t* data, uint32_t length) {
+        this->length = length;
+        sum = 0;
+        weighted_sum = 0;
+        for(uint32_t i = 0; i < length; i++) {
+            sum += data[i];
+            weighted_sum += (length - i) * data[i];
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+
+// Delta writes replace the contents of a file on the device while only sending the parts of the new contents that are not
+// already somewhere in the existing file, in the same way as rsync.
+// The daemon splits the existing file into blocks and sends a rolling checksum and a strong checksum of each (see RequestType::GetBlockChecksums).
+// The client slides a window the length of a block over the new contents, and wherever the rolling checksum of the window matches a block,
+// compares the strong checksums to confirm the match. The new contents are then sent as a series of DeltaOps (see RequestType::WriteDelta),
+// copying the blocks that matched and sending the data in between as literals.
+
+namespace nandroidfs
+{
+    // The maximum length of the data in a single Literal op.
+    const uint32_t MAX_DELTA_LITERAL_LEN = 65536;
+
+    enum class DeltaOp : uint8_t
+    {
+        // Followed by the index of the first block to copy from the existing file (uint32_t) and the number of blocks to copy (uint32_t).
+        CopyBlocks,
+        // Followed by the length of the data (uint32_t), at most MAX_DELTA_LITERAL_LEN, then the data.
+        // If compression is enabled, the data is compressed.
+        Literal,
+        // The final op. Followed by the XXH3 hash of the whole of the new contents (uint64_t), which the daemon checks before replacing the file.
+        End
+    };
+
+    // The checksums of a single block of the existing file.
+    struct BlockChecksum
+    {
+        // The RollingChecksum of the block.
+        uint32_t rolling;
+        // The XXH3 hash of the block.
+        uint64_t strong;
+    };
+
+    // A weak checksum of a fixed length window of data, which can be moved along the data one byte at a time without reading the whole window.
+    // This is the checksum used by rsync: the low 16 bits are the sum of the bytes in the window,
+    // and the high 16 bits are the sum of each byte multiplied by its distance from the end of the window.
+    class RollingChecksum
+    {
+    public:
+        // Starts the checksum of the window of `length` bytes at `data`.
+        void reset(const uint8_t* data, uint32_t length);
+
+        // Moves the window along by one byte, removing `out` from the start of the window and adding `in` to the end.
+        inline void roll(uint8_t out, uint8_t in) {
+            sum += in - out;
+            weighted_sum += sum - length * out;
+        }
+
+        inline uint32_t value() const {
+            return (sum & 0xFFFF) | (weighted_sum << 16);
+        }
+    private:
+        // Both sums are only used modulo 2^16, so they are left to wrap around.
+        uint32_t sum = 0;
+        uint32_t weighted_sum = 0;
+        uint32_t length = 0;
+    };
+}
@@ -0,0 +1,402 @@
+#include "hash_functions.hpp"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace nandroidfs
+{
+    // All words are read as little endian, since that is the byte order of every android ABI and of windows.
+    inline uint64_t read_le64(const uint8_t* ptr) {
+        uint64_t value;
+        memcpy(&value, ptr, sizeof(value));
+        return value;
+    }
+
+    inline uint32_t read_le32(const uint8_t* ptr) {
+        uint32_t value;
+        memcpy(&value, ptr, sizeof(value));
+        return value;
+    }
+
+    inline uint64_t bswap64(uint64_t value) {
+#ifdef _MSC_VER
+        return _byteswap_uint64(value);
+#else
+        return __builtin_bswap64(value);
+#endif
+    }
+
+    inline uint32_t bswap32(uint32_t value) {
+#ifdef _MSC_VER
+        return _byteswap_ulong(value);
+#else
+        return __builtin_bswap32(value);
+#endif
+    }
+
+    inline uint64_t rotl64(uint64_t value, int bits) {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    // XXH3 (see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md)
+
+    const uint32_t XXH_PRIME32_1 = 0x9E3779B1U;
+    const uint32_t XXH_PRIME32_2 = 0x85EBCA77U;
+    const uint32_t XXH_PRIME32_3 = 0xC2B2AE3DU;
+    const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+    const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+    const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+    const uint64_t XXH_PRIME_MX1 = 0x165667919E3779F9ULL;
+    const uint64_t XXH_PRIME_MX2 = 0x9FB21C651E98DF25ULL;
+
+    const size_t XXH_SECRET_SIZE = 192;
+    // The secret is consumed 8 bytes further along for each stripe of a block, so a block is 16 stripes.
+    const size_t XXH_STRIPES_PER_BLOCK = (XXH_SECRET_SIZE - 64) / 8;
+    // Offsets into the secret for the final stripe and for merging the accumulators.
+    const size_t XXH_SECRET_LASTACC_START = 7;
+    const size_t XXH_SECRET_MERGEACCS_START = 11;
+    // Inputs up to this length are hashed without accumulators.
+    const size_t XXH_MIDSIZE_MAX = 240;
+
+    alignas(64) const uint8_t XXH_DEFAULT_SECRET[XXH_SECRET_SIZE] = {
+        0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+        0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+        0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+        0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+        0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+        0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+        0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+        0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+        0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+        0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+        0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+        0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+    };
+
+    // Multiplies two 64 bit values into a 128 bit product, and XORs the halves of the product together.
+    inline uint64_t xxh_mul128_fold64(uint64_t lhs, uint64_t rhs) {
+#ifdef _MSC_VER
+        uint64_t product_hi;
+        uint64_t product_lo = _umul128(lhs, rhs, &product_hi);
+        return product_lo ^ product_hi;
+#else
+        unsigned __int128 product = (unsigned __int128) lhs * rhs;
+        return (uint64_t) product ^ (uint64_t) (product >> 64);
+#endif
+    }
+
+    inline uint64_t xxh64_avalanche(uint64_t hash) {
+        hash ^= hash >> 33;
+        hash *= XXH_PRIME64_2;
+        hash ^= hash >> 29;
+        hash *= XXH_PRIME64_3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+    inline uint64_t xxh3_avalanche(uint64_t hash) {
+        hash ^= hash >> 37;
+        hash *= XXH_PRIME_MX1;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+    inline uint64_t xxh3_rrmxmx(uint64_t hash, uint64_t length) {
+        hash ^= rotl64(hash, 49) ^ rotl64(hash, 24);
+        hash *= XXH_PRIME_MX2;
+        hash ^= (hash >> 35) + length;
+        hash *= XXH_PRIME_MX2;
+        hash ^= hash >> 28;
+        return hash;
+    }
+
+    inline uint64_t xxh3_mix16(const uint8_t* input, const uint8_t* secret) {
+        return xxh_mul128_fold64(read_le64(input) ^ read_le64(secret), read_le64(input + 8) ^ read_le64(secret + 8));
+    }
+
+    // Hashes an input of at most XXH_MIDSIZE_MAX bytes.
+    uint64_t xxh3_hash_short(const uint8_t* input, size_t length) {
+        const uint8_t* secret = XXH_DEFAULT_SECRET;
+
+        if(length == 0) {
+            return xxh64_avalanche(read_le64(secret + 56) ^ read_le64(secret + 64));
+        }   else if(length <= 3)    {
+            uint32_t combined = ((uint32_t) input[0] << 16) | ((uint32_t) input[length >> 1] << 24)
+                | (uint32_t) input[length - 1] | ((uint32_t) length << 8);
+            uint64_t bitflip = read_le32(secret) ^ read_le32(secret + 4);
+            return xxh64_avalanche(combined ^ bitflip);
+        }   else if(length <= 8)    {
+            uint64_t bitflip = read_le64(secret + 8) ^ read_le64(secret + 16);
+            uint64_t input64 = read_le32(input + length - 4) + ((uint64_t) read_le32(input) << 32);
+            return xxh3_rrmxmx(input64 ^ bitflip, length);
+        }   else if(length <= 16)   {
+            uint64_t input_lo = read_le64(input) ^ (read_le64(secret + 24) ^ read_le64(secret + 32));
+            uint64_t input_hi = read_le64(input + length - 8) ^ (read_le64(secret + 40) ^ read_le64(secret + 48));
+            uint64_t acc = length + bswap64(input_lo) + input_hi + xxh_mul128_fold64(input_lo, input_hi);
+            return xxh3_avalanche(acc);
+        }   else if(length <= 128)  {
+            uint64_t acc = length * XXH_PRIME64_1;
+            if(length > 32) {
+                if(length > 64) {
+                    if(length > 96) {
+                        acc += xxh3_mix16(input + 48, secret + 96);
+                        acc += xxh3_mix16(input + length - 64, secret + 112);
+                    }
+                    acc += xxh3_mix16(input + 32, secret + 64);
+                    acc += xxh3_mix16(input + length - 48, secret + 80);
+                }
+                acc += xxh3_mix16(input + 16, secret + 32);
+                acc += xxh3_mix16(input + length - 32, secret + 48);
+            }
+            acc += xxh3_mix16(input, secret);
+            acc += xxh3_mix16(input + length - 16, secret + 16);
+            return xxh3_avalanche(acc);
+        }   else    {
+            uint64_t acc = length * XXH_PRIME64_1;
+            size_t rounds = length / 16;
+            for(size_t i = 0; i < 8; i++) {
+                acc += xxh3_mix16(input + 16 * i, secret + 16 * i);
+            }
+            acc = xxh3_avalanche(acc);
+            for(size_t i = 8; i < rounds; i++) {
+                acc += xxh3_mix16(input + 16 * i, secret + 16 * (i - 8) + 3);
+            }
+            acc += xxh3_mix16(input + length - 16, secret + 136 - 17);
+            return xxh3_avalanche(acc);
+        }
+    }
+
+    // Accumulates a single 64 byte stripe into the 8 accumulators.
+    // This is the inner loop of hashing a long input, so it is vectorised where possible.
+    inline void xxh3_accumulate_stripe(uint64_t* acc, const uint8_t* input, const uint8_t* secret) {
+#if defined(__ARM_NEON)
+        for(int i = 0; i < 4; i++) {
+            uint64x2_t data_vec = vreinterpretq_u64_u8(vld1q_u8(input + 16 * i));
+            uint64x2_t key_vec = vreinterpretq_u64_u8(vld1q_u8(secret + 16 * i));
+            uint64x2_t data_key = veorq_u64(data_vec, key_vec);
+            // Each accumulator is added to the data of its neighbour, so swap the lanes.
+            uint64x2_t data_swap = vextq_u64(data_vec, data_vec, 1);
+            // Multiply the low and high halves of each key, adding the products to the data.
+            uint64x2_t sum = vmlal_u32(data_swap, vmovn_u64(data_key), vshrn_n_u64(data_key, 32));
+            vst1q_u64(acc + 2 * i, vaddq_u64(vld1q_u64(acc + 2 * i), sum));
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        for(int i = 0; i < 4; i++) {
+            __m128i data_vec = _mm_loadu_si128((const __m128i*) (input + 16 * i));
+            __m128i key_vec = _mm_loadu_si128((const __m128i*) (secret + 16 * i));
+            __m128i data_key = _mm_xor_si128(data_vec, key_vec);
+            // Move the high half of each key into the low half, so `_mm_mul_epu32` multiplies the two halves.
+            __m128i data_key_hi = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+            __m128i product = _mm_mul_epu32(data_key, data_key_hi);
+            __m128i data_swap = _mm_shuffle_epi32(data_vec, _MM_SHUFFLE(1, 0, 3, 2));
+            __m128i* acc_vec = (__m128i*) (acc + 2 * i);
+            _mm_storeu_si128(acc_vec, _mm_add_epi64(_mm_loadu_si128(acc_vec), _mm_add_epi64(product, data_swap)));
+        }
+#else
+        for(int i = 0; i < 8; i++) {
+            uint64_t data_val = read_le64(input + 8 * i);
+            uint64_t data_key = data_val ^ read_le64(secret + 8 * i);
+            acc[i ^ 1] += data_val;
+            acc[i] += (data_key & 0xFFFFFFFF) * (data_key >> 32);
+        }
+#endif
+    }
+
+    inline void xxh3_scramble(uint64_t* acc, const uint8_t* secret) {
+        for(int i = 0; i < 8; i++) {
+            uint64_t value = acc[i];
+            value ^= value >> 47;
+            value ^= read_le64(secret + 8 * i);
+            value *= XXH_PRIME32_1;
+            acc[i] = value;
+        }
+    }
+
+    Xxh3Hasher::Xxh3Hasher() : acc {
+        XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+        XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1
+    } { }
+
+    void Xxh3Hasher::consume_stripes(uint64_t* accs, size_t& block_stripes, const uint8_t* data, size_t count) {
+        for(size_t i = 0; i < count; i++) {
+            xxh3_accumulate_stripe(accs, data + i * STRIPE_LEN, XXH_DEFAULT_SECRET + block_stripes * 8);
+            block_stripes++;
+            if(block_stripes == XXH_STRIPES_PER_BLOCK) {
+                xxh3_scramble(accs, XXH_DEFAULT_SECRET + XXH_SECRET_SIZE - STRIPE_LEN);
+                block_stripes = 0;
+            }
+        }
+    }
+
+    void Xxh3Hasher::update(const uint8_t* data, size_t length) {
+        total_len += length;
+
+        while(length > 0) {
+            if(buffered == BUFFER_SIZE) {
+                // There is more data to come, so none of the buffer is the final stripe.
+                consume_stripes(acc, stripes_in_block, buffer, BUFFER_SIZE / STRIPE_LEN);
+                memcpy(last_stripe, buffer + BUFFER_SIZE - STRIPE_LEN, STRIPE_LEN);
+                buffered = 0;
+            }
+
+            if(buffered == 0 && length > BUFFER_SIZE) {
+                // Accumulate straight from the input, leaving the last 1 to 64 bytes in the buffer.
+                size_t stripes = (length - 1) / STRIPE_LEN;
+                consume_stripes(acc, stripes_in_block, data, stripes);
+                memcpy(last_stripe, data + (stripes - 1) * STRIPE_LEN, STRIPE_LEN);
+                data += stripes * STRIPE_LEN;
+                length -= stripes * STRIPE_LEN;
+            }
+
+            size_t copy_len = std::min(length, BUFFER_SIZE - buffered);
+            memcpy(buffer + buffered, data, copy_len);
+            buffered += copy_len;
+            data += copy_len;
+            length -= copy_len;
+        }
+    }
+
+    uint64_t Xxh3Hasher::digest() {
+        if(total_len <= XXH_MIDSIZE_MAX) {
+            return xxh3_hash_short(buffer, total_len);
+        }
+
+        // Work on a copy of the state, so that more data can still be added.
+        uint64_t final_acc[8];
+        memcpy(final_acc, acc, sizeof(acc));
+        size_t final_block_stripes = stripes_in_block;
+        consume_stripes(final_acc, final_block_stripes, buffer, (buffered - 1) / STRIPE_LEN);
+
+        // The final stripe is always the last 64 bytes of the input, so it may overlap the last stripe accumulated.
+        uint8_t final_stripe[STRIPE_LEN];
+        if(buffered >= STRIPE_LEN) {
+            memcpy(final_stripe, buffer + buffered - STRIPE_LEN, STRIPE_LEN);
+        }   else    {
+            size_t from_last = STRIPE_LEN - buffered;
+            memcpy(final_stripe, last_stripe + STRIPE_LEN - from_last, from_last);
+            memcpy(final_stripe + from_last, buffer, buffered);
+        }
+        xxh3_accumulate_stripe(final_acc, final_stripe, XXH_DEFAULT_SECRET + XXH_SECRET_SIZE - STRIPE_LEN - XXH_SECRET_LASTACC_START);
+
+        uint64_t result = total_len * XXH_PRIME64_1;
+        const uint8_t* merge_secret = XXH_DEFAULT_SECRET + XXH_SECRET_MERGEACCS_START;
+        for(int i = 0; i < 4; i++) {
+            result += xxh_mul128_fold64(final_acc[2 * i] ^ read_le64(merge_secret + 16 * i),
+                final_acc[2 * i + 1] ^ read_le64(merge_secret + 16 * i + 8));
+        }
+        return xxh3_avalanche(result);
+    }
+
+    // SHA-256 (see FIPS 180-4)
+
+    const uint32_t SHA256_ROUND_CONSTANTS[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+
+    inline uint32_t rotr32(uint32_t value, int bits) {
+        return (value >> bits) | (value << (32 - bits));
+    }
+
+    Sha256Hasher::Sha256Hasher() : state {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    } { }
+
+    void Sha256Hasher::process_block(const uint8_t* block) {
+        uint32_t w[64];
+        for(int i = 0; i < 16; i++) {
+            w[i] = bswap32(read_le32(block + 4 * i));
+        }
+        for(int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for(int i = 0; i < 64; i++) {
+            uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+            uint32_t choice = (e & f) ^ (~e & g);
+            uint32_t temp1 = h + s1 + choice + SHA256_ROUND_CONSTANTS[i] + w[i];
+            uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+            uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t temp2 = s0 + majority;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + temp1;
+            d = c;
+            c = b;
+            b = a;
+            a = temp1 + temp2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+    void Sha256Hasher::update(const uint8_t* data, size_t length) {
+        total_len += length;
+
+        if(buffered > 0) {
+            size_t copy_len = std::min(length, sizeof(buffer) - buffered);
+            memcpy(buffer + buffered, data, copy_len);
+            buffered += copy_len;
+            data += copy_len;
+            length -= copy_len;
+            if(buffered < sizeof(buffer)) {
+                return;
+            }
+            process_block(buffer);
+            buffered = 0;
+        }
+
+        while(length >= sizeof(buffer)) {
+            process_block(data);
+            data += sizeof(buffer);
+            length -= sizeof(buffer);
+        }
+
+        memcpy(buffer, data, length);
+        buffered = length;
+    }
+
+    void Sha256Hasher::digest(uint8_t* out_digest) {
+        uint64_t bit_len = total_len * 8;
+
+        // Pad with a 1 bit, then zeros until there is just space for the length at the end of a block.
+        uint8_t padding[sizeof(buffer) + 8] = { 0x80 };
+        size_t padding_len = (buffered < 56 ? 56 : 120) - buffered;
+        update(padding, padding_len);
+
+        uint8_t len_bytes[8];
+        for(int i = 0; i < 8; i++) {
+            len_bytes[i] = (uint8_t) (bit_len >> (56 - 8 * i));
+        }
+        update(len_bytes, sizeof(len_bytes));
+
+        for(int i = 0; i < 8; i++) {
+            uint32_t word = bswap32(state[i]);
+            memcpy(out_digest + 4 * i, &word, sizeof(word));
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Hash functions used by both the client and the daemon, so that hashes calculated on either side can be compared.
+
+namespace nandroidfs
+{
+    // Calculates the 64 bit XXH3 hash of data passed in any number of parts.
+    // Uses the default secret and a seed of 0, so the result matches XXH3_64bits from the xxHash library.
+    class Xxh3Hasher {
+    public:
+        Xxh3Hasher();
+
+        void update(const uint8_t* data, size_t length);
+        // Gets the hash of all the data passed to `update` so far.
+        uint64_t digest();
+    private:
+        static const size_t STRIPE_LEN = 64;
+        // Must be a multiple of STRIPE_LEN and at least the length of the longest input hashed without accumulators (240 bytes).
+        static const size_t BUFFER_SIZE = 256;
+
+        uint64_t acc[8];
+        uint64_t total_len = 0;
+        // The number of stripes accumulated since the accumulators were last scrambled.
+        size_t stripes_in_block = 0;
+        // Data not yet accumulated. Until more than BUFFER_SIZE bytes have been passed, this holds all of the data.
+        // At least one byte is always left here, since the final stripe is accumulated differently.
+        uint8_t buffer[BUFFER_SIZE];
+        size_t buffered = 0;
+        // The last stripe accumulated, as the final stripe may overlap it.
+        uint8_t last_stripe[STRIPE_LEN];
+
+        // Accumulates `count` stripes, scrambling the accumulators at the end of each block.
+        void consume_stripes(uint64_t* accs, size_t& block_stripes, const uint8_t* data, size_t count);
+    };
+
+    // Calculates the SHA-256 hash of data passed in any number of parts.
+    class Sha256Hasher {
+    public:
+        static const size_t DIGEST_LEN = 32;
+
+        Sha256Hasher();
+
+        void update(const uint8_t* data, size_t length);
+        // Writes the hash of all the data passed to `update` to `out_digest`.
+        // The hasher must not be updated afterwards.
+        void digest(uint8_t* out_digest);
+    private:
+        uint32_t state[8];
+        uint64_t total_len = 0;
+        uint8_t buffer[64];
+        size_t buffered = 0;
+
+        void process_block(const uint8_t* block);
+    };
+}
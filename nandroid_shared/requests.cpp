@@ -13,13 +13,15 @@ namespace nandroidfs {
         read_access = mode_and_perms & 0b10000000;
         write_access = mode_and_perms & 0b01000000;
         mode = (OpenMode) (mode_and_perms & 0b00111111);
+        hint = (AccessHint) reader.read_byte();
     }
 
-    OpenHandleArgs::OpenHandleArgs(std::string path, OpenMode mode, bool read_access, bool write_access) {
+    OpenHandleArgs::OpenHandleArgs(std::string path, OpenMode mode, bool read_access, bool write_access, AccessHint hint) {
         this->path = path;
         this->mode = mode;
         this->read_access = read_access;
         this->write_access = write_access;
+        this->hint = hint;
     }
 
     void OpenHandleArgs::write(DataWriter& writer) {
@@ -29,6 +31,7 @@ namespace nandroidfs {
         mode_and_perms |= write_access ? 0b01000000 : 0;
 
         writer.write_byte(mode_and_perms);
+        writer.write_byte((uint8_t) hint);
     }
 
     ReadHandleArgs::ReadHandleArgs(DataReader& reader) {
@@ -49,6 +52,31 @@ namespace nandroidfs {
         writer.write_u64(offset);
     }
 
+    ReadHandleVArgs::ReadHandleVArgs(DataReader& reader) {
+        handle = reader.read_u32();
+        uint32_t range_count = reader.read_u32();
+        for(uint32_t i = 0; i < range_count; i++) {
+            ReadRange range;
+            range.offset = reader.read_u64();
+            range.data_len = reader.read_u32();
+            ranges.push_back(range);
+        }
+    }
+
+    ReadHandleVArgs::ReadHandleVArgs(FILE_HANDLE handle, std::vector<ReadRange> ranges) {
+        this->handle = handle;
+        this->ranges = std::move(ranges);
+    }
+
+    void ReadHandleVArgs::write(DataWriter& writer) {
+        writer.write_u32(handle);
+        writer.write_u32(static_cast<uint32_t>(ranges.size()));
+        for(const ReadRange& range : ranges) {
+            writer.write_u64(range.offset);
+            writer.write_u32(range.data_len);
+        }
+    }
+
     WriteHandleInitArgs::WriteHandleInitArgs(DataReader& reader) {
         handle = reader.read_u32();
         offset = reader.read_u64();
@@ -85,6 +113,45 @@ namespace nandroidfs {
         writer.write_byte(overwrite);
     }
 
+    CopyEntryArgs::CopyEntryArgs(DataReader& reader) {
+        from_path = reader.read_utf8_string();
+        to_path = reader.read_utf8_string();
+        replace_if_exists = static_cast<bool>(reader.read_byte());
+    }
+
+    CopyEntryArgs::CopyEntryArgs(std::string from_path, std::string to_path, bool replace_if_exists) {
+        this->from_path = from_path;
+        this->to_path = to_path;
+        this->replace_if_exists = replace_if_exists;
+    }
+
+    void CopyEntryArgs::write(DataWriter& writer) {
+        writer.write_utf8_string(from_path);
+        writer.write_utf8_string(to_path);
+        writer.write_byte(replace_if_exists);
+    }
+
+    HashRangeArgs::HashRangeArgs(DataReader& reader) {
+        path = reader.read_utf8_string();
+        offset = reader.read_u64();
+        length = reader.read_u64();
+        algorithm = static_cast<HashAlgorithm>(reader.read_byte());
+    }
+
+    HashRangeArgs::HashRangeArgs(std::string path, uint64_t offset, uint64_t length, HashAlgorithm algorithm) {
+        this->path = path;
+        this->offset = offset;
+        this->length = length;
+        this->algorithm = algorithm;
+    }
+
+    void HashRangeArgs::write(DataWriter& writer) {
+        writer.write_utf8_string(path);
+        writer.write_u64(offset);
+        writer.write_u64(length);
+        writer.write_byte(static_cast<uint8_t>(algorithm));
+    }
+
     TruncateHandleArgs::TruncateHandleArgs(DataReader& reader) {
         handle = reader.read_u32();
         new_length = reader.read_u64();
@@ -117,4 +184,40 @@ namespace nandroidfs {
         writer.write_u64(access_time);
         writer.write_u64(write_time);
     }
+
+    StatManyArgs::StatManyArgs(DataReader& reader) {
+        uint32_t path_count = reader.read_u32();
+        for(uint32_t i = 0; i < path_count; i++) {
+            paths.push_back(reader.read_utf8_string());
+        }
+    }
+
+    StatManyArgs::StatManyArgs(std::vector<std::string> paths) {
+        this->paths = std::move(paths);
+    }
+
+    void StatManyArgs::write(DataWriter& writer) {
+        writer.write_u32(static_cast<uint32_t>(paths.size()));
+        for(const std::string& path : paths) {
+            writer.write_utf8_string(path);
+        }
+    }
+
+    ListTreeArgs::ListTreeArgs(DataReader& reader) {
+        path = reader.read_utf8_string();
+        max_depth = reader.read_u16();
+        max_entries = reader.read_u32();
+    }
+
+    ListTreeArgs::ListTreeArgs(std::string path, uint16_t max_depth, uint32_t max_entries) {
+        this->path = path;
+        this->max_depth = max_depth;
+        this->max_entries = max_entries;
+    }
+
+    void ListTreeArgs::write(DataWriter& writer) {
+        writer.write_utf8_string(path);
+        writer.write_u16(max_depth);
+        writer.write_u32(max_entries);
+    }
 }
\ No newline at end of file
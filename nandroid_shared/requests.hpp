@@ -1,10 +1,14 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include "serialization.hpp"
 
-// Requests are sent as a RequestType (1 byte), 
-// followed by the request body.
+// Requests are sent as a RequestType (1 byte), followed by a REQUEST_ID (4 bytes)
+// and then the request body.
+//
+// The REQUEST_ID is chosen by the client and is echoed back at the start of the response.
+// This allows many requests to be in flight at once, and the daemon may respond to them in any order.
 
 namespace nandroidfs 
 {
@@ -12,12 +16,44 @@ namespace nandroidfs
     inline const char* AGENT_READY_MSG = "NANDROID_READY_FOR_CONNECTION";
 
     typedef uint32_t FILE_HANDLE;
+    typedef uint32_t REQUEST_ID;
+
+    // Optional protocol features, which are negotiated in the handshake.
+    // After the handshake bytes are echoed, the client sends a byte with the bit of each feature it supports set,
+    // and the daemon replies with the bits of the features that will be used on the connection.
+
+    // ReadHandle data, WriteHandle data and directory listings are compressed. (see compression.hpp)
+    inline const uint8_t FEATURE_COMPRESSION = 1 << 0;
+    // The daemon watches the directories listed with ListDirectory, and sends change notifications when their entries change,
+    // so that the client can keep their listings and the stats of their entries cached until then. (see ChangeKind)
+    inline const uint8_t FEATURE_CHANGE_NOTIFICATIONS = 1 << 1;
+
+    // Change notifications are sent with this in place of the REQUEST_ID of a response, followed by the ChangeKind (1 byte)
+    // and the path it applies to (string). They may be sent at any time between responses.
+    // The client never gives a request this ID.
+    inline const REQUEST_ID CHANGE_NOTIFICATION_ID = 0xFFFFFFFF;
+
+    enum class ChangeKind : uint8_t
+    {
+        // The directory at the path is now watched, so changes to its entries will be notified from now on.
+        // Sent before the response to the ListDirectory request that caused it.
+        Watching,
+        // The directory at the path is no longer watched, e.g. because it was removed or too many directories are watched.
+        Unwatched,
+        // The entry at the path was created, removed, moved, written to or had its attributes changed.
+        EntryChanged,
+        // The directory at the path was removed or moved, or a directory was moved to the path, so everything within it has changed.
+        TreeChanged,
+        // Notifications were lost, so anything within any watched directory may have changed. The path is empty.
+        Overflow
+    };
 
     enum class RequestType : uint8_t
     {
         // Followed by a singular string - the full file/directory path.
         StatFile,
         // Followed by a singular string - the full directory path.
+        // If compression is enabled, the entries are preceded by their length (uint32_t) and compressed.
         ListDirectory,
         // Followed by a singular string - the full directory path.
         CreateDirectory,
@@ -37,13 +73,17 @@ namespace nandroidfs
         // Moves the entry at the specified path to a different location
         MoveEntry,
         // Followed by OpenHandleArgs
+        // Response is the FILE_HANDLE, then a byte which is 1 if the file existed before it was opened, then the FileStat of the opened file.
+        // Fails with NotAFile if the path is a directory.
         OpenHandle,
         // Followed by the FILE_HANDLE
         CloseHandle,
         // Followed by ReadHandleArgs
         // Response is the number of bytes read (uint32_t), followed by the data read.
+        // If compression is enabled, the data read is compressed.
         ReadHandle,
         // Followed by WriteHandleArgs
+        // If compression is enabled, the data to write is compressed.
         WriteHandle,
         // Followed by TruncateHandleArgs
         TruncateHandle,
@@ -51,9 +91,66 @@ namespace nandroidfs
         SetFileTime,
         // No additional arguments
         // Gives a DiskStats as its response.
-        GetDiskStats
+        GetDiskStats,
+        // Followed by StatManyArgs
+        // Response is a ResponseStatus for each path, in the same order as the paths, each followed by a FileStat if it is Success.
+        StatMany,
+        // Followed by ListTreeArgs
+        // Response is a series of directories, each written as Success, the path of the directory relative to the root (string)
+        // and the entries of the directory (see DirEntryWriter). The series ends with NoMoreEntries, followed by a byte which is 1 if
+        // the listing was cut short by the entry limit. Directories within the tree that could not be listed are left out.
+        // If compression is enabled, the directories are preceded by their length (uint32_t) and compressed.
+        ListTree,
+        // Followed by ReadHandleVArgs
+        // Response is, for each range in order, the number of bytes read (uint32_t) followed by the data read.
+        // If compression is enabled, the data read for each range is compressed.
+        ReadHandleV,
+        // Followed by CopyEntryArgs
+        // While copying, the daemon sends any number of InProgress responses, each followed by the number of bytes copied so far (uint64_t)
+        // and the number of files, directories and symbolic links fully copied so far (uint64_t).
+        // The final response is the status of the copy, followed by the number of bytes copied (uint64_t).
+        CopyEntry,
+        // Followed by the path of the file or directory to remove (string), including everything within it.
+        // Response is the status of the first entry that could not be removed, or Success,
+        // followed by the number of files removed (uint32_t) and the number of directories removed (uint32_t).
+        // Entries that cannot be removed are skipped, and the directories containing them are left in place.
+        RemoveTree,
+        // Followed by HashRangeArgs
+        // Response is the status, followed by the number of bytes hashed (uint64_t), which is less than the length requested
+        // if the range extends past the end of the file, then the length of the hash (uint8_t) and the hash itself.
+        HashRange,
+        // Followed by the path of the file (string). Gets the checksums of the existing file needed for a delta write. (see delta.hpp)
+        // Response is the status, then if it is Success, the length of the file (uint64_t), the block size (uint32_t),
+        // the number of blocks (uint32_t) and the checksums of each block, as the rolling checksum (uint32_t) then the strong checksum (uint64_t).
+        // Only whole blocks are included, so any data after the last whole block can never be copied.
+        GetBlockChecksums,
+        // Followed by the path of the file (string), the block size given by GetBlockChecksums (uint32_t),
+        // then a series of DeltaOps ending with DeltaOp::End. (see delta.hpp)
+        // The new contents are written to a temporary file next to the existing file, which is moved over the existing file once the
+        // hash of the new contents has been checked, so the existing file is left unchanged if the write fails.
+        // Response is the status of the write.
+        WriteDelta,
+        // Followed by the number of steps (uint16_t), then each step, as its RequestType, a byte which is 1 if the steps after it should
+        // still be run if it fails, and then the arguments of the step as they would be sent in a request of that type.
+        // The daemon runs the steps in order, so a chain of dependent requests only takes a single round trip.
+        // Only StatFile, CreateDirectory, CheckRemoveFile, CheckRemoveDirectory, RemoveFile, RemoveDirectory, MoveEntry,
+        // OpenHandle, CloseHandle, WriteHandle, TruncateHandle and SetFileTime can be steps.
+        // A FILE_HANDLE in the arguments of a step may refer to the handle opened by an earlier step. (see compound_step_handle)
+        // Response is Success, followed by the status of each step in order, each followed by the rest of the step's response
+        // as it would be for a request of that type. Steps after a failed step that did not allow the steps after it to run are Skipped.
+        // If a step stops the chain in this way, the handles opened by earlier steps are closed, so they are only usable if no step stopped the chain.
+        Compound
     };
 
+    // Set in a FILE_HANDLE given to a step of a Compound request to refer to the handle opened by an earlier step.
+    inline const FILE_HANDLE COMPOUND_STEP_HANDLE_FLAG = 0x80000000;
+
+    // Gets a FILE_HANDLE that refers to the handle opened by the OpenHandle step with index `step` of the same Compound request.
+    // Steps given the handle fail if that step did not open a handle.
+    inline FILE_HANDLE compound_step_handle(uint16_t step) {
+        return COMPOUND_STEP_HANDLE_FLAG | step;
+    }
+
     enum class OpenMode  : uint8_t
     {
         // Only allows opening an existing file
@@ -68,6 +165,36 @@ namespace nandroidfs
         CreateAlways
     };
 
+    // How a file handle is expected to be accessed, which the daemon passes on to the kernel so that it can manage the page cache.
+    enum class AccessHint : uint8_t
+    {
+        // No particular access pattern is expected.
+        Normal,
+        // The file will be accessed from start to end, so the kernel should read further ahead.
+        // The pages of the file are dropped from the page cache when the handle is closed,
+        // so that streaming a large file does not evict the pages of running apps.
+        Sequential,
+        // The file will be accessed at random offsets, so the kernel should not read ahead.
+        Random,
+        // The data of the file will not be accessed again, so its pages are dropped from the page cache when the handle is closed.
+        NoReuse
+    };
+
+    // The algorithms that can be used to hash a file with RequestType::HashRange.
+    enum class HashAlgorithm : uint8_t
+    {
+        // 64 bit XXH3 with the default secret and a seed of 0, written big endian.
+        // Very fast, but only suitable for detecting accidental changes.
+        Xxh3,
+        // The range is split into chunks of HASH_TREE_CHUNK_SIZE bytes, with the last chunk holding the remainder.
+        // The hash is the SHA-256 of the SHA-256 hashes of each chunk, one after the other.
+        // The chunks are hashed in parallel, so this is faster than a plain SHA-256 on a device with several cores.
+        Sha256Tree
+    };
+
+    // The length of each chunk hashed separately by HashAlgorithm::Sha256Tree.
+    inline const uint64_t HASH_TREE_CHUNK_SIZE = 4 * 1024 * 1024;
+
     struct OpenHandleArgs
     {
         // Full file path.
@@ -75,9 +202,10 @@ namespace nandroidfs
         OpenMode mode;
         bool read_access;
         bool write_access;
+        AccessHint hint;
 
         OpenHandleArgs(DataReader& reader);
-        OpenHandleArgs(std::string path, OpenMode mode, bool read_access, bool write_access);
+        OpenHandleArgs(std::string path, OpenMode mode, bool read_access, bool write_access, AccessHint hint);
         void write(DataWriter& writer);
     };
 
@@ -95,6 +223,28 @@ namespace nandroidfs
         void write(DataWriter& writer);
     };
 
+    // A range of a file to read.
+    struct ReadRange
+    {
+        uint64_t offset;
+        uint32_t data_len;
+    };
+
+    // Arguments for a request to read many ranges of a file at once.
+    // The full length of each range will always be read, except in the case of EOF.
+    struct ReadHandleVArgs
+    {
+        // The total length of all the ranges in a request must not exceed this.
+        static const uint32_t MAX_TOTAL_LEN = 64 * 1024 * 1024;
+
+        FILE_HANDLE handle;
+        std::vector<ReadRange> ranges;
+
+        ReadHandleVArgs(DataReader& reader);
+        ReadHandleVArgs(FILE_HANDLE handle, std::vector<ReadRange> ranges);
+        void write(DataWriter& writer);
+    };
+
     // Followed by the actual data to write.
     struct WriteHandleInitArgs
     {
@@ -121,6 +271,33 @@ namespace nandroidfs
         void write(DataWriter& writer);
     };
 
+    // Arguments for a request to copy a file or directory on the device.
+    struct CopyEntryArgs {
+        std::string from_path;
+        std::string to_path;
+        // Whether to overwrite existing files, and copy into existing directories.
+        bool replace_if_exists;
+
+        CopyEntryArgs(DataReader& reader);
+        CopyEntryArgs(std::string from_path, std::string to_path, bool replace_if_exists);
+        void write(DataWriter& writer);
+    };
+
+    // Arguments for a request to hash part of a file on the device.
+    struct HashRangeArgs {
+        // Full file path.
+        std::string path;
+        // Offset of the start of the range to hash.
+        uint64_t offset;
+        // Length of the range to hash. The range is cut short at the end of the file, so UINT64_MAX hashes the rest of the file.
+        uint64_t length;
+        HashAlgorithm algorithm;
+
+        HashRangeArgs(DataReader& reader);
+        HashRangeArgs(std::string path, uint64_t offset, uint64_t length, HashAlgorithm algorithm);
+        void write(DataWriter& writer);
+    };
+
     // Arguments for a request to increase or decrease the length of a file.
     struct TruncateHandleArgs {
         FILE_HANDLE handle;
@@ -131,6 +308,30 @@ namespace nandroidfs
         void write(DataWriter& writer);
     };
 
+    // Arguments for a request to stat many files at once.
+    struct StatManyArgs {
+        // The full paths of the files/directories to stat.
+        std::vector<std::string> paths;
+
+        StatManyArgs(DataReader& reader);
+        StatManyArgs(std::vector<std::string> paths);
+        void write(DataWriter& writer);
+    };
+
+    // Arguments for a request to list every directory within a tree.
+    struct ListTreeArgs {
+        // The full path of the root directory of the tree.
+        std::string path;
+        // The maximum depth of the directories to list below the root. A depth of 0 only lists the root.
+        uint16_t max_depth;
+        // The maximum number of entries to list. Once listing another directory would exceed this, the listing stops.
+        uint32_t max_entries;
+
+        ListTreeArgs(DataReader& reader);
+        ListTreeArgs(std::string path, uint16_t max_depth, uint32_t max_entries);
+        void write(DataWriter& writer);
+    };
+
     // Arguments for a request to set when a file was last read from/written to.
     struct SetFileTimeArgs {
         std::string path;
@@ -1,4 +1,5 @@
 #include "responses.hpp"
+#include <algorithm>
 
 
 namespace nandroidfs
@@ -54,4 +55,86 @@ namespace nandroidfs
 		writer.write_u64(available_bytes);
 		writer.write_u64(total_bytes);
 	}
+
+	// Set in the tag byte of a directory entry if the mode is the same as that of the previous entry.
+	const uint8_t SAME_MODE = 1 << 4;
+	// Set in the tag byte of a directory entry if the access time is the same as the write time.
+	const uint8_t SAME_ACCESS_TIME = 1 << 5;
+	const uint8_t STATUS_MASK = 0x0F;
+
+	DirEntryWriter::DirEntryWriter(DataWriter& writer) : writer(writer) { }
+
+	void DirEntryWriter::write_entry(const std::string& name, const FileStat& stat) {
+		uint8_t tag = (uint8_t) ResponseStatus::Success;
+		if (stat.mode == previous_mode) {
+			tag |= SAME_MODE;
+		}
+		if (stat.access_time == stat.write_time) {
+			tag |= SAME_ACCESS_TIME;
+		}
+		writer.write_byte(tag);
+
+		size_t shared_len = 0;
+		size_t max_shared_len = std::min(name.length(), previous_name.length());
+		while (shared_len < max_shared_len && name[shared_len] == previous_name[shared_len]) {
+			shared_len++;
+		}
+		writer.write_varint(shared_len);
+		writer.write_varint(name.length() - shared_len);
+		writer.write_exact(reinterpret_cast<const uint8_t*>(name.data() + shared_len), static_cast<int>(name.length() - shared_len));
+
+		if (!(tag & SAME_MODE)) {
+			writer.write_u16(stat.mode);
+		}
+		writer.write_varint(stat.size);
+		writer.write_varint(zigzag_encode(stat.write_time - previous_write_time));
+		if (!(tag & SAME_ACCESS_TIME)) {
+			writer.write_varint(zigzag_encode(stat.access_time - stat.write_time));
+		}
+
+		previous_name = name;
+		previous_mode = stat.mode;
+		previous_write_time = stat.write_time;
+	}
+
+	void DirEntryWriter::write_failed_entry(ResponseStatus status) {
+		writer.write_byte((uint8_t) status);
+	}
+
+	void DirEntryWriter::finish() {
+		writer.write_byte((uint8_t) ResponseStatus::NoMoreEntries);
+	}
+
+	DirEntryReader::DirEntryReader(DataReader& reader) : reader(reader) { }
+
+	bool DirEntryReader::read_entry(ResponseStatus& out_status, std::string& out_name, FileStat& out_stat) {
+		uint8_t tag = reader.read_byte();
+		out_status = (ResponseStatus) (tag & STATUS_MASK);
+		if (out_status == ResponseStatus::NoMoreEntries) {
+			return false;
+		}
+		else if (out_status != ResponseStatus::Success)
+		{
+			return true;
+		}
+
+		uint64_t shared_len = reader.read_varint();
+		uint64_t suffix_len = reader.read_varint();
+		if (shared_len > previous_name.length() || suffix_len > UINT16_MAX) {
+			throw std::runtime_error("Directory entry name is invalid");
+		}
+		out_name.assign(previous_name, 0, shared_len);
+		out_name.resize(shared_len + suffix_len);
+		reader.read_exact(reinterpret_cast<uint8_t*>(&out_name[shared_len]), static_cast<int>(suffix_len));
+
+		out_stat.mode = (tag & SAME_MODE) ? previous_mode : reader.read_u16();
+		out_stat.size = reader.read_varint();
+		out_stat.write_time = previous_write_time + zigzag_decode(reader.read_varint());
+		out_stat.access_time = (tag & SAME_ACCESS_TIME) ? out_stat.write_time : out_stat.write_time + zigzag_decode(reader.read_varint());
+
+		previous_name = out_name;
+		previous_mode = out_stat.mode;
+		previous_write_time = out_stat.write_time;
+		return true;
+	}
 }
\ No newline at end of file
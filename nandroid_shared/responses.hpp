@@ -2,15 +2,15 @@
 #include "requests.hpp"
 #include "serialization.hpp"
 
-// Responses are written as a StatusCode enum (1 byte) 
+// Responses are written as the REQUEST_ID of the request being responded to (4 bytes), then a StatusCode enum (1 byte)
 // followed by the response data, or no data if the StatusCode is not that of a success.
 
 namespace nandroidfs 
 {
     // A code given that represents each response.
     // NB:
-    // A ResponseStatus is also sent with each FileStat when listing the files in a directory.
-    // If the status is NoMoreEntries, then the final file stat has just been sent.
+    // A ResponseStatus is also sent with each entry when listing the files in a directory. (see DirEntryWriter)
+    // If the status is NoMoreEntries, then the final entry has just been sent.
     // If the status is Success, then a FileStat is included with the file name.
     enum class ResponseStatus {
         Success,
@@ -21,7 +21,11 @@ namespace nandroidfs
         FileNotFound,
         FileExists, // Considered a success if opening a file with a mode that supports existing files.
         DirectoryNotEmpty,
-        NoMoreEntries
+        NoMoreEntries,
+        // Sent by requests that report their progress before they finish. More responses with the same request ID will follow.
+        InProgress,
+        // Given for a step of a Compound request that was not run, since an earlier step failed.
+        Skipped
     };
 
     // The information about a file returned by the daemon 
@@ -46,6 +50,50 @@ namespace nandroidfs
         void write(DataWriter& writer);
     };
 
+    // Writes the entries of a directory listing in a compact form, since directories can have tens of thousands of entries.
+    // Each entry starts with a tag byte, with the entry's ResponseStatus in the lower 4 bits. If the status is Success, it is followed by:
+    // - The name, as the length of the prefix it shares with the previous name (varint), then the length (varint) and bytes of the rest of the name.
+    // - The mode (u16), unless the SAME_MODE tag bit is set, in which case the mode is the same as the previous entry.
+    // - The size (varint).
+    // - The write time, as the difference from the previous entry's write time (zigzag varint).
+    // - The access time, as the difference from the write time (zigzag varint), unless the SAME_ACCESS_TIME tag bit is set, in which case it equals the write time.
+    // The listing ends with an entry with the status NoMoreEntries.
+    class DirEntryWriter
+    {
+    private:
+        DataWriter& writer;
+        std::string previous_name;
+        uint16_t previous_mode = 0;
+        uint64_t previous_write_time = 0;
+
+    public:
+        DirEntryWriter(DataWriter& writer);
+
+        void write_entry(const std::string& name, const FileStat& stat);
+        // Writes an entry that could not be statted.
+        void write_failed_entry(ResponseStatus status);
+        // Indicates the end of the listing.
+        void finish();
+    };
+
+    // Reads the entries of a directory listing written by DirEntryWriter.
+    class DirEntryReader
+    {
+    private:
+        DataReader& reader;
+        std::string previous_name;
+        uint16_t previous_mode = 0;
+        uint64_t previous_write_time = 0;
+
+    public:
+        DirEntryReader(DataReader& reader);
+
+        // Reads the next entry, setting `out_status` to its status.
+        // If the status is Success, `out_name` and `out_stat` are set to the name and stat of the entry.
+        // Returns false once the end of the listing is reached.
+        bool read_entry(ResponseStatus& out_status, std::string& out_name, FileStat& out_stat);
+    };
+
     struct DiskStats {
         uint64_t free_bytes; // Free blocks including that only available to root.
         uint64_t available_bytes; // Available to unprivileged users
@@ -1,4 +1,4 @@
-#ifdef __ANDROID__
+#ifndef _WIN32
 #include <arpa/inet.h>
 #endif
 
@@ -28,6 +28,7 @@ uint64_t ntohll(uint64_t v) {
 #endif
 
 #include "serialization.hpp"
+#include <cstring>
 #include <stdexcept>
 #include <cmath>
 #include <string_view>
@@ -37,6 +38,23 @@ namespace nandroidfs
 {
     EOFException::EOFException() : std::runtime_error("EOF reached while reading from stream") {}
 
+    MemoryReadable::MemoryReadable(const uint8_t* data, size_t length) {
+        this->data = data;
+        this->length = length;
+    }
+
+    int MemoryReadable::read(uint8_t* buffer, int length) {
+        int bytes_to_read = static_cast<int>(std::min<size_t>(length, this->length - position));
+        memcpy(buffer, data + position, bytes_to_read);
+        position += bytes_to_read;
+
+        return bytes_to_read;
+    }
+
+    void MemoryWritable::write(const uint8_t* buffer, int length) {
+        data.insert(data.end(), buffer, buffer + length);
+    }
+
     DataReader::DataReader(Readable* stream, int buffer_size) 
     {
         this->stream = stream;
@@ -85,6 +103,14 @@ namespace nandroidfs
         }
     }
 
+    int DataReader::consume_buffered(const uint8_t*& data, int max_bytes) {
+        int bytes_to_consume = std::min(max_bytes, read_into_buffer - position_in_buffer);
+        data = buffer + position_in_buffer;
+        position_in_buffer += bytes_to_consume;
+
+        return bytes_to_consume;
+    }
+
     uint8_t DataReader::read_byte() {
         uint8_t result;
         read_exact(&result, 1);
@@ -109,6 +135,37 @@ namespace nandroidfs
         return ntohll(result);
     }
 
+    // The maximum length of a varint encoding a 64 bit integer.
+    const int MAX_VARINT_LEN = 10;
+
+    uint64_t DataReader::read_varint() {
+        uint64_t result = 0;
+        int shift = 0;
+
+        // If the whole varint is definitely in the buffer, decode it from there directly rather than reading one byte at a time.
+        if(read_into_buffer - position_in_buffer >= MAX_VARINT_LEN) {
+            const uint8_t* next = buffer + position_in_buffer;
+            uint8_t current;
+            do {
+                current = *next++;
+                result |= static_cast<uint64_t>(current & 0x7F) << shift;
+                shift += 7;
+            } while((current & 0x80) && shift < MAX_VARINT_LEN * 7);
+
+            position_in_buffer = static_cast<int>(next - buffer);
+            return result;
+        }
+
+        uint8_t current;
+        do {
+            current = read_byte();
+            result |= static_cast<uint64_t>(current & 0x7F) << shift;
+            shift += 7;
+        } while((current & 0x80) && shift < MAX_VARINT_LEN * 7);
+
+        return result;
+    }
+
     std::string DataReader::read_utf8_string() {
         uint16_t length = read_u16();
 
@@ -182,6 +239,18 @@ namespace nandroidfs
         write_exact(reinterpret_cast<uint8_t*>(&net_data), 8);
     }
 
+    void DataWriter::write_varint(uint64_t data) {
+        uint8_t encoded[MAX_VARINT_LEN];
+        int length = 0;
+        while(data >= 0x80) {
+            encoded[length++] = static_cast<uint8_t>(data) | 0x80;
+            data >>= 7;
+        }
+        encoded[length++] = static_cast<uint8_t>(data);
+
+        write_exact(encoded, length);
+    }
+
     void DataWriter::write_utf8_string(std::string_view data) {
         if(data.length() > UINT16_MAX) {
             throw std::runtime_error("String too long to write to stream. Was path length properly limited?");
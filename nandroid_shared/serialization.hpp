@@ -4,6 +4,7 @@
 #include <string>
 #include <string_view>
 #include <stdexcept>
+#include <vector>
 
 namespace nandroidfs
 {
@@ -29,6 +30,38 @@ namespace nandroidfs
         virtual void write(const uint8_t* buffer, int length) = 0;
     };
 
+    // Maps signed integers to unsigned integers so that values close to zero, including negative ones, have a short varint encoding.
+    inline uint64_t zigzag_encode(int64_t value) {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    inline int64_t zigzag_decode(uint64_t value) {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    // A Readable that reads from a block of memory.
+    class MemoryReadable : public Readable
+    {
+    private:
+        const uint8_t* data;
+        size_t length;
+        size_t position = 0;
+
+    public:
+        MemoryReadable(const uint8_t* data, size_t length);
+
+        virtual int read(uint8_t* buffer, int length);
+    };
+
+    // A Writable that appends all data written to a vector.
+    class MemoryWritable : public Writable
+    {
+    public:
+        std::vector<uint8_t> data;
+
+        virtual void write(const uint8_t* buffer, int length);
+    };
+
     // A buffered reader for primitive data types.
     class DataReader 
     {
@@ -46,11 +79,17 @@ namespace nandroidfs
 
         // Reads exactly the specified number of bytes into the pointer at into.
         void read_exact(uint8_t* into, int num_bytes);
+        // Consumes up to `max_bytes` of the data that has already been read into the buffer, without reading from the underlying stream.
+        // `data` is set to point to the consumed data, which is valid until the next read.
+        // Returns the number of bytes consumed, which is 0 if the buffer is empty.
+        int consume_buffered(const uint8_t*& data, int max_bytes);
         
         uint8_t read_byte();
         uint16_t read_u16();
         uint32_t read_u32();
         uint64_t read_u64();
+        // Reads an unsigned integer encoded with `DataWriter::write_varint`.
+        uint64_t read_varint();
 
         // Reads a string, prefixed with a 2 byte length.
         std::string read_utf8_string();
@@ -79,6 +118,9 @@ namespace nandroidfs
         void write_u16(uint16_t data);
         void write_u32(uint32_t data);
         void write_u64(uint64_t data);
+        // Writes an unsigned integer in 7 bit groups, least significant first, with the top bit of each byte set if more bytes follow.
+        // Small values take fewer bytes, e.g. values below 128 take a single byte.
+        void write_varint(uint64_t data);
         void write_utf8_string(std::string_view data);
     };
 }
\ No newline at end of file
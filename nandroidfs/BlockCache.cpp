@@ -0,0 +1,164 @@
+#include "BlockCache.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace nandroidfs {
+	BlockCache::BlockCache(size_t memory_budget) {
+		this->memory_budget = memory_budget;
+	}
+
+	BlockCache::CachedFile* BlockCache::get_file(const std::string& path, const FileStat& stat) {
+		auto file = files.find(path);
+		if (file == files.end()) {
+			return nullptr;
+		}
+
+		if (file->second.size != stat.size || file->second.write_time != stat.write_time) {
+			// The file has changed since its blocks were cached.
+			remove_blocks(file->second);
+			files.erase(file);
+			return nullptr;
+		}
+
+		return &file->second;
+	}
+
+	void BlockCache::remove_blocks(CachedFile& file) {
+		for (auto& block : file.blocks) {
+			memory_used -= block.second->data.size();
+			blocks.erase(block.second);
+		}
+		file.blocks.clear();
+	}
+
+	void BlockCache::evict() {
+		while (memory_used > memory_budget && !blocks.empty()) {
+			Block& oldest = blocks.back();
+			auto file = files.find(oldest.path);
+			file->second.blocks.erase(oldest.index);
+			if (file->second.blocks.empty()) {
+				files.erase(file);
+			}
+
+			memory_used -= oldest.data.size();
+			blocks.pop_back();
+		}
+	}
+
+	bool BlockCache::read(const std::string& path, const FileStat& stat, uint64_t offset, uint8_t* buffer, uint32_t length, uint32_t& out_bytes_read) {
+		std::lock_guard lock(cache_mutex);
+		total_data_fetched++;
+
+		CachedFile* file = get_file(path, stat);
+		if (file == nullptr) {
+			return false;
+		}
+
+		// Only the data before the end of the file can be read.
+		uint32_t readable_len = offset >= stat.size ? 0 : static_cast<uint32_t>(std::min<uint64_t>(length, stat.size - offset));
+
+		// Check that every block is cached before copying any data.
+		uint64_t first_index = offset / BLOCK_SIZE;
+		uint64_t end_index = (offset + readable_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		for (uint64_t index = first_index; index < end_index; index++) {
+			if (!file->blocks.contains(index)) {
+				return false;
+			}
+		}
+
+		uint32_t copied = 0;
+		while (copied < readable_len) {
+			uint64_t position = offset + copied;
+			auto block = file->blocks[position / BLOCK_SIZE];
+			uint32_t offset_in_block = static_cast<uint32_t>(position % BLOCK_SIZE);
+			if (offset_in_block >= block->data.size()) {
+				// The last block of the file was cached when the file was shorter, so cannot have come from this version of it.
+				return false;
+			}
+			uint32_t copy_len = std::min<uint32_t>(readable_len - copied, static_cast<uint32_t>(block->data.size()) - offset_in_block);
+			memcpy(buffer + copied, block->data.data() + offset_in_block, copy_len);
+			copied += copy_len;
+
+			// Mark the block as the most recently used.
+			blocks.splice(blocks.begin(), blocks, block);
+		}
+
+		total_cache_hits++;
+		out_bytes_read = readable_len;
+		return true;
+	}
+
+	void BlockCache::insert(const std::string& path, const FileStat& stat, uint64_t offset, const uint8_t* data, uint32_t length) {
+		std::lock_guard lock(cache_mutex);
+
+		CachedFile* file = get_file(path, stat);
+		if (file == nullptr) {
+			file = &files[path];
+			file->size = stat.size;
+			file->write_time = stat.write_time;
+		}
+
+		uint64_t end = offset + length;
+		// Skip forward to the first block that starts within the data.
+		uint64_t index = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		while (true) {
+			uint64_t block_start = index * BLOCK_SIZE;
+			uint64_t block_end = std::min(block_start + BLOCK_SIZE, stat.size);
+			// Only cache blocks that are entirely contained in the data.
+			if (block_start >= block_end || block_end > end) {
+				break;
+			}
+
+			auto existing = file->blocks.find(index);
+			if (existing != file->blocks.end()) {
+				memory_used -= existing->second->data.size();
+				blocks.erase(existing->second);
+			}
+
+			const uint8_t* block_data = data + (block_start - offset);
+			blocks.push_front(Block{ path, index, std::vector<uint8_t>(block_data, block_data + (block_end - block_start)) });
+			file->blocks[index] = blocks.begin();
+			memory_used += block_end - block_start;
+			index++;
+		}
+
+		if (file->blocks.empty()) {
+			files.erase(path);
+		}
+		evict();
+	}
+
+	void BlockCache::invalidate(const std::string& path) {
+		std::lock_guard lock(cache_mutex);
+
+		auto file = files.find(path);
+		if (file != files.end()) {
+			remove_blocks(file->second);
+			files.erase(file);
+		}
+	}
+
+	void BlockCache::invalidate_tree(const std::string& path) {
+		std::string prefix = path + "/";
+		std::lock_guard lock(cache_mutex);
+
+		for (auto file = files.begin(); file != files.end();) {
+			if (file->first == path || file->first.starts_with(prefix)) {
+				remove_blocks(file->second);
+				file = files.erase(file);
+			}
+			else
+			{
+				file++;
+			}
+		}
+	}
+
+	CacheStatistics BlockCache::get_cache_statistics() {
+		CacheStatistics ret;
+		ret.total_cache_hits = total_cache_hits.load();
+		ret.total_data_fetched = total_data_fetched.load();
+
+		return ret;
+	}
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "responses.hpp"
+#include "TimedCache.hpp"
+
+namespace nandroidfs {
+	// A cache of the contents of files, split into blocks of BLOCK_SIZE bytes.
+	// Used to avoid reading the same data from the device again and again, e.g. when explorer generates previews.
+	//
+	// The blocks of each file are only used while the size and write time of the file match those of when the blocks were cached.
+	// Once the memory used by the cache exceeds the budget, the least recently used blocks are evicted.
+	// This class is thread safe.
+	class BlockCache {
+	public:
+		static const uint32_t BLOCK_SIZE = 65536;
+
+		// Creates a cache that will use no more than `memory_budget` bytes for cached data.
+		BlockCache(size_t memory_budget);
+
+		// Reads the `length` bytes at `offset` of the file at `path` from the cache, if they are all cached.
+		// `stat` must be the current stat of the file.
+		// `out_bytes_read` is set to the number of bytes read, which is less than `length` if the range goes past the end of the file.
+		// Returns false if any of the data is not cached.
+		bool read(const std::string& path, const FileStat& stat, uint64_t offset, uint8_t* buffer, uint32_t length, uint32_t& out_bytes_read);
+		// Caches `length` bytes of data read from `offset` in the file at `path`, which had the stat `stat` when read.
+		// Only whole blocks are cached, except for the last block of the file, so `offset` should be a multiple of BLOCK_SIZE.
+		void insert(const std::string& path, const FileStat& stat, uint64_t offset, const uint8_t* data, uint32_t length);
+		// Removes all cached blocks of the file at `path`.
+		void invalidate(const std::string& path);
+		// Removes all cached blocks of the file at `path` and every file within it.
+		void invalidate_tree(const std::string& path);
+
+		CacheStatistics get_cache_statistics();
+	private:
+		struct Block {
+			std::string path;
+			uint64_t index;
+			std::vector<uint8_t> data;
+		};
+
+		struct CachedFile {
+			// The size and write time of the file when its blocks were cached.
+			uint64_t size;
+			uint64_t write_time;
+			// The cached blocks of the file, keyed by block index.
+			std::unordered_map<uint64_t, std::list<Block>::iterator> blocks;
+		};
+
+		size_t memory_budget;
+		size_t memory_used = 0;
+		std::atomic_size_t total_cache_hits = 0;
+		std::atomic_size_t total_data_fetched = 0;
+
+		// All cached blocks, with the most recently used at the front.
+		std::list<Block> blocks;
+		std::unordered_map<std::string, CachedFile> files;
+		std::mutex cache_mutex;
+
+		// Gets the cached file at the given path, removing any cached blocks if they are for a different version of the file.
+		// Does not lock, caller must lock.
+		CachedFile* get_file(const std::string& path, const FileStat& stat);
+		// Removes all cached blocks of the given file.
+		// Does not lock, caller must lock.
+		void remove_blocks(CachedFile& file);
+		// Evicts the least recently used blocks until the memory used is within the budget.
+		// Does not lock, caller must lock.
+		void evict();
+	};
+}
@@ -0,0 +1,57 @@
+#include "BloomFilter.hpp"
+#include "hash_functions.hpp"
+
+namespace nandroidfs {
+	const size_t BITS_PER_VALUE = 10;
+	// The optimal number of bits to set for each value is about BITS_PER_VALUE * ln(2).
+	const uint32_t BITS_SET_PER_VALUE = 7;
+
+	BloomFilter::BloomFilter() { }
+
+	BloomFilter::BloomFilter(size_t expected_count) : bits((expected_count * BITS_PER_VALUE + 63) / 64 + 1) { }
+
+	void BloomFilter::insert(std::string_view value) {
+		uint32_t position;
+		uint32_t step;
+		hash(value, position, step);
+
+		uint64_t bit_count = bits.size() * 64;
+		for (uint32_t i = 0; i < BITS_SET_PER_VALUE; i++) {
+			uint64_t bit = position % bit_count;
+			bits[bit / 64] |= 1ULL << (bit % 64);
+			position += step;
+		}
+	}
+
+	bool BloomFilter::might_contain(std::string_view value) const {
+		if (bits.empty()) {
+			return true;
+		}
+
+		uint32_t position;
+		uint32_t step;
+		hash(value, position, step);
+
+		uint64_t bit_count = bits.size() * 64;
+		for (uint32_t i = 0; i < BITS_SET_PER_VALUE; i++) {
+			uint64_t bit = position % bit_count;
+			if ((bits[bit / 64] & (1ULL << (bit % 64))) == 0) {
+				return false;
+			}
+			position += step;
+		}
+
+		return true;
+	}
+
+	void BloomFilter::hash(std::string_view value, uint32_t& out_first, uint32_t& out_step) {
+		Xxh3Hasher hasher;
+		hasher.update(reinterpret_cast<const uint8_t*>(value.data()), value.size());
+		uint64_t digest = hasher.digest();
+
+		// Each bit is chosen with the same two hashes combined differently, which is as good as using a separate hash for each bit.
+		out_first = static_cast<uint32_t>(digest);
+		// An odd step means the positions do not repeat if the number of bits is a power of two.
+		out_step = static_cast<uint32_t>(digest >> 32) | 1;
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+namespace nandroidfs {
+	// A compact set of strings, which can tell that a string is definitely not in the set without storing the strings themselves.
+	// Takes about 10 bits per string, and wrongly reports that a string might be in the set about 1% of the time.
+	class BloomFilter {
+	public:
+		// Creates a filter that might contain every string.
+		BloomFilter();
+		// Creates an empty filter sized to hold `expected_count` strings.
+		BloomFilter(size_t expected_count);
+
+		void insert(std::string_view value);
+		// Returns false if `value` is definitely not in the set.
+		bool might_contain(std::string_view value) const;
+	private:
+		std::vector<uint64_t> bits;
+
+		// Gets the two hashes from which the positions of the bits for `value` are derived.
+		static void hash(std::string_view value, uint32_t& out_first, uint32_t& out_step);
+	};
+}
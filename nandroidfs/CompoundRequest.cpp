@@ -0,0 +1,155 @@
+#include "CompoundRequest.hpp"
+#include "conversion.hpp"
+#include <stdexcept>
+
+namespace nandroidfs {
+	// Buffer size for the DataWriter used to write the arguments of each step.
+	const int STEP_ARGS_BUFFER_SIZE = 512;
+
+	ResponseStatus get_first_failure(const std::vector<CompoundStepResult>& results) {
+		for (const CompoundStepResult& result : results) {
+			if (result.status != ResponseStatus::Success) {
+				return result.status;
+			}
+		}
+
+		return ResponseStatus::Success;
+	}
+
+	FILE_HANDLE CompoundRequest::step_handle(uint16_t step) {
+		return compound_step_handle(step);
+	}
+
+	uint16_t CompoundRequest::add_step(RequestType type,
+		bool continue_on_failure,
+		std::vector<std::string> changed_paths,
+		bool changes_listing,
+		std::function<void(DataWriter& writer)> write_args) {
+		if (steps.size() >= UINT16_MAX) {
+			throw std::runtime_error("Too many steps in compound request");
+		}
+
+		Step step;
+		step.type = type;
+		step.continue_on_failure = continue_on_failure;
+		step.changed_paths = std::move(changed_paths);
+		step.changes_listing = changes_listing;
+
+		MemoryWritable args;
+		{
+			DataWriter writer(&args, STEP_ARGS_BUFFER_SIZE);
+			write_args(writer);
+			writer.flush();
+		}
+		step.args = std::move(args.data);
+
+		steps.push_back(std::move(step));
+		return static_cast<uint16_t>(steps.size() - 1);
+	}
+
+	uint16_t CompoundRequest::stat_file(LPCWSTR path, bool continue_on_failure) {
+		std::string unix_path = win32_path_to_unix(path);
+		return add_step(RequestType::StatFile, continue_on_failure, {}, false, [&](DataWriter& writer) {
+			writer.write_utf8_string(unix_path);
+		});
+	}
+
+	uint16_t CompoundRequest::create_directory(LPCWSTR path, bool continue_on_failure) {
+		std::string unix_path = win32_path_to_unix(path);
+		return add_step(RequestType::CreateDirectory, continue_on_failure, { unix_path }, true, [&](DataWriter& writer) {
+			writer.write_utf8_string(unix_path);
+		});
+	}
+
+	uint16_t CompoundRequest::can_remove_file(LPCWSTR path, bool continue_on_failure) {
+		std::string unix_path = win32_path_to_unix(path);
+		return add_step(RequestType::CheckRemoveFile, continue_on_failure, {}, false, [&](DataWriter& writer) {
+			writer.write_utf8_string(unix_path);
+		});
+	}
+
+	uint16_t CompoundRequest::can_remove_directory(LPCWSTR path, bool continue_on_failure) {
+		std::string unix_path = win32_path_to_unix(path);
+		return add_step(RequestType::CheckRemoveDirectory, continue_on_failure, {}, false, [&](DataWriter& writer) {
+			writer.write_utf8_string(unix_path);
+		});
+	}
+
+	uint16_t CompoundRequest::remove_file(LPCWSTR path, bool continue_on_failure) {
+		std::string unix_path = win32_path_to_unix(path);
+		return add_step(RequestType::RemoveFile, continue_on_failure, { unix_path }, true, [&](DataWriter& writer) {
+			writer.write_utf8_string(unix_path);
+		});
+	}
+
+	uint16_t CompoundRequest::remove_directory(LPCWSTR path, bool continue_on_failure) {
+		std::string unix_path = win32_path_to_unix(path);
+		return add_step(RequestType::RemoveDirectory, continue_on_failure, { unix_path }, true, [&](DataWriter& writer) {
+			writer.write_utf8_string(unix_path);
+		});
+	}
+
+	uint16_t CompoundRequest::move_entry(LPCWSTR from_path, LPCWSTR to_path, bool replace_if_exists, bool continue_on_failure) {
+		MoveEntryArgs args(win32_path_to_unix(from_path), win32_path_to_unix(to_path), replace_if_exists);
+		return add_step(RequestType::MoveEntry, continue_on_failure, { args.from_path, args.to_path }, true, [&](DataWriter& writer) {
+			args.write(writer);
+		});
+	}
+
+	uint16_t CompoundRequest::open_file(LPCWSTR path,
+		OpenMode mode,
+		bool read_access,
+		bool write_access,
+		AccessHint hint,
+		bool continue_on_failure) {
+		OpenHandleArgs args(win32_path_to_unix(path), mode, read_access, write_access, hint);
+		// Every mode other than OpenOnly may create or truncate the file.
+		bool changes_file = mode != OpenMode::OpenOnly;
+		std::vector<std::string> changed_paths;
+		if (changes_file) {
+			changed_paths.push_back(args.path);
+		}
+
+		return add_step(RequestType::OpenHandle, continue_on_failure, changed_paths, changes_file, [&](DataWriter& writer) {
+			args.write(writer);
+		});
+	}
+
+	uint16_t CompoundRequest::close_file(FILE_HANDLE handle, bool continue_on_failure) {
+		return add_step(RequestType::CloseHandle, continue_on_failure, {}, false, [&](DataWriter& writer) {
+			writer.write_u32(handle);
+		});
+	}
+
+	uint16_t CompoundRequest::write_to_file(LPCWSTR path,
+		FILE_HANDLE handle,
+		uint64_t offset,
+		std::vector<uint8_t> data,
+		bool continue_on_failure) {
+		WriteHandleInitArgs args(handle, offset, static_cast<uint32_t>(data.size()));
+		uint16_t step = add_step(RequestType::WriteHandle, continue_on_failure, { win32_path_to_unix(path) }, false, [&](DataWriter& writer) {
+			args.write(writer);
+		});
+
+		steps[step].data = std::move(data);
+		return step;
+	}
+
+	uint16_t CompoundRequest::set_file_len(LPCWSTR path, FILE_HANDLE handle, uint64_t file_len, bool continue_on_failure) {
+		TruncateHandleArgs args(handle, file_len);
+		return add_step(RequestType::TruncateHandle, continue_on_failure, { win32_path_to_unix(path) }, false, [&](DataWriter& writer) {
+			args.write(writer);
+		});
+	}
+
+	uint16_t CompoundRequest::set_file_time(LPCWSTR path, int64_t access_time, int64_t write_time, bool continue_on_failure) {
+		SetFileTimeArgs args(win32_path_to_unix(path), access_time, write_time);
+		return add_step(RequestType::SetFileTime, continue_on_failure, { args.path }, false, [&](DataWriter& writer) {
+			args.write(writer);
+		});
+	}
+
+	bool CompoundRequest::empty() {
+		return steps.empty();
+	}
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "dokan_no_winsock.h"
+#include "serialization.hpp"
+#include "requests.hpp"
+#include "responses.hpp"
+
+namespace nandroidfs {
+	// The result of a step of a CompoundRequest.
+	struct CompoundStepResult {
+		ResponseStatus status;
+		// Only set for open_file steps that are successful.
+		FILE_HANDLE handle = 0;
+		bool existed = false;
+		// Only set for open_file and stat_file steps that are successful.
+		FileStat stat;
+	};
+
+	// Gets the status of the first step that failed, or Success if every step was successful.
+	ResponseStatus get_first_failure(const std::vector<CompoundStepResult>& results);
+
+	// A chain of operations that is sent with `Connection::req_compound`, which the daemon runs one after the other in a single round trip.
+	// Each function adds a step to the end of the chain and returns the index of the step.
+	// If a step fails, the steps after it are skipped, unless `continue_on_failure` is true for the failed step.
+	// Handles opened by open_file steps are closed by the daemon if a later step is skipped in this way.
+	class CompoundRequest {
+	public:
+		// Gets a handle that can be given to later steps to refer to the handle opened by the open_file step at index `step`.
+		static FILE_HANDLE step_handle(uint16_t step);
+
+		uint16_t stat_file(LPCWSTR path, bool continue_on_failure = false);
+		uint16_t create_directory(LPCWSTR path, bool continue_on_failure = false);
+		uint16_t can_remove_file(LPCWSTR path, bool continue_on_failure = false);
+		uint16_t can_remove_directory(LPCWSTR path, bool continue_on_failure = false);
+		uint16_t remove_file(LPCWSTR path, bool continue_on_failure = false);
+		uint16_t remove_directory(LPCWSTR path, bool continue_on_failure = false);
+		uint16_t move_entry(LPCWSTR from_path, LPCWSTR to_path, bool replace_if_exists, bool continue_on_failure = false);
+		uint16_t open_file(LPCWSTR path, OpenMode mode, bool read_access, bool write_access, AccessHint hint, bool continue_on_failure = false);
+		uint16_t close_file(FILE_HANDLE handle, bool continue_on_failure = false);
+		// `path` must be the path the handle was opened with.
+		uint16_t write_to_file(LPCWSTR path, FILE_HANDLE handle, uint64_t offset, std::vector<uint8_t> data, bool continue_on_failure = false);
+		// `path` must be the path the handle was opened with.
+		uint16_t set_file_len(LPCWSTR path, FILE_HANDLE handle, uint64_t file_len, bool continue_on_failure = false);
+		uint16_t set_file_time(LPCWSTR path, int64_t access_time, int64_t write_time, bool continue_on_failure = false);
+
+		bool empty();
+	private:
+		friend class Connection;
+
+		struct Step {
+			RequestType type;
+			bool continue_on_failure;
+			// The arguments of the step, as they would be written for a request of its type.
+			std::vector<uint8_t> args;
+			// The data written by a write_to_file step, which is sent after `args`.
+			std::vector<uint8_t> data;
+			// The paths of the entries that the step may change, whose cached state is invalidated by `Connection::req_compound`.
+			std::vector<std::string> changed_paths;
+			// Whether the step may add or remove the entries at `changed_paths`, so that the listings of their parents must be invalidated.
+			bool changes_listing = false;
+		};
+		std::vector<Step> steps;
+
+		uint16_t add_step(RequestType type,
+			bool continue_on_failure,
+			std::vector<std::string> changed_paths,
+			bool changes_listing,
+			std::function<void(DataWriter& writer)> write_args);
+	};
+}
@@ -1,201 +1,334 @@
 #include "Connection.hpp"
 #include "WinSockException.hpp"
 #include "path_utils.hpp"
+#include "compression.hpp"
 
 #include "conversion.hpp"
 
+#include <ctime>
 #include <iostream>
 
 namespace nandroidfs {
-	// Buffer size for the DataWriter and DataReader.
-	const int BUFFER_SIZE = 8192;
+	// Buffer size for the DataReader used to read decompressed response bodies.
+	const int BODY_BUFFER_SIZE = 8192;
 
-	Connection::Connection(std::string address, uint16_t port, ContextLogger& parent_logger) 
-		: writer(this, BUFFER_SIZE),
-		reader(this, BUFFER_SIZE),
-		logger(parent_logger.with_context("Connection")),
+	CachedListing::CachedListing() { }
+
+	CachedListing::CachedListing(std::vector<std::string> entry_names, bool use_filter, uint64_t changes_before) {
+		this->changes_before = changes_before;
+		if (use_filter) {
+			name_filter = BloomFilter(entry_names.size());
+			for (const std::string& name : entry_names) {
+				name_filter.insert(name);
+			}
+		}
+		this->entry_names = std::move(entry_names);
+	}
+
+	Connection::Connection(std::string address, uint16_t port, std::string device_serial, ContextLogger& parent_logger) 
+		: logger(parent_logger.with_context("Connection")),
 		stat_cache(STAT_SCAN_PERIOD, STAT_CACHE_PERIOD),
-		dir_list_cache(STAT_SCAN_PERIOD, STAT_CACHE_PERIOD) {
+		dir_list_cache(STAT_SCAN_PERIOD, STAT_CACHE_PERIOD),
+		missing_cache(STAT_SCAN_PERIOD, MISSING_CACHE_PERIOD),
+		block_cache(BLOCK_CACHE_BUDGET) {
+		std::optional<std::wstring> store_path = MetadataStore::get_path_for_device(device_serial);
+		if (store_path.has_value()) {
+			metadata_store = std::make_unique<MetadataStore>(*store_path, logger);
+		}
+		else
+		{
+			logger.warn("nowhere to store metadata, directory listings will not be kept after unmounting");
+		}
+
 		logger.debug("initialising agent connection");
 		WSADATA wsa_data;
 		throw_if_nonzero(WSAStartup(MAKEWORD(2, 2), &wsa_data));
 		try {
-			struct addrinfo* result,
-				hints;
-
-			ZeroMemory(&hints, sizeof(hints));
-			hints.ai_family = AF_INET;
-			hints.ai_socktype = SOCK_STREAM;
-			hints.ai_protocol = IPPROTO_TCP;
-
-			// Fetch all addresses matching the address/port specified.
-			std::string port_string = std::to_string(port);
-			throw_if_nonzero(getaddrinfo(address.c_str(), port_string.c_str(), &hints, &result));
-
-			// Iterate through the provided linked list of addresses until reaching a nullptr.
-			SOCKET connect_socket = INVALID_SOCKET;
-			for (struct addrinfo* ptr = result; ptr != nullptr; ptr = ptr->ai_next) {
-				logger.trace("trying address, family: {}, socktype: {}, protocol: {}", ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
-				connect_socket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
-				if (connect_socket == INVALID_SOCKET) {
-					freeaddrinfo(result);
-					throw WinSockException(WSAGetLastError());
-				}
-
-				int result = connect(connect_socket, ptr->ai_addr, (int)ptr->ai_addrlen);
-				if (result == -1) {
-					closesocket(connect_socket);
-					continue;
-				}
-
-				// Successfully connected; break
-				break;
-			}
-
-			freeaddrinfo(result);
-			// No possible addresses connected successfully
-			if (connect_socket == INVALID_SOCKET) {
-				throw std::runtime_error("Unable to connect to daemon; none of the supplied addresses led to a successful connection");
+			for (int i = 0; i < CONNECTION_POOL_SIZE; i++) {
+				sockets.push_back(std::make_unique<DaemonSocket>(address, port, logger, [this](ChangeKind kind, std::string& path) {
+					apply_change(kind, path);
+				}));
 			}
-
-			conn_sock = connect_socket;
-			logger.debug("connection successful, handshaking");
-			this->handshake();
 #ifdef _DEBUG
 			data_log_thread = std::thread(&Connection::data_log_entry_point, this);
 #endif
 		}
 		catch (std::exception&) {
 			// Ensure we release resources before propogating any exceptions.
+			sockets.clear();
 			WSACleanup();
 			throw;
 		}
 	}
 
-	void Connection::handshake() {
-		const uint32_t HANDSHAKE_DATA = 0xFAFE5ABE;
-		writer.write_u32(HANDSHAKE_DATA);
-		writer.flush();
+	DaemonSocket& Connection::choose_socket() {
+		DaemonSocket* chosen = sockets[0].get();
+		int chosen_in_flight = chosen->get_requests_in_flight();
+		for (int i = 1; i < sockets.size() && chosen_in_flight > 0; i++) {
+			int in_flight = sockets[i]->get_requests_in_flight();
+			if (in_flight < chosen_in_flight) {
+				chosen = sockets[i].get();
+				chosen_in_flight = in_flight;
+			}
+		}
+
+		return *chosen;
+	}
+
+	ResponseStatus Connection::req_stat_file(LPCWSTR path, FileStat& out_file_stat) {
+		std::string unix_path = win32_path_to_unix(path);
 
-		uint32_t received_data = reader.read_u32();
-		if (received_data == HANDSHAKE_DATA) {
-			logger.debug("handshake succeeded");
+		// Windows checks for files such as desktop.ini thousands of times each time you click a directory in file explorer.
+		std::optional<ResponseStatus> cached_status = lookup_cached_stat(unix_path, out_file_stat);
+		if (cached_status.has_value()) {
+			return *cached_status;
 		}
-		else
-		{
-			throw std::runtime_error("Failed handshake! Did not receive same bytes that were sent");
+
+		// Explorer also stats the entries of a directory one at a time, so once several entries of the same directory have missed the cache,
+		// the whole directory is listed instead, which caches the stat of every entry in a single request.
+		// It is always listed by the daemon, since each stored listing can only be used once, and is kept for when the directory itself is listed.
+		std::optional<std::string> parent = get_parent_path(unix_path);
+		if (parent.has_value() && note_sibling_miss(*parent)
+			&& list_directory_from_daemon(*parent, [](FileStat stat, std::wstring file_name) { }) == ResponseStatus::Success) {
+			cached_status = lookup_cached_stat(unix_path, out_file_stat);
+			if (cached_status.has_value()) {
+				return *cached_status;
+			}
+		}
+
+		uint64_t changes_before = changes_received;
+		Request request(choose_socket(), RequestType::StatFile);
+		request.writer.write_utf8_string(unix_path);
+		request.await_response();
+
+		ResponseStatus status = (ResponseStatus) request.reader.read_byte();
+		if (status == ResponseStatus::FileNotFound) {
+			cache_missing(unix_path, changes_before);
+		}
+		if (status != ResponseStatus::Success) {
+			return status;
 		}
-	}
 
-	int Connection::read(uint8_t* buffer, int length) {
-		int result = recv(conn_sock, reinterpret_cast<char*>(buffer), length, 0);
-		if (result == -1) {
-			throw WinSockException(WSAGetLastError());
+		out_file_stat = FileStat(request.reader);
+		// Cache the stat for future calls
+		if (parent.has_value()) {
+			stat_cache.cache(unix_path, out_file_stat, cache_period_for(*parent, changes_before));
 		}
 		else
 		{
-			// Number of bytes read
-#ifdef _DEBUG
-			data_read += result;
-#endif
-			return result;
+			stat_cache.cache(unix_path, out_file_stat);
 		}
-	}
 
-	void Connection::write(const uint8_t* buffer, int length) {
-		while (length > 0) {
-			int result = send(conn_sock, reinterpret_cast<const char*>(buffer), length, 0);
-			if (result == -1) {
-				throw WinSockException(WSAGetLastError());
-			}
-
-			length -= result;
-			buffer += result;
-#ifdef _DEBUG
-			data_written += result;
-#endif
-		}
+		return ResponseStatus::Success;
 	}
 
-	ResponseStatus Connection::req_stat_file(LPCWSTR path, FileStat& out_file_stat) {
+	bool Connection::get_cached_stat(LPCWSTR path, FileStat& out_file_stat) {
 		std::string unix_path = win32_path_to_unix(path);
+		return lookup_cached_stat(unix_path, out_file_stat) == ResponseStatus::Success;
+	}
 
-		// Attempt to use a cached version of the stat.
-		auto cached_stat = stat_cache.get_cached(unix_path);
-		if (cached_stat.has_value()) {
-			out_file_stat = *cached_stat;
-			return ResponseStatus::Success;
+	ResponseStatus Connection::req_stat_many(const std::vector<std::wstring>& paths, std::vector<StatResult>& out_results) {
+		std::vector<std::string> unix_paths;
+		for (const std::wstring& path : paths) {
+			unix_paths.push_back(win32_path_to_unix(path.c_str()));
 		}
 
-		std::lock_guard guard(request_mutex);
+		return stat_many(unix_paths, out_results);
+	}
+
+	ResponseStatus Connection::stat_many(const std::vector<std::string>& unix_paths, std::vector<StatResult>& out_results) {
+		out_results.assign(unix_paths.size(), StatResult{ ResponseStatus::FileNotFound, FileStat() });
 
-		// Now that we've waited to lock the mutex, it's possible that somebody else statted and cached the stat
-		// for this path in the meanwhile, so we will check for a stat again.
-		cached_stat = stat_cache.get_cached(unix_path);
-		if (cached_stat.has_value()) {
-			out_file_stat = *cached_stat;
-			return ResponseStatus::Success;
+		// Only request the stats that are not already known.
+		std::vector<std::string> requested_paths;
+		std::vector<size_t> requested_indices;
+		for (size_t i = 0; i < unix_paths.size(); i++) {
+			std::string unix_path = unix_paths[i];
+
+			FileStat cached_stat;
+			std::optional<ResponseStatus> cached_status = lookup_cached_stat(unix_path, cached_stat);
+			if (cached_status.has_value()) {
+				out_results[i] = StatResult{ *cached_status, cached_stat };
+			}
+			else
+			{
+				requested_paths.push_back(std::move(unix_path));
+				requested_indices.push_back(i);
+			}
 		}
 
-		// Skip any requests for desktop.ini.
-		// Windows requests this about 6000 times each time you click a directory in file explorer.
-		// If somebody actually needs a file with this name, they can complain to me later.
-		if (unix_path.ends_with("desktop.ini")) {
-			return ResponseStatus::FileNotFound;
+		if (requested_paths.empty()) {
+			return ResponseStatus::Success;
 		}
 
-		writer.write_byte((uint8_t) RequestType::StatFile);
-		writer.write_utf8_string(unix_path);
-		writer.flush();
+		uint64_t changes_before = changes_received;
+		Request request(choose_socket(), RequestType::StatMany);
+		StatManyArgs args(std::move(requested_paths));
+		args.write(request.writer);
+		request.await_response();
 
-		ResponseStatus status = (ResponseStatus) reader.read_byte();
+		ResponseStatus status = (ResponseStatus)request.reader.read_byte();
 		if (status != ResponseStatus::Success) {
 			return status;
 		}
 
-		out_file_stat = FileStat(reader);
-		// Cache the stat for future calls
-		stat_cache.cache(unix_path, out_file_stat);
+		for (size_t i = 0; i < requested_indices.size(); i++) {
+			StatResult& result = out_results[requested_indices[i]];
+			result.status = (ResponseStatus)request.reader.read_byte();
+			if (result.status == ResponseStatus::Success) {
+				result.stat = FileStat(request.reader);
+				stat_cache.cache(args.paths[i], result.stat);
+			}
+			else if (result.status == ResponseStatus::FileNotFound)
+			{
+				cache_missing(args.paths[i], changes_before);
+			}
+		}
 
 		return ResponseStatus::Success;
 	}
 
 	ResponseStatus Connection::req_list_file_stats(LPCWSTR path, std::function<void(FileStat stat, std::wstring file_name)> consume_stat) {
 		std::string unix_dir_path = win32_path_to_unix(path);
-		if (try_use_cached_dir_listing(unix_dir_path, consume_stat)) {
+		return list_directory(unix_dir_path, consume_stat);
+	}
+
+	ResponseStatus Connection::list_directory(std::string& unix_dir_path, std::function<void(FileStat stat, std::wstring file_name)> consume_stat) {
+		if (try_use_cached_dir_listing(unix_dir_path, consume_stat)
+			|| try_use_stored_dir_listing(unix_dir_path, consume_stat)) {
 			return ResponseStatus::Success;
 		}
-		
-		std::lock_guard guard(request_mutex);
-		writer.write_byte((uint8_t) RequestType::ListDirectory);
-		writer.write_utf8_string(win32_path_to_unix(path));
-		writer.flush();
 
-		ResponseStatus status = (ResponseStatus) reader.read_byte();
+		return list_directory_from_daemon(unix_dir_path, consume_stat);
+	}
+
+	ResponseStatus Connection::list_directory_from_daemon(std::string& unix_dir_path, std::function<void(FileStat stat, std::wstring file_name)> consume_stat) {
+		uint64_t changes_before = changes_received;
+		Request request(choose_socket(), RequestType::ListDirectory);
+		request.writer.write_utf8_string(unix_dir_path);
+		request.await_response();
+
+		ResponseStatus status = (ResponseStatus) request.reader.read_byte();
+		if (status != ResponseStatus::Success) {
+			return status;
+		}
+
+		read_compressible_body(request, [&](DataReader& body_reader) {
+			read_dir_entries(unix_dir_path, body_reader, changes_before, consume_stat);
+		});
+
+		return ResponseStatus::Success;
+	}
+
+	ResponseStatus Connection::req_list_tree(LPCWSTR path,
+		uint16_t max_depth,
+		uint32_t max_entries,
+		std::function<void(FileStat stat, std::wstring relative_path)> consume_stat,
+		bool& out_truncated) {
+		std::string unix_root_path = win32_path_to_unix(path);
+
+		uint64_t changes_before = changes_received;
+		Request request(choose_socket(), RequestType::ListTree);
+		ListTreeArgs args(unix_root_path, max_depth, max_entries);
+		args.write(request.writer);
+		request.await_response();
+
+		ResponseStatus status = (ResponseStatus)request.reader.read_byte();
 		if (status != ResponseStatus::Success) {
 			return status;
 		}
 
+		read_compressible_body(request, [&](DataReader& body_reader) {
+			while ((ResponseStatus)body_reader.read_byte() == ResponseStatus::Success) {
+				std::string relative_dir_path = body_reader.read_utf8_string();
+				std::string unix_dir_path = relative_dir_path.empty() ? unix_root_path : get_full_path(unix_root_path, relative_dir_path);
+				std::wstring relative_dir_prefix = relative_dir_path.empty() ? L"" : unix_path_to_win32(relative_dir_path) + L"\\";
+
+				read_dir_entries(unix_dir_path, body_reader, changes_before, [&](FileStat stat, std::wstring file_name) {
+					// Each subdirectory already appears as an entry in its parent, so its `.` and `..` entries are left out.
+					if (relative_dir_path.empty() || (file_name != L"." && file_name != L"..")) {
+						consume_stat(stat, relative_dir_prefix + file_name);
+					}
+				});
+			}
+
+			out_truncated = body_reader.read_byte() != 0;
+		});
+
+		return ResponseStatus::Success;
+	}
+
+	void Connection::read_compressible_body(Request& request, std::function<void(DataReader& body_reader)> read_body) {
+		if (!request.use_compression()) {
+			read_body(request.reader);
+			return;
+		}
+
+		// Decompress the whole body before reading it.
+		std::vector<uint8_t> body(request.reader.read_u32());
+		read_compressed(request.reader, body.data(), static_cast<uint32_t>(body.size()));
+
+		MemoryReadable body_stream(body.data(), body.size());
+		DataReader body_reader(&body_stream, BODY_BUFFER_SIZE);
+		read_body(body_reader);
+	}
+
+	void Connection::read_dir_entries(std::string& unix_dir_path,
+		DataReader& reader,
+		uint64_t changes_before,
+		std::function<void(FileStat stat, std::wstring file_name)> consume_stat) {
+		ms_duration valid_for = cache_period_for(unix_dir_path, changes_before);
+		// Only store listings of watched directories that did not change while they were listed,
+		// since otherwise the entries may have been listed before the change but the write time of the directory statted after it.
+		bool store_listing = metadata_store && valid_for == WATCHED_CACHE_PERIOD;
+		std::vector<std::pair<std::string, FileStat>> stored_entries;
+		std::optional<uint64_t> dir_write_time;
+		// Set if an entry could not be statted, in which case its name is not known.
+		bool any_failed = false;
+
 		std::vector<std::string> entries;
+		DirEntryReader dir_reader(reader);
 		ResponseStatus entry_status;
-		while((entry_status = (ResponseStatus) reader.read_byte()) != ResponseStatus::NoMoreEntries)
+		std::string file_name;
+		FileStat entry_stat;
+		while (dir_reader.read_entry(entry_status, file_name, entry_stat))
 		{
 			if (entry_status == ResponseStatus::Success) {
-				std::string file_name = reader.read_utf8_string();
-				FileStat entry_stat(reader);
 				std::string full_entry_path = get_full_path(unix_dir_path, file_name);
 
-				stat_cache.cache(full_entry_path, entry_stat);
+				stat_cache.cache(full_entry_path, entry_stat, valid_for);
 				entries.push_back(file_name);
+				if (store_listing) {
+					stored_entries.emplace_back(file_name, entry_stat);
+					if (file_name == ".") {
+						dir_write_time = entry_stat.write_time;
+					}
+				}
 
 				consume_stat(entry_stat, unix_path_to_win32(file_name));
 			}
-			// TODO: Right now we're skipping files with AccessDenied, maybe in the future we can show these files in some way?
-			// We know the filename, but we have no clue if they're files or directories.
+			else
+			{
+				// TODO: Right now we're skipping files with AccessDenied, maybe in the future we can show these files in some way?
+				// We know the filename, but we have no clue if they're files or directories.
+				any_failed = true;
+			}
+		}
+		// Entries created while the listing was in flight may be missing from it.
+		bool complete = !any_failed;
+		{
+			std::lock_guard lock(watched_dirs_mutex);
+			complete = complete && !dir_changed_since(unix_dir_path, changes_before);
+		}
+		// Only listings of watched directories have a filter, since changes to other directories are not reported.
+		bool use_filter = complete && valid_for == WATCHED_CACHE_PERIOD;
+		dir_list_cache.cache(unix_dir_path, CachedListing(std::move(entries), use_filter, changes_before), valid_for);
+		// A directory written to within the last second could have an entry added later in the same second without its write time changing.
+		store_listing = store_listing && dir_write_time.has_value()
+			&& static_cast<uint64_t>(std::time(nullptr)) >= *dir_write_time + MIN_STORED_DIR_AGE_SECS;
+		if (store_listing && complete) {
+			metadata_store->store_listing(unix_dir_path, *dir_write_time, stored_entries);
 		}
-		dir_list_cache.cache(unix_dir_path, entries);
-
-		return ResponseStatus::Success;
 	}
 
 	bool Connection::try_use_cached_dir_listing(std::string& unix_dir_path, std::function<void(FileStat stat, std::wstring file_name)> consume_stat) {
@@ -204,127 +337,320 @@ namespace nandroidfs {
 			return false;
 		}
 
-		std::vector<std::string> cached_dir = *opt_cached_dir;
-		for (int i = 0; i < cached_dir.size(); i++) {
+		std::vector<std::string>& cached_dir = opt_cached_dir->entry_names;
+		std::vector<std::optional<FileStat>> stats(cached_dir.size());
+		std::vector<std::string> uncached_paths;
+		std::vector<size_t> uncached_indices;
+		for (size_t i = 0; i < cached_dir.size(); i++) {
 			std::string full_path = get_full_path(unix_dir_path, cached_dir[i]);
+			stats[i] = stat_cache.get_cached(full_path);
+			if (!stats[i].has_value()) {
+				uncached_paths.push_back(std::move(full_path));
+				uncached_indices.push_back(i);
+			}
+		}
 
-			std::optional<FileStat> cached = stat_cache.get_cached(full_path);
-			if (cached.has_value()) {
-				consume_stat(*cached, unix_path_to_win32(cached_dir[i]));
+		// If most of the stats have expired, listing the directory again is cheaper than statting each entry.
+		if (uncached_paths.size() > cached_dir.size() / 2) {
+			return false;
+		}
+
+		// Otherwise, the stats of a few entries have been invalidated since the listing was cached, e.g. as they were written to,
+		// so these are fetched in a single request.
+		if (!uncached_paths.empty()) {
+			std::vector<StatResult> results;
+			if (stat_many(uncached_paths, results) != ResponseStatus::Success) {
+				return false;
 			}
-			else
-			{
-				// TODO: Handle this case. e.g. fetch the stat with a separate call.
-				// Right now the file will just be skipped.
+
+			for (size_t i = 0; i < results.size(); i++) {
+				if (results[i].status == ResponseStatus::Success) {
+					stats[uncached_indices[i]] = results[i].stat;
+				}
+			}
+		}
+
+		for (size_t i = 0; i < cached_dir.size(); i++) {
+			// Entries that could not be statted, e.g. as they have been removed, are left out.
+			if (stats[i].has_value()) {
+				consume_stat(*stats[i], unix_path_to_win32(cached_dir[i]));
 			}
 		}
 
 		return true;
 	}
 
-	ResponseStatus Connection::req_move_entry(LPCWSTR from_path, LPCWSTR to_path, bool replace_if_exists) {
-		std::lock_guard guard(request_mutex);
+	bool Connection::try_use_stored_dir_listing(std::string& unix_dir_path, std::function<void(FileStat stat, std::wstring file_name)> consume_stat) {
+		if (!metadata_store) {
+			return false;
+		}
+
+		std::optional<StoredListing> listing = metadata_store->take_listing(unix_dir_path);
+		if (!listing.has_value()) {
+			return false;
+		}
+
+		// The device may have changed since the listing was stored, but adding, removing or renaming an entry updates the write time of the directory,
+		// so the names are still correct if the write time of the directory is unchanged. Files may have been written to without changing the directory,
+		// so the stats of the entries are fetched again, in the same round trip as the stat of the directory (its "." entry).
+		// This still saves listing the directory, and each stored listing is only used once: later listings come from the daemon.
+		std::vector<std::string> entry_paths;
+		for (auto& entry : listing->entries) {
+			entry_paths.push_back(get_full_path(unix_dir_path, entry.first));
+		}
+
+		std::vector<StatResult> results;
+		if (stat_many(entry_paths, results) != ResponseStatus::Success) {
+			return false;
+		}
+
+		bool dir_unchanged = false;
+		for (size_t i = 0; i < results.size(); i++) {
+			if (listing->entries[i].first == ".") {
+				dir_unchanged = results[i].status == ResponseStatus::Success && results[i].stat.write_time == listing->dir_write_time;
+			}
+		}
+		if (!dir_unchanged) {
+			metadata_store->forget(unix_dir_path);
+			return false;
+		}
+
+		for (size_t i = 0; i < results.size(); i++) {
+			// Entries that could not be statted, e.g. as they have been removed since, are left out.
+			if (results[i].status == ResponseStatus::Success) {
+				consume_stat(results[i].stat, unix_path_to_win32(listing->entries[i].first));
+			}
+		}
+
+		return true;
+	}
 
+	ResponseStatus Connection::req_move_entry(LPCWSTR from_path, LPCWSTR to_path, bool replace_if_exists) {
 		std::string unix_from_path = win32_path_to_unix(from_path);
 		std::string unix_to_path = win32_path_to_unix(to_path);
 
 		stat_cache.invalidate(unix_from_path);
 		invalidate_parent_dir(unix_from_path);
+		block_cache.invalidate(unix_from_path);
 		stat_cache.invalidate(unix_to_path);
 		invalidate_parent_dir(unix_to_path);
+		block_cache.invalidate(unix_to_path);
+
+		ResponseStatus status;
+		{
+			Request request(choose_socket(), RequestType::MoveEntry);
+			MoveEntryArgs args(unix_from_path, unix_to_path, replace_if_exists);
+			args.write(request.writer);
+			request.await_response();
+
+			status = (ResponseStatus)request.reader.read_byte();
+		}
+
+		invalidate_parent_dir(unix_to_path);
+		return status;
+	}
+
+	ResponseStatus Connection::req_copy_entry(LPCWSTR from_path,
+		LPCWSTR to_path,
+		bool replace_if_exists,
+		std::function<void(uint64_t bytes_copied, uint64_t entries_copied)> on_progress,
+		uint64_t& out_bytes_copied) {
+		std::string unix_to_path = win32_path_to_unix(to_path);
+
+		ResponseStatus status;
+		{
+			Request request(choose_socket(), RequestType::CopyEntry);
+			CopyEntryArgs args(win32_path_to_unix(from_path), unix_to_path, replace_if_exists);
+			args.write(request.writer);
+			request.await_response();
+
+			while ((status = (ResponseStatus)request.reader.read_byte()) == ResponseStatus::InProgress) {
+				uint64_t bytes_copied = request.reader.read_u64();
+				uint64_t entries_copied = request.reader.read_u64();
+				on_progress(bytes_copied, entries_copied);
+				request.await_next_response();
+			}
+			out_bytes_copied = request.reader.read_u64();
+		}
 
-		writer.write_byte((uint8_t)RequestType::MoveEntry);
-		MoveEntryArgs args(unix_from_path, unix_to_path, replace_if_exists);
-		args.write(writer);
-		writer.flush();
+		// Invalidate once the copy has finished, since entries are created throughout it.
+		stat_cache.invalidate(unix_to_path);
+		invalidate_parent_dir(unix_to_path);
+		block_cache.invalidate(unix_to_path);
 
-		return (ResponseStatus)reader.read_byte();
+		return status;
 	}
 
 	ResponseStatus Connection::req_remove_file(LPCWSTR path) {
-		std::lock_guard guard(request_mutex);
-
 		std::string unix_path = win32_path_to_unix(path);
 		stat_cache.invalidate(unix_path);
 		invalidate_parent_dir(unix_path);
+		block_cache.invalidate(unix_path);
 
-		writer.write_byte((uint8_t)RequestType::RemoveFile);
-		writer.write_utf8_string(unix_path);
-		writer.flush();
+		Request request(choose_socket(), RequestType::RemoveFile);
+		request.writer.write_utf8_string(unix_path);
+		request.await_response();
 
-		return (ResponseStatus) reader.read_byte();
+		return (ResponseStatus) request.reader.read_byte();
 	}
 
 	ResponseStatus Connection::req_can_remove_file(LPCWSTR path) {
-		std::lock_guard guard(request_mutex);
+		Request request(choose_socket(), RequestType::CheckRemoveFile);
+		request.writer.write_utf8_string(win32_path_to_unix(path));
+		request.await_response();
 
-		writer.write_byte((uint8_t)RequestType::CheckRemoveFile);
-		writer.write_utf8_string(win32_path_to_unix(path));
-		writer.flush();
-
-		return (ResponseStatus)reader.read_byte();
+		return (ResponseStatus)request.reader.read_byte();
 	}
 
 	ResponseStatus Connection::req_remove_directory(LPCWSTR path) {
-		std::lock_guard guard(request_mutex);
-
 		std::string unix_path = win32_path_to_unix(path);
 		stat_cache.invalidate(unix_path);
 		invalidate_parent_dir(unix_path);
 
-		writer.write_byte((uint8_t)RequestType::RemoveDirectory);
-		writer.write_utf8_string(unix_path);
-		writer.flush();
+		Request request(choose_socket(), RequestType::RemoveDirectory);
+		request.writer.write_utf8_string(unix_path);
+		request.await_response();
 
-		return (ResponseStatus)reader.read_byte();
+		return (ResponseStatus)request.reader.read_byte();
 	}
 
-	ResponseStatus Connection::req_can_remove_directory(LPCWSTR path) {
-		std::lock_guard guard(request_mutex);
+	ResponseStatus Connection::req_remove_tree(LPCWSTR path, uint32_t& out_files_removed, uint32_t& out_directories_removed) {
+		std::string unix_path = win32_path_to_unix(path);
+		// Drop everything cached within the tree, since even entries that are not removed may be left in a different state.
+		stat_cache.invalidate_tree(unix_path);
+		dir_list_cache.invalidate_tree(unix_path);
+		block_cache.invalidate_tree(unix_path);
+		if (metadata_store) {
+			metadata_store->forget_tree(unix_path);
+		}
+		invalidate_parent_dir(unix_path);
+
+		Request request(choose_socket(), RequestType::RemoveTree);
+		request.writer.write_utf8_string(unix_path);
+		request.await_response();
+
+		ResponseStatus status = (ResponseStatus)request.reader.read_byte();
+		out_files_removed = request.reader.read_u32();
+		out_directories_removed = request.reader.read_u32();
+		return status;
+	}
+
+	ResponseStatus Connection::req_hash_range(LPCWSTR path,
+		uint64_t offset,
+		uint64_t length,
+		HashAlgorithm algorithm,
+		std::vector<uint8_t>& out_digest,
+		uint64_t& out_bytes_hashed) {
+		Request request(choose_socket(), RequestType::HashRange);
+		HashRangeArgs args(win32_path_to_unix(path), offset, length, algorithm);
+		args.write(request.writer);
+		request.await_response();
+
+		ResponseStatus status = (ResponseStatus)request.reader.read_byte();
+		out_bytes_hashed = request.reader.read_u64();
+		out_digest.resize(request.reader.read_byte());
+		request.reader.read_exact(out_digest.data(), static_cast<int>(out_digest.size()));
+		return status;
+	}
 
-		writer.write_byte((uint8_t)RequestType::CheckRemoveDirectory);
+	ResponseStatus Connection::req_write_delta(LPCWSTR path, DeltaSource source, uint64_t& out_literal_bytes) {
 		std::string unix_path = win32_path_to_unix(path);
-		writer.write_utf8_string(unix_path);
-		writer.flush();
+		out_literal_bytes = 0;
+
+		uint32_t block_size;
+		std::vector<BlockChecksum> blocks;
+		{
+			Request request(choose_socket(), RequestType::GetBlockChecksums);
+			request.writer.write_utf8_string(unix_path);
+			request.await_response();
+
+			ResponseStatus status = (ResponseStatus)request.reader.read_byte();
+			if (status != ResponseStatus::Success) {
+				return status;
+			}
+
+			request.reader.read_u64(); // Length of the existing file, which is not needed.
+			block_size = request.reader.read_u32();
+			blocks.resize(request.reader.read_u32());
+			for (BlockChecksum& block : blocks) {
+				block.rolling = request.reader.read_u32();
+				block.strong = request.reader.read_u64();
+			}
+		}
+
+		ResponseStatus status;
+		{
+			Request request(choose_socket(), RequestType::WriteDelta);
+			request.writer.write_utf8_string(unix_path);
+			request.writer.write_u32(block_size);
+			DeltaEncoder encoder(block_size, blocks);
+			out_literal_bytes = encoder.encode(request.writer, source, request.use_compression());
+			request.await_response();
+
+			status = (ResponseStatus)request.reader.read_byte();
+		}
 
-		return (ResponseStatus)reader.read_byte();
+		stat_cache.invalidate(unix_path);
+		invalidate_parent_dir(unix_path);
+		block_cache.invalidate(unix_path);
+		return status;
 	}
 
-	ResponseStatus Connection::req_create_directory(LPCWSTR path) {
-		std::lock_guard guard(request_mutex);
+	ResponseStatus Connection::req_can_remove_directory(LPCWSTR path) {
+		Request request(choose_socket(), RequestType::CheckRemoveDirectory);
+		request.writer.write_utf8_string(win32_path_to_unix(path));
+		request.await_response();
+
+		return (ResponseStatus)request.reader.read_byte();
+	}
 
+	ResponseStatus Connection::req_create_directory(LPCWSTR path) {
 		std::string unix_path = win32_path_to_unix(path);
 		stat_cache.invalidate(unix_path);
 		invalidate_parent_dir(unix_path);
 
-		writer.write_byte((uint8_t)RequestType::CreateDirectory);
-		writer.write_utf8_string(unix_path);
-		writer.flush();
+		ResponseStatus status;
+		{
+			Request request(choose_socket(), RequestType::CreateDirectory);
+			request.writer.write_utf8_string(unix_path);
+			request.await_response();
 
-		return (ResponseStatus)reader.read_byte();
+			status = (ResponseStatus)request.reader.read_byte();
+		}
+
+		invalidate_parent_dir(unix_path);
+		return status;
 	}
 
 	ResponseStatus Connection::req_open_file(LPCWSTR path,
 		OpenMode mode,
 		bool read_access,
 		bool write_access,
-		FILE_HANDLE& out_file_handle) {
-		std::lock_guard guard(request_mutex);
-
+		AccessHint hint,
+		FILE_HANDLE& out_file_handle,
+		bool& out_existed,
+		FileStat& out_file_stat) {
 		std::string unix_path = win32_path_to_unix(path);
-		// Fail anything to do with desktop.ini, just to stop windows spamming requests for this constantly.
-		if (unix_path.ends_with("desktop.ini")) {
-			return ResponseStatus::GenericFailure;
+		// Opening a file that must already exist fails in the same way as statting it. (see req_stat_file)
+		bool must_exist = mode == OpenMode::OpenOnly || mode == OpenMode::Truncate;
+		if (must_exist && is_known_missing(unix_path)) {
+			return ResponseStatus::FileNotFound;
 		}
-		
-		writer.write_byte((uint8_t)RequestType::OpenHandle);
-		OpenHandleArgs args(unix_path, mode, read_access, write_access);
-		args.write(writer);
-		writer.flush();
 
-		ResponseStatus status = (ResponseStatus) reader.read_byte();
-		if (status == ResponseStatus::Success) {
-			out_file_handle = reader.read_u32();
+		uint64_t changes_before = changes_received;
+		ResponseStatus status;
+		{
+			Request request(choose_socket(), RequestType::OpenHandle);
+			OpenHandleArgs args(unix_path, mode, read_access, write_access, hint);
+			args.write(request.writer);
+			request.await_response();
+
+			status = (ResponseStatus) request.reader.read_byte();
+			if (status == ResponseStatus::Success) {
+				out_file_handle = request.reader.read_u32();
+				out_existed = request.reader.read_byte();
+				out_file_stat = FileStat(request.reader);
+			}
 		}
 
 		switch (mode) {
@@ -333,124 +659,535 @@ namespace nandroidfs {
 			case OpenMode::CreateOrTruncate:
 				invalidate_parent_dir(unix_path);
 		}
+		if (mode == OpenMode::Truncate || mode == OpenMode::CreateOrTruncate) {
+			block_cache.invalidate(unix_path);
+		}
+		if (status == ResponseStatus::Success) {
+			// The stat is as fresh as any request would give, so later stats of the path can use it.
+			stat_cache.cache(unix_path, out_file_stat);
+		}
+		else if (must_exist && status == ResponseStatus::FileNotFound)
+		{
+			cache_missing(unix_path, changes_before);
+		}
+		else if (mode == OpenMode::Truncate || mode == OpenMode::CreateOrTruncate)
+		{
+			stat_cache.invalidate(unix_path);
+		}
 
 		return status;
 	}
 
 	ResponseStatus Connection::req_close_file(FILE_HANDLE file_handle) {
-		std::lock_guard guard(request_mutex);
-
-		writer.write_byte((uint8_t)RequestType::CloseHandle);
-		writer.write_u32(file_handle);
-		writer.flush();
-		return (ResponseStatus)reader.read_byte();
+		Request request(choose_socket(), RequestType::CloseHandle);
+		request.writer.write_u32(file_handle);
+		request.await_response();
+		return (ResponseStatus)request.reader.read_byte();
 	}
 
-	ResponseStatus Connection::req_write_to_file(FILE_HANDLE file_handle,
+	ResponseStatus Connection::req_write_to_file(LPCWSTR path,
+		FILE_HANDLE file_handle,
 		uint64_t file_offset,
 		const uint8_t* data,
 		uint32_t data_len) {
-		std::lock_guard guard(request_mutex);
+		ResponseStatus status;
+		{
+			// Write the request header and data to be written.
+			Request request(choose_socket(), RequestType::WriteHandle);
+			WriteHandleInitArgs args(file_handle, file_offset, data_len);
+			args.write(request.writer);
+			if (request.use_compression()) {
+				write_compressed(request.writer, data, data_len);
+			}
+			else
+			{
+				request.writer.write_exact(data, data_len);
+			}
 
-		// Write the request header and data to be written.
-		writer.write_byte((uint8_t)RequestType::WriteHandle);
-		WriteHandleInitArgs args(file_handle, file_offset, data_len);
-		args.write(writer);
-		writer.write_exact(data, data_len);
+			request.await_response();
+			status = (ResponseStatus)request.reader.read_byte();
+		}
+
+		// Invalidate once the write has completed, so that any data read while the write was in progress is not kept.
+		// The write time only has a resolution of one second, so the cached blocks would otherwise still be considered valid.
+		std::string unix_path = win32_path_to_unix(path);
+		stat_cache.invalidate(unix_path);
+		block_cache.invalidate(unix_path);
+
+		return status;
+	}
 
-		writer.flush();
+	void Connection::req_write_to_file_async(LPCWSTR path,
+		FILE_HANDLE file_handle,
+		uint64_t file_offset,
+		const uint8_t* data,
+		uint32_t data_len,
+		std::function<void(ResponseStatus status)> on_complete) {
+		Request request(choose_socket(), RequestType::WriteHandle);
+		WriteHandleInitArgs args(file_handle, file_offset, data_len);
+		args.write(request.writer);
+		if (request.use_compression()) {
+			write_compressed(request.writer, data, data_len);
+		}
+		else
+		{
+			request.writer.write_exact(data, data_len);
+		}
 
-		return (ResponseStatus)reader.read_byte();
+		std::string unix_path = win32_path_to_unix(path);
+		request.send_async([this, unix_path, on_complete](DataReader* reader) mutable {
+			ResponseStatus status = reader ? (ResponseStatus)reader->read_byte() : ResponseStatus::GenericFailure;
+
+			// See req_write_to_file
+			stat_cache.invalidate(unix_path);
+			block_cache.invalidate(unix_path);
+			on_complete(status);
+		});
 	}
 
-	ResponseStatus Connection::req_read_from_file(FILE_HANDLE file_handle,
+	ResponseStatus Connection::req_read_from_file(LPCWSTR path,
+		FILE_HANDLE file_handle,
+		const FileStat& stat,
 		uint64_t file_offset,
 		uint8_t* buffer,
 		uint32_t buffer_len,
 		int& bytes_read) {
-		std::lock_guard guard(request_mutex);
+		std::string unix_path = win32_path_to_unix(path);
+		uint32_t cached_bytes_read;
+		if (block_cache.read(unix_path, stat, file_offset, buffer, buffer_len, cached_bytes_read)) {
+			bytes_read = cached_bytes_read;
+			return ResponseStatus::Success;
+		}
+
+		// Read the whole blocks containing the requested data, so that they can all be cached.
+		uint64_t aligned_offset = file_offset - file_offset % BlockCache::BLOCK_SIZE;
+		uint64_t aligned_end = file_offset + buffer_len;
+		if (aligned_end % BlockCache::BLOCK_SIZE != 0) {
+			aligned_end += BlockCache::BLOCK_SIZE - aligned_end % BlockCache::BLOCK_SIZE;
+		}
+		uint32_t aligned_len = static_cast<uint32_t>(aligned_end - aligned_offset);
+
+		if (aligned_offset == file_offset && aligned_len == buffer_len) {
+			ResponseStatus status = read_from_file_uncached(file_handle, file_offset, buffer, buffer_len, bytes_read);
+			if (status == ResponseStatus::Success) {
+				block_cache.insert(unix_path, stat, file_offset, buffer, bytes_read);
+			}
+			return status;
+		}
+
+		std::vector<uint8_t> block_buffer(aligned_len);
+		int aligned_bytes_read;
+		ResponseStatus status = read_from_file_uncached(file_handle, aligned_offset, block_buffer.data(), aligned_len, aligned_bytes_read);
+		if (status != ResponseStatus::Success) {
+			return status;
+		}
+		block_cache.insert(unix_path, stat, aligned_offset, block_buffer.data(), aligned_bytes_read);
+
+		// Copy out the requested part of the blocks, which may be cut short by EOF.
+		uint32_t offset_in_blocks = static_cast<uint32_t>(file_offset - aligned_offset);
+		if (static_cast<uint32_t>(aligned_bytes_read) <= offset_in_blocks) {
+			bytes_read = 0;
+		}
+		else
+		{
+			bytes_read = std::min<uint32_t>(buffer_len, aligned_bytes_read - offset_in_blocks);
+			memcpy(buffer, block_buffer.data() + offset_in_blocks, bytes_read);
+		}
+
+		return ResponseStatus::Success;
+	}
+
+	ResponseStatus Connection::req_prefetch(LPCWSTR path, FILE_HANDLE file_handle, const FileStat& file_stat, uint64_t file_offset, uint32_t length) {
+		// Reading the data caches it, and the read is skipped if it is already cached.
+		std::vector<uint8_t> buffer(length);
+		int bytes_read;
+		return req_read_from_file(path, file_handle, file_stat, file_offset, buffer.data(), length, bytes_read);
+	}
 
-		// Write the request header and data to be written.
-		writer.write_byte((uint8_t)RequestType::ReadHandle);
+	ResponseStatus Connection::read_from_file_uncached(FILE_HANDLE file_handle,
+		uint64_t file_offset,
+		uint8_t* buffer,
+		uint32_t buffer_len,
+		int& bytes_read) {
+		Request request(choose_socket(), RequestType::ReadHandle);
 		ReadHandleArgs args(file_handle, buffer_len, file_offset);
-		args.write(writer);
-		writer.flush();
+		args.write(request.writer);
+		request.await_response();
 
-		ResponseStatus status = (ResponseStatus)reader.read_byte();
+		ResponseStatus status = (ResponseStatus)request.reader.read_byte();
 		if (status == ResponseStatus::Success) {
-			bytes_read = reader.read_u32();
-			reader.read_exact(buffer, bytes_read);
+			bytes_read = request.reader.read_u32();
+			if (request.use_compression()) {
+				read_compressed(request.reader, buffer, bytes_read);
+			}
+			else
+			{
+				request.reader.read_exact(buffer, bytes_read);
+			}
 		}
 
 		return status;
 	}
 	
-	ResponseStatus Connection::req_set_file_len(FILE_HANDLE file_handle, uint64_t file_len) {
-		std::lock_guard guard(request_mutex);
-		
-		writer.write_byte((uint8_t)RequestType::TruncateHandle);
-		TruncateHandleArgs args(file_handle, file_len);
+	ResponseStatus Connection::req_read_ranges(FILE_HANDLE file_handle, std::vector<ReadRangeBuffer>& ranges) {
+		std::vector<ReadRange> requested_ranges;
+		for (ReadRangeBuffer& range : ranges) {
+			requested_ranges.push_back(ReadRange{ range.file_offset, range.buffer_len });
+		}
+
+		Request request(choose_socket(), RequestType::ReadHandleV);
+		ReadHandleVArgs args(file_handle, std::move(requested_ranges));
+		args.write(request.writer);
+		request.await_response();
+
+		ResponseStatus status = (ResponseStatus)request.reader.read_byte();
+		if (status != ResponseStatus::Success) {
+			return status;
+		}
 
-		args.write(writer);
-		writer.flush();
+		for (ReadRangeBuffer& range : ranges) {
+			range.bytes_read = request.reader.read_u32();
+			if (request.use_compression()) {
+				read_compressed(request.reader, range.buffer, range.bytes_read);
+			}
+			else
+			{
+				request.reader.read_exact(range.buffer, range.bytes_read);
+			}
+		}
 
-		return (ResponseStatus)reader.read_byte();
+		return ResponseStatus::Success;
 	}
 
-	ResponseStatus Connection::req_set_file_time(LPCWSTR path, uint64_t access_time, uint64_t write_time) {
-		std::lock_guard guard(request_mutex);
+	ResponseStatus Connection::req_set_file_len(LPCWSTR path, FILE_HANDLE file_handle, uint64_t file_len) {
+		ResponseStatus status;
+		{
+			Request request(choose_socket(), RequestType::TruncateHandle);
+			TruncateHandleArgs args(file_handle, file_len);
+			args.write(request.writer);
+			request.await_response();
+			status = (ResponseStatus)request.reader.read_byte();
+		}
 
 		std::string unix_path = win32_path_to_unix(path);
 		stat_cache.invalidate(unix_path);
+		block_cache.invalidate(unix_path);
+
+		return status;
+	}
 
-		writer.write_byte((uint8_t)RequestType::SetFileTime);
+	ResponseStatus Connection::req_set_file_time(LPCWSTR path, uint64_t access_time, uint64_t write_time) {
+		std::string unix_path = win32_path_to_unix(path);
+		stat_cache.invalidate(unix_path);
 
+		Request request(choose_socket(), RequestType::SetFileTime);
 		SetFileTimeArgs args(unix_path, access_time, write_time);
-		args.write(writer);
-		writer.flush();
+		args.write(request.writer);
+		request.await_response();
 
-		return (ResponseStatus)reader.read_byte();
+		return (ResponseStatus)request.reader.read_byte();
 	}
 
 	ResponseStatus Connection::req_get_disk_stats(DiskStats& out_disk_stats) {
-		std::lock_guard guard(request_mutex);
-
-		writer.write_byte((uint8_t)RequestType::GetDiskStats);
-		writer.flush();
+		Request request(choose_socket(), RequestType::GetDiskStats);
+		request.await_response();
 
-		ResponseStatus status = (ResponseStatus)reader.read_byte();
+		ResponseStatus status = (ResponseStatus)request.reader.read_byte();
 		if (status == ResponseStatus::Success) {
-			DiskStats stats(reader);
+			DiskStats stats(request.reader);
 			out_disk_stats = stats;
 		}
 
 		return status;
 	}
 
+	ResponseStatus Connection::req_compound(CompoundRequest& compound, std::vector<CompoundStepResult>& out_results) {
+		out_results.clear();
+		if (compound.steps.empty()) {
+			return ResponseStatus::Success;
+		}
+
+		// Invalidate before the request, as each request does for the entries it changes,
+		// and again once it completes, so that any state cached while the steps were running is not kept.
+		invalidate_compound_paths(compound);
+		ResponseStatus status;
+		{
+			Request request(choose_socket(), RequestType::Compound);
+			request.writer.write_u16(static_cast<uint16_t>(compound.steps.size()));
+			for (CompoundRequest::Step& step : compound.steps) {
+				request.writer.write_byte(static_cast<uint8_t>(step.type));
+				request.writer.write_byte(step.continue_on_failure);
+				request.writer.write_exact(step.args.data(), static_cast<int>(step.args.size()));
+				if (step.type != RequestType::WriteHandle) {
+					continue;
+				}
+
+				if (request.use_compression()) {
+					write_compressed(request.writer, step.data.data(), static_cast<uint32_t>(step.data.size()));
+				}
+				else
+				{
+					request.writer.write_exact(step.data.data(), static_cast<int>(step.data.size()));
+				}
+			}
+			request.await_response();
+
+			status = (ResponseStatus)request.reader.read_byte();
+			if (status == ResponseStatus::Success) {
+				for (CompoundRequest::Step& step : compound.steps) {
+					CompoundStepResult result;
+					result.status = (ResponseStatus)request.reader.read_byte();
+					if (result.status == ResponseStatus::Success && step.type == RequestType::OpenHandle) {
+						result.handle = request.reader.read_u32();
+						result.existed = request.reader.read_byte();
+						result.stat = FileStat(request.reader);
+					}
+					else if (result.status == ResponseStatus::Success && step.type == RequestType::StatFile)
+					{
+						result.stat = FileStat(request.reader);
+					}
+					out_results.push_back(result);
+				}
+			}
+		}
+
+		invalidate_compound_paths(compound);
+		return status;
+	}
+
+	void Connection::invalidate_compound_paths(CompoundRequest& compound) {
+		for (CompoundRequest::Step& step : compound.steps) {
+			for (std::string& path : step.changed_paths) {
+				stat_cache.invalidate(path);
+				block_cache.invalidate(path);
+				if (step.changes_listing) {
+					invalidate_parent_dir(path);
+				}
+			}
+		}
+	}
+
 	void Connection::invalidate_parent_dir(std::string& path) {
+		// Anything that changes the listing may create `path`, or entries within it if it is a directory that was moved or copied.
+		missing_cache.invalidate_tree(path);
+		note_dir_changed(path);
+
 		std::optional<std::string> parent = get_parent_path(path);
 		if (parent.has_value()) {
+			note_dir_changed(*parent);
 			dir_list_cache.invalidate(*parent);
+			if (metadata_store) {
+				metadata_store->forget(*parent);
+			}
 		}
 	}
 
-#ifdef _DEBUG
-	void Connection::data_log_entry_point() {
+	void Connection::apply_change(ChangeKind kind, std::string& path) {
+		switch (kind) {
+			// Starting or stopping a watch does not change the directory, so a listing in flight, which is usually the request
+			// that started the watch, is not affected. Whether the directory is watched is checked once the response arrives.
+			case ChangeKind::Watching: {
+				std::lock_guard lock(watched_dirs_mutex);
+				watched_dirs[path]++;
+				break;
+			}
+			case ChangeKind::Unwatched: {
+				{
+					std::lock_guard lock(watched_dirs_mutex);
+					auto watched = watched_dirs.find(path);
+					if (watched == watched_dirs.end() || --watched->second > 0) {
+						break;
+					}
+					watched_dirs.erase(watched);
+				}
+
+				// Changes to the directory are no longer reported, so anything cached for longer because of the watch must go.
+				stat_cache.invalidate_tree(path);
+				dir_list_cache.invalidate_tree(path);
+				missing_cache.invalidate_tree(path);
+				break;
+			}
+			case ChangeKind::EntryChanged: {
+				stat_cache.invalidate(path);
+				block_cache.invalidate(path);
+				std::optional<std::string> parent = get_parent_path(path);
+				if (parent.has_value()) {
+					stat_cache.invalidate(*parent);
+				}
+				// The listing holds the stat of the entry, so is out of date even if the entry was only written to.
+				invalidate_parent_dir(path);
+				break;
+			}
+			case ChangeKind::TreeChanged: {
+				// The directories within the tree that have changed are not known.
+				note_all_dirs_changed();
+				stat_cache.invalidate_tree(path);
+				dir_list_cache.invalidate_tree(path);
+				block_cache.invalidate_tree(path);
+				if (metadata_store) {
+					metadata_store->forget_tree(path);
+				}
+				std::optional<std::string> parent = get_parent_path(path);
+				if (parent.has_value()) {
+					stat_cache.invalidate(*parent);
+				}
+				invalidate_parent_dir(path);
+				break;
+			}
+			case ChangeKind::Overflow:
+				// Some changes were not reported, so no cached stat or listing can be relied on.
+				note_all_dirs_changed();
+				// Cached blocks are checked against the stat of their file, so they can be kept.
+				stat_cache.invalidate_all();
+				dir_list_cache.invalidate_all();
+				missing_cache.invalidate_all();
+				break;
+			default:
+				logger.warn("unknown change notification kind {}", (int)kind);
+		}
+	}
+
+	std::optional<ResponseStatus> Connection::lookup_cached_stat(std::string& unix_path, FileStat& out_file_stat) {
+		// The stats of the entries in each cached listing are kept in the stat cache for as long as the listing.
+		std::optional<FileStat> cached_stat = stat_cache.get_cached(unix_path);
+		if (cached_stat.has_value()) {
+			out_file_stat = *cached_stat;
+			return ResponseStatus::Success;
+		}
+
+		if (is_known_missing(unix_path)) {
+			return ResponseStatus::FileNotFound;
+		}
+
+		return std::nullopt;
+	}
+
+	bool Connection::note_sibling_miss(std::string& unix_dir_path) {
+		std::lock_guard lock(sibling_misses_mutex);
+		auto now = std::chrono::steady_clock::now();
+		if (sibling_misses.size() >= MAX_SIBLING_MISS_DIRS) {
+			std::erase_if(sibling_misses, [&](auto& misses) {
+				return now - misses.second.window_start > SIBLING_MISS_WINDOW;
+			});
+		}
+
+		SiblingMisses& misses = sibling_misses[unix_dir_path];
+		if (now - misses.window_start > SIBLING_MISS_WINDOW) {
+			misses.count = 0;
+			misses.window_start = now;
+		}
+
+		misses.count++;
+		if (misses.count < SIBLING_MISS_THRESHOLD) {
+			return false;
+		}
+
+		sibling_misses.erase(unix_dir_path);
+		return true;
+	}
+
+	bool Connection::is_known_missing(std::string& unix_path) {
+		std::string path = unix_path;
+		// If a directory is missing, so is everything that would be within it.
 		while (true) {
-			{
-				std::lock_guard guard(request_mutex);
+			if (missing_cache.get_cached(path).has_value()) {
+				return true;
+			}
+
+			std::optional<std::string> parent = get_parent_path(path);
+			if (!parent.has_value()) {
+				return false;
+			}
 
-				if (kill_data_log) {
-					return; // Stop thread if requested.
+			std::string_view name = std::string_view(path).substr(path.find_last_of('/') + 1);
+			bool missing_from_listing = false;
+			uint64_t listing_changes_before = 0;
+			dir_list_cache.use_cached(*parent, [&](const CachedListing& listing) {
+				missing_from_listing = !listing.name_filter.might_contain(name);
+				listing_changes_before = listing.changes_before;
+			});
+			if (missing_from_listing) {
+				// The listing may be out of date if a change to the directory was seen after it was listed,
+				// or might not have been seen because the directory is no longer watched.
+				std::lock_guard lock(watched_dirs_mutex);
+				if (watched_dirs.contains(*parent) && !dir_changed_since(*parent, listing_changes_before)) {
+					return true;
 				}
+			}
 
-				int written_kb = data_written >> 10;
-				int read_kb = data_read >> 10;
+			path = std::move(*parent);
+		}
+	}
 
-				logger.debug("wrote {}KiB, read {}KiB", written_kb, read_kb);
-				data_written = 0;
-				data_read = 0;
+	void Connection::cache_missing(std::string& unix_path, uint64_t changes_before) {
+		std::optional<std::string> parent = get_parent_path(unix_path);
+		// The entry may have been created after the daemon looked for it.
+		if (parent.has_value()) {
+			std::lock_guard lock(watched_dirs_mutex);
+			if (dir_changed_since(*parent, changes_before)) {
+				return;
 			}
+		}
+
+		// The daemon reports the creation of entries within watched directories, so they can be remembered as missing until then.
+		if (parent.has_value() && cache_period_for(*parent, changes_before) == WATCHED_CACHE_PERIOD) {
+			missing_cache.cache(unix_path, true, WATCHED_CACHE_PERIOD);
+		}
+		else
+		{
+			missing_cache.cache(unix_path, true);
+		}
+	}
+
+	void Connection::note_dir_changed(const std::string& unix_dir_path) {
+		std::lock_guard lock(watched_dirs_mutex);
+		if (dir_changes.size() >= MAX_TRACKED_DIR_CHANGES && !dir_changes.contains(unix_dir_path)) {
+			// Forgetting the changes to every directory is rare, and only means that the responses in flight are cached for less time.
+			dir_changes.clear();
+			all_dirs_changed = ++changes_received;
+		}
+		dir_changes[unix_dir_path] = ++changes_received;
+	}
+
+	void Connection::note_all_dirs_changed() {
+		std::lock_guard lock(watched_dirs_mutex);
+		all_dirs_changed = ++changes_received;
+	}
+
+	bool Connection::dir_changed_since(const std::string& unix_dir_path, uint64_t changes_before) {
+		if (all_dirs_changed > changes_before) {
+			return true;
+		}
+
+		auto changed = dir_changes.find(unix_dir_path);
+		return changed != dir_changes.end() && changed->second > changes_before;
+	}
+
+	ms_duration Connection::cache_period_for(std::string& unix_dir_path, uint64_t changes_before) {
+		std::lock_guard lock(watched_dirs_mutex);
+		if (!dir_changed_since(unix_dir_path, changes_before) && watched_dirs.contains(unix_dir_path)) {
+			return WATCHED_CACHE_PERIOD;
+		}
+		else
+		{
+			return STAT_CACHE_PERIOD;
+		}
+	}
+
+#ifdef _DEBUG
+	void Connection::data_log_entry_point() {
+		while (true) {
+			if (kill_data_log) {
+				return; // Stop thread if requested.
+			}
+
+			int written_kb = 0;
+			int read_kb = 0;
+			for (auto& socket : sockets) {
+				written_kb += socket->take_data_written() >> 10;
+				read_kb += socket->take_data_read() >> 10;
+			}
+			logger.debug("wrote {}KiB, read {}KiB", written_kb, read_kb);
 
 			std::this_thread::sleep_for(std::chrono::milliseconds(1000));
 		}
@@ -460,17 +1197,16 @@ namespace nandroidfs {
 	Connection::~Connection() {
 		// Tell the data log thread to stop.
 #ifdef _DEBUG
-		request_mutex.lock();
 		kill_data_log = true;
-		request_mutex.unlock();
-
 		data_log_thread.join();
 
 		logger.debug("stat cache statistics: {}", stat_cache.get_cache_statistics());
 		logger.debug("dir listing statistics: {}", dir_list_cache.get_cache_statistics());
+		logger.debug("missing file statistics: {}", missing_cache.get_cache_statistics());
+		logger.debug("block cache statistics: {}", block_cache.get_cache_statistics());
 #endif
 
-		closesocket(conn_sock);
+		sockets.clear();
 		WSACleanup();
 	}
 }
\ No newline at end of file
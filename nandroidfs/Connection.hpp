@@ -3,6 +3,11 @@
 #include <string_view>
 #include <mutex>
 #include <functional>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
 
 #include "dokan_no_winsock.h"
 #include <winsock2.h>
@@ -11,93 +16,318 @@
 #include <stdio.h>
 
 #include "serialization.hpp"
+#include "requests.hpp"
 #include "responses.hpp"
+#include "DaemonSocket.hpp"
 #include "TimedCache.hpp"
+#include "BlockCache.hpp"
+#include "DeltaEncoder.hpp"
+#include "CompoundRequest.hpp"
+#include "MetadataStore.hpp"
+#include "BloomFilter.hpp"
 #include "Logger.hpp"
 
 namespace nandroidfs {
 	const ms_duration STAT_CACHE_PERIOD = std::chrono::milliseconds(200);
 	const ms_duration STAT_SCAN_PERIOD = std::chrono::milliseconds(5000);
+	// Once this many entries of the same directory miss the stat cache within SIBLING_MISS_WINDOW, the whole directory is listed.
+	const int SIBLING_MISS_THRESHOLD = 4;
+	const ms_duration SIBLING_MISS_WINDOW = std::chrono::milliseconds(500);
+	// Directories with no recent misses are forgotten once this many directories have misses recorded.
+	const size_t MAX_SIBLING_MISS_DIRS = 64;
+	// How long a path is remembered as missing after the daemon reports that it does not exist.
+	// Windows checks for the same missing files, e.g. desktop.ini, many times in a row.
+	const ms_duration MISSING_CACHE_PERIOD = std::chrono::milliseconds(1000);
+	// How long stats and listings are cached for within a directory that the daemon is watching for changes.
+	// The daemon reports any change to the directory, so this only limits how long an unused entry takes up memory.
+	const ms_duration WATCHED_CACHE_PERIOD = std::chrono::minutes(2);
+	// A listing is only stored if the directory was last written to at least this many seconds ago, according to the clock of this PC.
+	// Write times only have a precision of one second, so an entry added in the same second as the listing would not change the write time
+	// that the stored listing is checked against.
+	const uint64_t MIN_STORED_DIR_AGE_SECS = 2;
+	// Once changes to this many directories have been recorded, they are all forgotten, and every directory counts as changed.
+	const size_t MAX_TRACKED_DIR_CHANGES = 4096;
+	// Number of sockets opened to the daemon for each device.
+	const int CONNECTION_POOL_SIZE = 4;
+	// Maximum memory used to cache the contents of files.
+	const size_t BLOCK_CACHE_BUDGET = 64 * 1024 * 1024;
 
-	class Connection : Readable, Writable {
+	// The result of statting one of the paths given to `Connection::req_stat_many`.
+	struct StatResult {
+		ResponseStatus status;
+		// Only valid if `status` is `ResponseStatus::Success`.
+		FileStat stat;
+	};
+
+	// A range of a file to read with `Connection::req_read_ranges`, along with the buffer to read it into.
+	struct ReadRangeBuffer {
+		uint64_t file_offset;
+		uint8_t* buffer;
+		uint32_t buffer_len;
+		// Set to the number of bytes read into `buffer`, which is less than `buffer_len` only if EOF was reached.
+		uint32_t bytes_read = 0;
+	};
+
+	// The names of the entries of a directory, as kept in the directory listing cache.
+	struct CachedListing {
+		std::vector<std::string> entry_names;
+		// Holds each of `entry_names`, so that a name can be found to be missing without searching through them all.
+		BloomFilter name_filter;
+		// The value of `Connection::changes_received` before the listing was requested.
+		// The filter is only trusted while the directory is watched and has not changed since.
+		uint64_t changes_before = 0;
+
+		CachedListing();
+		// If `use_filter` is false, the filter might contain any name,
+		// e.g. because an entry may have been created after the listing was made.
+		CachedListing(std::vector<std::string> entry_names, bool use_filter, uint64_t changes_before);
+	};
+
+	// A pool of connections to the nandroid daemon for a single device.
+	// All methods are thread safe, and requests from different threads are spread across the sockets in the pool.
+	class Connection {
 	public:
 		// Creates a new instance of the Connection class
-		// This will establish a TCP connection to the server with the given address and port.
-		// It will also carry out a handshake to ensure the connection is working
-		Connection(std::string address, uint16_t port, ContextLogger& parent_logger);
+		// This will establish CONNECTION_POOL_SIZE TCP connections to the server with the given address and port.
+		// It will also carry out a handshake on each to ensure the connection is working
+		// Directory listings are kept on disk for the device with the serial number `device_serial`, and reused after the device is next mounted.
+		Connection(std::string address, uint16_t port, std::string device_serial, ContextLogger& parent_logger);
 		~Connection();
 
 		// Requests to stat a singular file.
+		// If several entries of the same directory are statted in quick succession, the whole directory is listed instead,
+		// so that statting every entry of a directory one by one takes a single request.
 		ResponseStatus req_stat_file(LPCWSTR path, FileStat& out_file_stat);
+		// Gets the stat of a file from the cache, without making a request.
+		// Returns false if the stat is not cached.
+		bool get_cached_stat(LPCWSTR path, FileStat& out_file_stat);
+		// Requests to stat many files in a single round trip.
+		// `out_results` is overwritten with the result for each path, in the same order as `paths`.
+		// Paths with a cached stat are not sent to the daemon, and the stats received are cached.
+		ResponseStatus req_stat_many(const std::vector<std::wstring>& paths, std::vector<StatResult>& out_results);
 		// Requests to list the stats for all files in a directory.
 		ResponseStatus req_list_file_stats(LPCWSTR path,
 			std::function<void(FileStat stat, std::wstring file_name)> consume_stat);
+		// Requests to list every directory in the tree under `path`, up to `max_depth` directories below it.
+		// `consume_stat` is called with each entry in the tree and its path relative to `path`.
+		// The listing stops before more than `max_entries` entries are listed, in which case `out_truncated` is set to true.
+		// The listing of each directory and the stat of each entry are cached, so that listing or statting them again does not need a request.
+		ResponseStatus req_list_tree(LPCWSTR path,
+			uint16_t max_depth,
+			uint32_t max_entries,
+			std::function<void(FileStat stat, std::wstring relative_path)> consume_stat,
+			bool& out_truncated);
 		// Requests to move a file or directory
 		ResponseStatus req_move_entry(LPCWSTR from_path, LPCWSTR to_path, bool replace_if_exists);
+		// Requests to copy a file or directory on the device, without the data passing through the PC.
+		// If `replace_if_exists` is true, existing files are overwritten and existing directories are copied into.
+		// `on_progress` is called periodically with the number of bytes copied so far and the number of entries fully copied so far.
+		// It should return quickly, since other responses on the same socket are held up while it runs.
+		// `out_bytes_copied` is set to the number of bytes copied, even if the copy fails part way through.
+		ResponseStatus req_copy_entry(LPCWSTR from_path,
+			LPCWSTR to_path,
+			bool replace_if_exists,
+			std::function<void(uint64_t bytes_copied, uint64_t entries_copied)> on_progress,
+			uint64_t& out_bytes_copied);
 		// Requests to remove a file
 		ResponseStatus req_remove_file(LPCWSTR path);
 		// Checks if it is possible to remove the file at the given path
 		ResponseStatus req_can_remove_file(LPCWSTR path);
 		// Requests to remove a directory
 		ResponseStatus req_remove_directory(LPCWSTR path);
+		// Requests to remove a file or directory, including everything within it, in a single round trip.
+		// Entries that cannot be removed are skipped, and the status of the first of these is returned.
+		// The number of files and directories removed are written to `out_files_removed` and `out_directories_removed`.
+		ResponseStatus req_remove_tree(LPCWSTR path, uint32_t& out_files_removed, uint32_t& out_directories_removed);
+		// Requests to hash `length` bytes of the file at `path`, starting at `offset`, on the device, so the file data never has to be transferred.
+		// The range is cut short at the end of the file, so a length of UINT64_MAX hashes the rest of the file.
+		// `out_digest` is set to the hash, and `out_bytes_hashed` to the number of bytes hashed. (see HashAlgorithm for each hash format)
+		// Data written through a WriteBuffer is only included once the buffer has been flushed.
+		ResponseStatus req_hash_range(LPCWSTR path,
+			uint64_t offset,
+			uint64_t length,
+			HashAlgorithm algorithm,
+			std::vector<uint8_t>& out_digest,
+			uint64_t& out_bytes_hashed);
+		// Requests to replace the contents of the existing file at `path` with the contents read from `source`,
+		// only sending the parts of the new contents that are not already in the existing file. (see delta.hpp)
+		// This is much faster than writing the whole file when overwriting a large file with a slightly changed version of itself.
+		// It reads the checksums of the whole existing file first, so it is only worth calling when the caller already holds the new contents
+		// and knows they are mostly the same as the existing file. Writes through file handles never use it.
+		// If the write fails, the existing file is left unchanged. `source` must not throw.
+		// `out_literal_bytes` is set to the number of bytes of the new contents that had to be sent.
+		ResponseStatus req_write_delta(LPCWSTR path, DeltaSource source, uint64_t& out_literal_bytes);
 		// Checks if it is possible to remove the directory at the given path.
 		ResponseStatus req_can_remove_directory(LPCWSTR path);
 		// Requests to create a directory.
 		ResponseStatus req_create_directory(LPCWSTR path);
 		// Requests to open a file.
-		// If successful, the file descriptor is written to out_file_handle.
+		// `hint` tells the daemon how the file is expected to be accessed.
+		// If successful, the file descriptor is written to out_file_handle, whether the file existed before it was opened to `out_existed`,
+		// and the stat of the opened file to `out_file_stat`. Fails with NotAFile if the path is a directory.
 		ResponseStatus req_open_file(LPCWSTR path,
 			OpenMode mode,
 			bool read_access,
 			bool write_access,
-			FILE_HANDLE& out_file_handle);
+			AccessHint hint,
+			FILE_HANDLE& out_file_handle,
+			bool& out_existed,
+			FileStat& out_file_stat);
 		// Closes the provided file handle.
 		ResponseStatus req_close_file(FILE_HANDLE handle);
 		// Requests to write to a file.
+		// `path` must be the path the handle was opened with, and is used to invalidate any cached data for the file.
 		// Will always write the full length of data requested.
-		ResponseStatus req_write_to_file(FILE_HANDLE file_handle, uint64_t file_offset, const uint8_t* data, uint32_t data_len);
+		ResponseStatus req_write_to_file(LPCWSTR path, FILE_HANDLE file_handle, uint64_t file_offset, const uint8_t* data, uint32_t data_len);
+		// Sends a write to a file without waiting for it to complete, so that many writes can be in flight at once.
+		// The data has been sent once this returns, so `data` can be reused.
+		// `on_complete` is called with the status of the write once it completes, or with `ResponseStatus::GenericFailure` if the connection is lost.
+		// It is called on the thread that receives responses, so must not make requests itself.
+		// Writes in flight at the same time may be applied in any order, so must not overlap.
+		void req_write_to_file_async(LPCWSTR path,
+			FILE_HANDLE file_handle,
+			uint64_t file_offset,
+			const uint8_t* data,
+			uint32_t data_len,
+			std::function<void(ResponseStatus status)> on_complete);
 		// Requests to read from a file.
+		// `path` must be the path the handle was opened with. The data is read from the block cache if the file has not changed,
+		// otherwise the whole blocks containing the data are read and cached.
+		// `file_stat` must be the stat of the file as known to the handle (see FileContext::stat), which is used to check that the cached blocks
+		// are still valid without statting the file for every read. Changes made on the device invalidate the blocks through change notifications.
 		// Will always read the full length of data requested, 
 		// unless the status is not `ResponseStatus::Success` or EOF is reached.
 		// `bytes_read` will be overwritten with the number of bytes successfully read.
-		ResponseStatus req_read_from_file(FILE_HANDLE file_handle, uint64_t file_offset, uint8_t* buffer, uint32_t buffer_len, int& bytes_read);
+		ResponseStatus req_read_from_file(LPCWSTR path,
+			FILE_HANDLE file_handle,
+			const FileStat& file_stat,
+			uint64_t file_offset,
+			uint8_t* buffer,
+			uint32_t buffer_len,
+			int& bytes_read);
+		// Reads `length` bytes at `file_offset` of a file into the block cache, unless they are already cached.
+		// `path` and `file_stat` are as for `req_read_from_file`.
+		ResponseStatus req_prefetch(LPCWSTR path, FILE_HANDLE file_handle, const FileStat& file_stat, uint64_t file_offset, uint32_t length);
+		// Requests to read many ranges of a file in a single round trip.
+		// Each range is read straight into its buffer, and `bytes_read` is set for each range.
+		// The total length of the ranges must be no more than `ReadHandleVArgs::MAX_TOTAL_LEN`.
+		ResponseStatus req_read_ranges(FILE_HANDLE file_handle, std::vector<ReadRangeBuffer>& ranges);
 		// Requests to set the length of a file.
 		// This will extend the file with null bytes if the given length is more than the current file length.
-		// The file handle must be writable.
-		ResponseStatus req_set_file_len(FILE_HANDLE file_handle, uint64_t file_len);
+		// The file handle must be writable, and `path` must be the path it was opened with.
+		ResponseStatus req_set_file_len(LPCWSTR path, FILE_HANDLE file_handle, uint64_t file_len);
 		// Requests to set the access and modification times of a file.
 		ResponseStatus req_set_file_time(LPCWSTR path, uint64_t access_time, uint64_t write_time);
 		// Requests to get the number of free/available/total bytes on the filesystem.
 		// If successful, this is saved to out_disk_stats
 		ResponseStatus req_get_disk_stats(DiskStats& out_disk_stats);
+		// Sends the steps of `compound` to the daemon, which runs them one after the other, so the whole chain takes a single round trip.
+		// `out_results` is overwritten with the result of each step, in the same order as the steps.
+		// Does not make a request if `compound` has no steps.
+		ResponseStatus req_compound(CompoundRequest& compound, std::vector<CompoundStepResult>& out_results);
 	private:
 		ContextLogger logger;
-		SOCKET conn_sock;
-		DataWriter writer;
-		DataReader reader;
-		std::mutex request_mutex;
+		// The sockets connected to the daemon.
+		// Requests are spread across these, so that a large transfer does not hold up other requests.
+		std::vector<std::unique_ptr<DaemonSocket>> sockets;
 		std::thread data_log_thread;
 
+		// Gets the socket that should be used for the next request: the one with the fewest requests in flight.
+		DaemonSocket& choose_socket();
+
 		TimedCache<FileStat> stat_cache;
 		// Cache of the entry names of the entries in directories.
 		// Does NOT include the full entry path to save memory. Does NOT include the stat as that is kept separately in the stat cache.
-		TimedCache<std::vector<std::string>> dir_list_cache;
+		TimedCache<CachedListing> dir_list_cache;
+		// Cache of the paths that the daemon reported do not exist. The cached value is always true.
+		TimedCache<bool> missing_cache;
+		// Cache of the contents of files, which is validated against the size and write time in the stat cache.
+		BlockCache block_cache;
+		struct SiblingMisses {
+			int count;
+			std::chrono::time_point<std::chrono::steady_clock> window_start;
+		};
+		// The recent misses of the stat cache for the entries of each directory, used to spot entries being statted one by one.
+		std::unordered_map<std::string, SiblingMisses> sibling_misses;
+		std::mutex sibling_misses_mutex;
+
+		// Listings of directories from earlier connections to the device. Null if there is nowhere to keep them.
+		std::unique_ptr<MetadataStore> metadata_store;
+
+		// The number of sockets whose daemon is watching each directory for changes.
+		std::unordered_map<std::string, int> watched_dirs;
+		// Protects `watched_dirs`, `dir_changes` and `all_dirs_changed`.
+		std::mutex watched_dirs_mutex;
+		// The number of changes seen so far: change notifications received, and changes to listings made through this connection.
+		// Taken before a request is made, so that changes to a directory seen while the request was in flight can be found with `dir_changed_since`.
+		// A response is only cached for WATCHED_CACHE_PERIOD, or as a missing entry, if its directory did not change while it was in flight,
+		// since the change may be one that the response does not include.
+		std::atomic_uint64_t changes_received = 0;
+		// The value of `changes_received` after the last change seen to the contents of each directory.
+		// Cleared once it reaches MAX_TRACKED_DIR_CHANGES directories, in which case `all_dirs_changed` covers them.
+		std::unordered_map<std::string, uint64_t> dir_changes;
+		// The value of `changes_received` after the last change that may have affected any directory,
+		// e.g. a tree being changed or `dir_changes` being cleared.
+		uint64_t all_dirs_changed = 0;
+
+		// Updates the caches for a change notification from the daemon.
+		void apply_change(ChangeKind kind, std::string& path);
+		// Records a change to the contents of the directory at `unix_dir_path`.
+		void note_dir_changed(const std::string& unix_dir_path);
+		// Records a change that may have affected the contents of any directory.
+		void note_all_dirs_changed();
+		// Checks whether the contents of the directory at `unix_dir_path` may have changed since `changes_received` was `changes_before`.
+		// Does not lock `watched_dirs_mutex`, caller must lock.
+		bool dir_changed_since(const std::string& unix_dir_path, uint64_t changes_before);
+		// Gets how long the stats and listing of the directory at `unix_dir_path` can be cached for,
+		// if fetched by a request made when `changes_received` was `changes_before`.
+		ms_duration cache_period_for(std::string& unix_dir_path, uint64_t changes_before);
 
 #ifdef _DEBUG
-		int data_written = 0;
-		int data_read = 0;
 		// Entry point for a thread that logs the quantity of data being written by this connection each second.
 		void data_log_entry_point();
-		bool kill_data_log = false;
+		std::atomic_bool kill_data_log = false;
 #endif
+		// Reads from a file without using the block cache.
+		ResponseStatus read_from_file_uncached(FILE_HANDLE file_handle, uint64_t file_offset, uint8_t* buffer, uint32_t buffer_len, int& bytes_read);
+		// Reads the body of a response written with `respond_compressible` on the daemon.
+		// `read_body` is passed a reader for the body, which has been decompressed if necessary.
+		void read_compressible_body(Request& request, std::function<void(DataReader& body_reader)> read_body);
+		// Reads the entries of a directory listing from `reader`, passing each to `consume_stat` and caching them.
+		// `changes_before` is the value of `changes_received` before the listing was requested.
+		void read_dir_entries(std::string& unix_dir_path,
+			DataReader& reader,
+			uint64_t changes_before,
+			std::function<void(FileStat stat, std::wstring file_name)> consume_stat);
 		bool try_use_cached_dir_listing(std::string& unix_dir_path, std::function<void(FileStat stat, std::wstring file_name)> consume_stat);
-		// Invalidates the cached directory listing for the parent of `path`.
-		// This does nothing if `path` has no parent.
+		// Lists a directory using the names in the listing in `metadata_store`, if there is one and the directory has not been written to since.
+		// The stored stats may be out of date, so every entry is statted again in a single StatMany, along with the directory itself.
+		// Returns false if the directory must be listed by the daemon.
+		bool try_use_stored_dir_listing(std::string& unix_dir_path, std::function<void(FileStat stat, std::wstring file_name)> consume_stat);
+		// Looks up the stat of the entry at `unix_path` in the caches, without making a request.
+		// Returns Success if the stat is cached, FileNotFound if the entry is known not to exist, or nullopt if neither is known.
+		std::optional<ResponseStatus> lookup_cached_stat(std::string& unix_path, FileStat& out_file_stat);
+		// Records that the stat of an entry in the directory at `unix_dir_path` was not cached.
+		// Returns true if enough of its entries have missed recently that the whole directory should be listed instead.
+		bool note_sibling_miss(std::string& unix_dir_path);
+		// Stats many entries in a single round trip, as `req_stat_many` does.
+		ResponseStatus stat_many(const std::vector<std::string>& unix_paths, std::vector<StatResult>& out_results);
+		// Lists the stats of all entries in a directory, as `req_list_file_stats` does.
+		ResponseStatus list_directory(std::string& unix_dir_path, std::function<void(FileStat stat, std::wstring file_name)> consume_stat);
+		// Lists a directory with a request to the daemon, without using a cached or stored listing, and caches the stats of its entries.
+		ResponseStatus list_directory_from_daemon(std::string& unix_dir_path, std::function<void(FileStat stat, std::wstring file_name)> consume_stat);
+		// Checks the caches to see if the entry at `path`, or any directory it is within, is known not to exist.
+		// An entry is known not to exist if it is in `missing_cache`, or is not in the cached listing of its parent,
+		// as long as the parent is still watched and has not changed since it was listed.
+		bool is_known_missing(std::string& unix_path);
+		// Remembers that the daemon reported the entry at `unix_path` does not exist.
+		// `changes_before` is the value of `changes_received` before the request was made.
+		void cache_missing(std::string& unix_path, uint64_t changes_before);
+		// Invalidates the cached and stored directory listing for the parent of `path`, and forgets that `path`, or anything within it, was missing.
+		// This does nothing to the listing if `path` has no parent.
+		// Requests that may create `path` must call this once they complete, as well as before.
 		void invalidate_parent_dir(std::string& path);
-
-		void handshake();
-
-		virtual int read(uint8_t* buffer, int length);
-		virtual void write(const uint8_t* buffer, int length);
+		// Invalidates the cached state of the entries that the steps of `compound` may change.
+		void invalidate_compound_paths(CompoundRequest& compound);
 	};
 }
\ No newline at end of file
@@ -0,0 +1,335 @@
+#include "DaemonSocket.hpp"
+#include "WinSockException.hpp"
+
+#include <format>
+#include <memory>
+#include <vector>
+
+namespace nandroidfs {
+	// Buffer size for the DataWriter and DataReader.
+	const int BUFFER_SIZE = 8192;
+	// The protocol features that the client is able to use, if the daemon supports them.
+	const uint8_t SUPPORTED_FEATURES = FEATURE_COMPRESSION | FEATURE_CHANGE_NOTIFICATIONS;
+
+	DaemonSocket::DaemonSocket(std::string address,
+		uint16_t port,
+		ContextLogger& parent_logger,
+		std::function<void(ChangeKind kind, std::string& path)> on_change)
+		: logger(parent_logger.with_context("DaemonSocket")),
+		writer(this, BUFFER_SIZE),
+		reader(this, BUFFER_SIZE),
+		on_change(on_change) {
+		struct addrinfo* result,
+			hints;
+
+		ZeroMemory(&hints, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+
+		// Fetch all addresses matching the address/port specified.
+		std::string port_string = std::to_string(port);
+		throw_if_nonzero(getaddrinfo(address.c_str(), port_string.c_str(), &hints, &result));
+
+		// Iterate through the provided linked list of addresses until reaching a nullptr.
+		SOCKET connect_socket = INVALID_SOCKET;
+		for (struct addrinfo* ptr = result; ptr != nullptr; ptr = ptr->ai_next) {
+			logger.trace("trying address, family: {}, socktype: {}, protocol: {}", ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+			connect_socket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+			if (connect_socket == INVALID_SOCKET) {
+				freeaddrinfo(result);
+				throw WinSockException(WSAGetLastError());
+			}
+
+			int result = connect(connect_socket, ptr->ai_addr, (int)ptr->ai_addrlen);
+			if (result == -1) {
+				closesocket(connect_socket);
+				connect_socket = INVALID_SOCKET;
+				continue;
+			}
+
+			// Successfully connected; break
+			break;
+		}
+
+		freeaddrinfo(result);
+		// No possible addresses connected successfully
+		if (connect_socket == INVALID_SOCKET) {
+			throw std::runtime_error("Unable to connect to daemon; none of the supplied addresses led to a successful connection");
+		}
+
+		conn_sock = connect_socket;
+		try {
+			logger.debug("connection successful, handshaking");
+			this->handshake();
+		}
+		catch (std::exception&) {
+			closesocket(conn_sock);
+			throw;
+		}
+
+		response_thread = std::thread(&DaemonSocket::response_entry_point, this);
+	}
+
+	void DaemonSocket::handshake() {
+		const uint32_t HANDSHAKE_DATA = 0xFAFE5ABE;
+		writer.write_u32(HANDSHAKE_DATA);
+		writer.write_byte(SUPPORTED_FEATURES);
+		writer.flush();
+
+		uint32_t received_data = reader.read_u32();
+		if (received_data != HANDSHAKE_DATA) {
+			throw std::runtime_error("Failed handshake! Did not receive same bytes that were sent");
+		}
+
+		// The daemon replies with the features that both sides support.
+		uint8_t features = reader.read_byte();
+		compression_enabled = (features & FEATURE_COMPRESSION) != 0;
+		logger.debug("handshake succeeded, compression enabled: {}, change notifications enabled: {}",
+			compression_enabled,
+			(features & FEATURE_CHANGE_NOTIFICATIONS) != 0);
+	}
+
+	int DaemonSocket::get_requests_in_flight() {
+		return requests_in_flight.load();
+	}
+
+	void DaemonSocket::response_entry_point() {
+		try
+		{
+			while (true) {
+				REQUEST_ID id = reader.read_u32();
+				if (id == CHANGE_NOTIFICATION_ID) {
+					ChangeKind kind = (ChangeKind)reader.read_byte();
+					std::string path = reader.read_utf8_string();
+					on_change(kind, path);
+					continue;
+				}
+
+				std::unique_lock lock(pending_mutex);
+				auto pending = pending_requests.find(id);
+				if (pending == pending_requests.end()) {
+					// We cannot skip over the response as we don't know its length, so there's no way to recover.
+					throw std::runtime_error(std::format("Received response for unknown request ID {}", id));
+				}
+
+				if (pending->second->on_response) {
+					// Nothing is waiting for this response, so read its body on this thread.
+					std::unique_ptr<PendingRequest> async_request(pending->second);
+					pending_requests.erase(pending);
+					lock.unlock();
+
+					try {
+						async_request->on_response(&reader);
+					}
+					catch (std::exception&) {
+						// The response was cut short, so report the request as never having received one.
+						async_request->on_response(nullptr);
+						requests_in_flight--;
+						throw;
+					}
+					requests_in_flight--;
+					continue;
+				}
+
+				// Hand the reader over to the thread waiting for this response, then wait for it to read the response body.
+				reading_response = true;
+				pending->second->response_arrived = true;
+				pending->second->response_cv.notify_one();
+				pending_requests.erase(pending);
+
+				response_read_cv.wait(lock, [this] { return !reading_response; });
+			}
+		}
+		catch (const EOFException&)
+		{
+			logger.debug("daemon closed the connection");
+		}
+		catch (const std::exception& ex)
+		{
+			logger.error("failed to read response from daemon: {}", ex.what());
+		}
+
+		// Wake up any threads still waiting for a response, since no more responses will arrive.
+		std::vector<std::unique_ptr<PendingRequest>> async_requests;
+		{
+			std::lock_guard lock(pending_mutex);
+			disconnected = true;
+			for (auto& pending : pending_requests) {
+				if (pending.second->on_response) {
+					async_requests.emplace_back(pending.second);
+				}
+				else
+				{
+					pending.second->response_cv.notify_one();
+				}
+			}
+			std::erase_if(pending_requests, [](auto& pending) { return pending.second->on_response != nullptr; });
+		}
+
+		for (auto& async_request : async_requests) {
+			async_request->on_response(nullptr);
+			requests_in_flight--;
+		}
+	}
+
+	int DaemonSocket::read(uint8_t* buffer, int length) {
+		int result = recv(conn_sock, reinterpret_cast<char*>(buffer), length, 0);
+		if (result == -1) {
+			throw WinSockException(WSAGetLastError());
+		}
+		else
+		{
+			// Number of bytes read
+#ifdef _DEBUG
+			data_read += result;
+#endif
+			return result;
+		}
+	}
+
+	void DaemonSocket::write(const uint8_t* buffer, int length) {
+		while (length > 0) {
+			int result = send(conn_sock, reinterpret_cast<const char*>(buffer), length, 0);
+			if (result == -1) {
+				throw WinSockException(WSAGetLastError());
+			}
+
+			length -= result;
+			buffer += result;
+#ifdef _DEBUG
+			data_written += result;
+#endif
+		}
+	}
+
+#ifdef _DEBUG
+	int DaemonSocket::take_data_written() {
+		return data_written.exchange(0);
+	}
+
+	int DaemonSocket::take_data_read() {
+		return data_read.exchange(0);
+	}
+#endif
+
+	DaemonSocket::~DaemonSocket() {
+		// Shutting down the socket causes the response thread to reach EOF and exit.
+		shutdown(conn_sock, SD_BOTH);
+		response_thread.join();
+
+		closesocket(conn_sock);
+	}
+
+	Request::Request(DaemonSocket& socket, RequestType type) :
+		writer(socket.writer),
+		reader(socket.reader),
+		socket(socket),
+		send_lock(socket.send_mutex, std::defer_lock) {
+		// Count the request before waiting to send it, so that it is taken into account when picking a socket for other requests.
+		socket.requests_in_flight++;
+		send_lock.lock();
+		id = socket.next_request_id++;
+		// Responses with the ID of change notifications would be mistaken for notifications.
+		if (socket.next_request_id == CHANGE_NOTIFICATION_ID) {
+			socket.next_request_id = 0;
+		}
+
+		writer.write_byte((uint8_t)type);
+		writer.write_u32(id);
+	}
+
+	bool Request::use_compression() {
+		return socket.compression_enabled;
+	}
+
+	void Request::await_response() {
+		{
+			std::lock_guard lock(socket.pending_mutex);
+			if (socket.disconnected) {
+				throw EOFException();
+			}
+
+			// Register the request before it is sent, so the response thread is always able to find it.
+			socket.pending_requests[id] = &pending;
+			registered = true;
+		}
+
+		writer.flush();
+		// Allow other requests to be sent while we wait for the response.
+		send_lock.unlock();
+
+		std::unique_lock lock(socket.pending_mutex);
+		pending.response_cv.wait(lock, [this] { return pending.response_arrived || socket.disconnected; });
+		if (!pending.response_arrived) {
+			throw EOFException();
+		}
+	}
+
+	void Request::await_next_response() {
+		std::unique_lock lock(socket.pending_mutex);
+		// Register for the next response before the response thread is allowed to read it.
+		pending.response_arrived = false;
+		socket.pending_requests[id] = &pending;
+		socket.reading_response = false;
+		socket.response_read_cv.notify_one();
+
+		pending.response_cv.wait(lock, [this] { return pending.response_arrived || socket.disconnected; });
+		if (!pending.response_arrived) {
+			throw EOFException();
+		}
+	}
+
+	void Request::send_async(std::function<void(DataReader* reader)> on_response) {
+		{
+			std::lock_guard lock(socket.pending_mutex);
+			if (socket.disconnected) {
+				throw EOFException();
+			}
+
+			// The response thread takes ownership of the request once it is registered.
+			PendingRequest* async_request = new PendingRequest();
+			async_request->on_response = std::move(on_response);
+			socket.pending_requests[id] = async_request;
+			sent_async = true;
+		}
+
+		try {
+			writer.flush();
+		}
+		catch (std::exception&) {
+			std::lock_guard lock(socket.pending_mutex);
+			auto pending = socket.pending_requests.find(id);
+			if (pending == socket.pending_requests.end()) {
+				// The response thread has already stopped and reported the request as failed.
+				return;
+			}
+
+			// The request was never fully sent, so will never get a response.
+			delete pending->second;
+			socket.pending_requests.erase(pending);
+			sent_async = false;
+			throw;
+		}
+		send_lock.unlock();
+	}
+
+	Request::~Request() {
+		if (sent_async) {
+			// The request remains in flight until the response thread receives its response.
+			return;
+		}
+		socket.requests_in_flight--;
+
+		std::lock_guard lock(socket.pending_mutex);
+		if (pending.response_arrived) {
+			// Finished reading the response body, so allow the response thread to read the next response.
+			socket.reading_response = false;
+			socket.response_read_cv.notify_one();
+		}
+		else if (registered)
+		{
+			socket.pending_requests.erase(id);
+		}
+	}
+}
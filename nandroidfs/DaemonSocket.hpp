@@ -0,0 +1,132 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <functional>
+
+#include "dokan_no_winsock.h"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include "serialization.hpp"
+#include "requests.hpp"
+#include "Logger.hpp"
+
+namespace nandroidfs {
+	// A request that has been sent to the daemon and is waiting for its response.
+	struct PendingRequest {
+		// Set by the response thread once the response has arrived.
+		// The waiting thread then has exclusive use of the socket's reader until it has read the response body.
+		bool response_arrived = false;
+		std::condition_variable response_cv;
+		// Set for requests sent with `Request::send_async`.
+		// Invoked on the response thread with the reader for the response body, or with nullptr if the connection is lost first.
+		std::function<void(DataReader* reader)> on_response;
+	};
+
+	// A single TCP connection to the nandroid daemon.
+	// Each request is tagged with an ID so that many threads can wait on a response at once,
+	// and the daemon is free to respond to them in any order.
+	class DaemonSocket : Readable, Writable {
+	public:
+		// Establishes a TCP connection to the daemon with the given address and port.
+		// It will also carry out a handshake to ensure the connection is working
+		// `on_change` is invoked on the socket's response thread with each change notification sent by the daemon.
+		// It must return quickly, and must not make requests itself.
+		DaemonSocket(std::string address,
+			uint16_t port,
+			ContextLogger& parent_logger,
+			std::function<void(ChangeKind kind, std::string& path)> on_change);
+		~DaemonSocket();
+
+		// Gets the number of requests that have been started on this socket and have not yet finished.
+		int get_requests_in_flight();
+
+#ifdef _DEBUG
+		// Gets the number of bytes written/read since the last call.
+		int take_data_written();
+		int take_data_read();
+#endif
+	private:
+		friend class Request;
+
+		ContextLogger logger;
+		SOCKET conn_sock;
+		DataWriter writer;
+		DataReader reader;
+		std::atomic_int requests_in_flight = 0;
+		// Whether file data and directory listings are compressed, which is negotiated in the handshake.
+		bool compression_enabled = false;
+		std::function<void(ChangeKind kind, std::string& path)> on_change;
+
+		// Held while a request is written to the socket.
+		std::mutex send_mutex;
+		// Only accessed while holding `send_mutex`.
+		REQUEST_ID next_request_id = 0;
+
+		// Protects all of the following state, which is shared with the response thread.
+		std::mutex pending_mutex;
+		// The requests waiting for a response, keyed by request ID.
+		std::unordered_map<REQUEST_ID, PendingRequest*> pending_requests;
+		// Set while a thread waiting on a request is reading its response body.
+		// The response thread will not read the next response until this is unset.
+		bool reading_response = false;
+		std::condition_variable response_read_cv;
+		// Set once the response thread has stopped, after which no more responses will arrive.
+		bool disconnected = false;
+		std::thread response_thread;
+
+#ifdef _DEBUG
+		std::atomic_int data_written = 0;
+		std::atomic_int data_read = 0;
+#endif
+
+		// Entry point for a thread that reads the ID of each response and hands the response to the thread waiting on it.
+		void response_entry_point();
+
+		void handshake();
+
+		virtual int read(uint8_t* buffer, int length);
+		virtual void write(const uint8_t* buffer, int length);
+	};
+
+	// Sends a single request to the daemon and receives its response.
+	// Constructing a Request gives the caller exclusive use of `writer` and writes the request header.
+	// The arguments of the request should then be written to `writer` before calling `await_response`.
+	// Once `await_response` returns, the response body can be read from `reader` until the Request is destroyed.
+	class Request {
+	public:
+		Request(DaemonSocket& socket, RequestType type);
+		~Request();
+
+		// Sends the request, then waits until its response arrives.
+		// Throws an EOFException if the connection is lost before the response arrives.
+		void await_response();
+		// For requests that send several responses, such as those reporting progress with ResponseStatus::InProgress.
+		// Must be called once the current response has been read. Waits until the next response arrives.
+		// Throws an EOFException if the connection is lost before the response arrives.
+		void await_next_response();
+		// Sends the request without waiting for its response. The Request can be destroyed as soon as this returns.
+		// `on_response` is invoked on the socket's response thread with a reader for the response body once it arrives,
+		// or with nullptr if the connection is lost first. It must read the whole response body, and must not make requests itself.
+		// If reading the response body throws, `on_response` is invoked again with nullptr.
+		// If this throws, `on_response` is never invoked.
+		void send_async(std::function<void(DataReader* reader)> on_response);
+		// Whether file data and directory listings should be compressed for this request. (see compression.hpp)
+		bool use_compression();
+
+		DataWriter& writer;
+		DataReader& reader;
+	private:
+		DaemonSocket& socket;
+		std::unique_lock<std::mutex> send_lock;
+		REQUEST_ID id;
+		PendingRequest pending;
+		bool registered = false;
+		bool sent_async = false;
+	};
+}
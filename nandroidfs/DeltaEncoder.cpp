@@ -0,0 +1,177 @@
+#include "DeltaEncoder.hpp"
+#include "compression.hpp"
+#include "hash_functions.hpp"
+#include <algorithm>
+
+namespace nandroidfs {
+	// The new contents are read from the source into a window of this many bytes, plus one block.
+	const uint32_t DELTA_WINDOW_SIZE = 4 * 1024 * 1024;
+	const int CHECKSUM_FILTER_BITS = 20;
+
+	inline uint32_t checksum_filter_index(uint32_t rolling) {
+		return (rolling * 2654435761U) >> (32 - CHECKSUM_FILTER_BITS);
+	}
+
+	DeltaEncoder::DeltaEncoder(uint32_t block_size, const std::vector<BlockChecksum>& blocks) : blocks(blocks) {
+		this->block_size = block_size;
+		checksum_filter.resize(1 << CHECKSUM_FILTER_BITS);
+		blocks_by_checksum.reserve(blocks.size());
+		for (uint32_t i = 0; i < blocks.size(); i++) {
+			blocks_by_checksum.emplace(blocks[i].rolling, i);
+			checksum_filter[checksum_filter_index(blocks[i].rolling)] = true;
+		}
+	}
+
+	bool DeltaEncoder::find_block(uint32_t rolling, const uint8_t* data, uint32_t& out_block) {
+		if (!checksum_filter[checksum_filter_index(rolling)]) {
+			return false;
+		}
+
+		auto [begin, end] = blocks_by_checksum.equal_range(rolling);
+		if (begin == end) {
+			return false;
+		}
+
+		// Only calculate the strong checksum once the rolling checksum matches, since it is far more expensive.
+		Xxh3Hasher hasher;
+		hasher.update(data, block_size);
+		uint64_t strong = hasher.digest();
+
+		bool found = false;
+		for (auto it = begin; it != end; it++) {
+			uint32_t block = it->second;
+			if (blocks[block].strong != strong) {
+				continue;
+			}
+
+			if (pending_block_count > 0 && block == pending_first_block + pending_block_count) {
+				out_block = block;
+				return true;
+			}
+			else if (!found)
+			{
+				out_block = block;
+				found = true;
+			}
+		}
+		return found;
+	}
+
+	void DeltaEncoder::add_block(DataWriter& writer, uint32_t block) {
+		if (pending_block_count > 0 && block != pending_first_block + pending_block_count) {
+			write_pending_blocks(writer);
+		}
+
+		if (pending_block_count == 0) {
+			pending_first_block = block;
+		}
+		pending_block_count++;
+	}
+
+	void DeltaEncoder::write_pending_blocks(DataWriter& writer) {
+		if (pending_block_count == 0) {
+			return;
+		}
+
+		writer.write_byte(static_cast<uint8_t>(DeltaOp::CopyBlocks));
+		writer.write_u32(pending_first_block);
+		writer.write_u32(pending_block_count);
+		pending_block_count = 0;
+	}
+
+	void DeltaEncoder::write_literals(DataWriter& writer, const uint8_t* data, size_t length, bool compress) {
+		if (length == 0) {
+			return;
+		}
+		write_pending_blocks(writer);
+
+		while (length > 0) {
+			uint32_t literal_len = static_cast<uint32_t>(std::min<size_t>(length, MAX_DELTA_LITERAL_LEN));
+			writer.write_byte(static_cast<uint8_t>(DeltaOp::Literal));
+			writer.write_u32(literal_len);
+			if (compress) {
+				write_compressed(writer, data, literal_len);
+			}
+			else
+			{
+				writer.write_exact(data, literal_len);
+			}
+
+			data += literal_len;
+			length -= literal_len;
+		}
+	}
+
+	uint64_t DeltaEncoder::encode(DataWriter& writer, DeltaSource source, bool compress) {
+		std::vector<uint8_t> window(DELTA_WINDOW_SIZE + block_size);
+		size_t window_len = 0;
+		uint64_t source_offset = 0;
+		bool source_finished = false;
+		Xxh3Hasher contents_hasher;
+		uint64_t literal_bytes = 0;
+
+		// The start of the block being checked, and the start of the data before it that has not matched any block.
+		size_t pos = 0;
+		size_t literal_start = 0;
+		RollingChecksum checksum;
+		bool checksum_valid = false;
+		while (true) {
+			if (pos + block_size > window_len) {
+				if (source_finished) {
+					break;
+				}
+
+				// Not enough data is left for a whole block, so send the data before it and move the rest to the start of the window.
+				write_literals(writer, window.data() + literal_start, pos - literal_start, compress);
+				literal_bytes += pos - literal_start;
+				std::copy(window.begin() + pos, window.begin() + window_len, window.begin());
+				window_len -= pos;
+				pos = 0;
+				literal_start = 0;
+
+				uint32_t to_read = static_cast<uint32_t>(window.size() - window_len);
+				uint32_t bytes_read = source(source_offset, window.data() + window_len, to_read);
+				contents_hasher.update(window.data() + window_len, bytes_read);
+				source_offset += bytes_read;
+				window_len += bytes_read;
+				source_finished = bytes_read < to_read;
+				checksum_valid = false;
+				continue;
+			}
+
+			if (!checksum_valid) {
+				checksum.reset(window.data() + pos, block_size);
+				checksum_valid = true;
+			}
+
+			uint32_t block;
+			if (find_block(checksum.value(), window.data() + pos, block)) {
+				write_literals(writer, window.data() + literal_start, pos - literal_start, compress);
+				literal_bytes += pos - literal_start;
+				add_block(writer, block);
+
+				pos += block_size;
+				literal_start = pos;
+				checksum_valid = false;
+			}
+			else
+			{
+				if (pos + block_size < window_len) {
+					checksum.roll(window[pos], window[pos + block_size]);
+				}
+				else
+				{
+					checksum_valid = false;
+				}
+				pos++;
+			}
+		}
+
+		write_literals(writer, window.data() + literal_start, window_len - literal_start, compress);
+		literal_bytes += window_len - literal_start;
+		write_pending_blocks(writer);
+		writer.write_byte(static_cast<uint8_t>(DeltaOp::End));
+		writer.write_u64(contents_hasher.digest());
+		return literal_bytes;
+	}
+}
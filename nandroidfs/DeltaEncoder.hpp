@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "serialization.hpp"
+#include "delta.hpp"
+
+namespace nandroidfs {
+	// Reads up to `length` bytes of the new contents of a file at `offset` into `buffer`.
+	// Returns the number of bytes read, which is only less than `length` once the end of the contents is reached.
+	typedef std::function<uint32_t(uint64_t offset, uint8_t* buffer, uint32_t length)> DeltaSource;
+
+	// Finds the parts of the new contents of a file that are already in the existing file, and writes the DeltaOps that rebuild
+	// the new contents from the existing file. (see delta.hpp)
+	class DeltaEncoder {
+	public:
+		// `blocks` are the checksums of the existing file, split into blocks of `block_size` bytes.
+		DeltaEncoder(uint32_t block_size, const std::vector<BlockChecksum>& blocks);
+
+		// Reads the whole of the new contents from `source`, and writes the DeltaOps for them to `writer`, ending with DeltaOp::End.
+		// Literals are compressed if `compress` is true.
+		// Returns the number of bytes of the new contents that were sent as literals.
+		uint64_t encode(DataWriter& writer, DeltaSource source, bool compress);
+	private:
+		uint32_t block_size;
+		const std::vector<BlockChecksum>& blocks;
+		// The indices of the blocks with each rolling checksum.
+		std::unordered_multimap<uint32_t, uint32_t> blocks_by_checksum;
+		// Has the bit for the hash of each block's rolling checksum set. (see checksum_filter_index)
+		// Most windows match no block, so checking this first avoids looking up every window in `blocks_by_checksum`.
+		std::vector<bool> checksum_filter;
+
+		// Blocks that have matched but not yet been written, which are combined into a single op while they are consecutive.
+		uint32_t pending_first_block = 0;
+		uint32_t pending_block_count = 0;
+
+		// Finds a block of the existing file with the given rolling checksum and the same data as the block at `data`.
+		// Prefers the block following the pending blocks, so that they can be combined.
+		// Returns false if there is no such block.
+		bool find_block(uint32_t rolling, const uint8_t* data, uint32_t& out_block);
+		// Adds a matching block to the pending blocks, writing the pending blocks first if it does not follow them.
+		void add_block(DataWriter& writer, uint32_t block);
+		void write_pending_blocks(DataWriter& writer);
+		// Writes `length` bytes of `data` as literals, after any pending blocks.
+		void write_literals(DataWriter& writer, const uint8_t* data, size_t length, bool compress);
+	};
+}
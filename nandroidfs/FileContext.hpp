@@ -1,6 +1,13 @@
 #pragma once
 
+#include <algorithm>
+#include <ctime>
+#include <mutex>
+
 #include "requests.hpp"
+#include "responses.hpp"
+#include "ReadAhead.hpp"
+#include "WriteBuffer.hpp"
 
 namespace nandroidfs {
 	// The context about each open file handle
@@ -14,5 +21,53 @@ namespace nandroidfs {
 		bool read_access;
 		// Whether the file was opened with write access.
 		bool write_access;
+		// Prefetches data when the file is read sequentially.
+		ReadAhead read_ahead;
+		// Collects small writes to the file. Must be flushed before anything that depends on the contents or length of the file.
+		WriteBuffer write_buffer;
+
+		// Protects `stat`.
+		std::mutex stat_mutex;
+		// The stat of the file, given by the daemon when the handle was opened, and kept up to date as the handle writes to and truncates
+		// the file. Only valid if `handle` is not -1. Used to check the cached blocks of the file when reading through the handle.
+		// Changes made to the file other than through this handle are only seen once the file is statted again. (see `set_stat`)
+		FileStat stat;
+
+		FileStat get_stat() {
+			std::lock_guard lock(stat_mutex);
+			return stat;
+		}
+
+		// Replaces the stat with a fresh stat of the file.
+		void set_stat(const FileStat& new_stat) {
+			std::lock_guard lock(stat_mutex);
+			stat = new_stat;
+		}
+
+		// Updates the stat once data has been written through the handle up to `end_offset`.
+		// The write time is taken from the clock of this PC, so may differ slightly from the time the device gives the file.
+		void update_stat_after_write(uint64_t end_offset) {
+			std::lock_guard lock(stat_mutex);
+			stat.size = std::max(stat.size, end_offset);
+			stat.write_time = std::time(nullptr);
+		}
+
+		// Updates the stat once the length of the file has been set through the handle.
+		void update_stat_after_truncate(uint64_t new_length) {
+			std::lock_guard lock(stat_mutex);
+			stat.size = new_length;
+			stat.write_time = std::time(nullptr);
+		}
+
+		// Updates the stat once the times of the file have been set. A time of -1 is left unchanged.
+		void update_stat_times(int64_t access_time, int64_t write_time) {
+			std::lock_guard lock(stat_mutex);
+			if (access_time != -1) {
+				stat.access_time = access_time;
+			}
+			if (write_time != -1) {
+				stat.write_time = write_time;
+			}
+		}
 	};
-}
\ No newline at end of file
+}
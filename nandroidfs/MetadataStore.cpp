@@ -0,0 +1,518 @@
+#include "MetadataStore.hpp"
+#include "conversion.hpp"
+#include "hash_functions.hpp"
+#include "serialization.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <format>
+#include <stdexcept>
+
+namespace nandroidfs {
+	// Each file starts with STORE_MAGIC followed by STORE_VERSION, both as a u32.
+	// Files with a different magic or version are cleared.
+	const uint32_t STORE_MAGIC = 0x534D444E; // "NDMS"
+	const uint32_t STORE_VERSION = 1;
+	const uint64_t HEADER_LEN = 8;
+	// Each record starts with the length of its body (u32), followed by the XXH3 hash of its body (u64).
+	const uint64_t RECORD_HEADER_LEN = 12;
+	// Listings are not stored once the file reaches this length, until it is next compacted.
+	const uint64_t MAX_STORE_LEN = 32 * 1024 * 1024;
+	// Files shorter than this are never compacted, since there is little to gain.
+	const uint64_t MIN_COMPACT_LEN = 1024 * 1024;
+	// Buffer size for the DataReaders and DataWriters used for record bodies.
+	const int RECORD_BUFFER_SIZE = 4096;
+
+	// The body of each record starts with its kind (u8) followed by the path of the directory (string).
+	enum class RecordKind : uint8_t {
+		// Followed by the write time of the directory (u64) and its entries, written by DirEntryWriter.
+		Listing,
+		// Forgets any earlier listing of the directory.
+		Forget
+	};
+
+	MetadataStore::MetadataStore(std::wstring file_path, ContextLogger& parent_logger)
+		: logger(parent_logger.with_context("MetadataStore")) {
+		this->file_path = file_path;
+		forget_thread = std::thread(&MetadataStore::forget_entry_point, this);
+	}
+
+	MetadataStore::~MetadataStore() {
+		{
+			std::lock_guard lock(pending_mutex);
+			stopping = true;
+		}
+		pending_cv.notify_all();
+		forget_thread.join();
+
+		// Make sure every listing that was forgotten is gone from the file before it is closed.
+		{
+			std::lock_guard lock(store_mutex);
+			apply_pending_forgets();
+		}
+		unmap_file();
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+		}
+	}
+
+	std::optional<std::wstring> MetadataStore::get_path_for_device(const std::string& device_serial) {
+		wchar_t app_data_path[MAX_PATH];
+		DWORD len = GetEnvironmentVariableW(L"LOCALAPPDATA", app_data_path, MAX_PATH);
+		if (len == 0 || len >= MAX_PATH) {
+			return std::nullopt;
+		}
+
+		std::wstring store_dir = std::wstring(app_data_path) + L"\\NandroidFS";
+		if (!CreateDirectoryW(store_dir.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) {
+			return std::nullopt;
+		}
+
+		// Serials of devices connected over the network contain the address and port, e.g. `192.168.0.2:5555`.
+		std::string file_name = device_serial;
+		for (char& c : file_name) {
+			if (!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_' && c != '.') {
+				c = '_';
+			}
+		}
+
+		return store_dir + L"\\" + wstring_from_string(file_name) + L".metadata";
+	}
+
+	std::optional<StoredListing> MetadataStore::take_listing(const std::string& dir_path) {
+		std::lock_guard lock(store_mutex);
+		apply_pending_forgets();
+		if (!ensure_loaded()) {
+			return std::nullopt;
+		}
+
+		auto location = index.find(dir_path);
+		if (location == index.end() || location->second.taken) {
+			return std::nullopt;
+		}
+
+		try
+		{
+			// Records appended since the file was mapped are not yet in the mapping.
+			if (location->second.offset + location->second.length > mapped_len) {
+				map_file();
+			}
+
+			const uint8_t* body = mapped_data + location->second.offset + RECORD_HEADER_LEN;
+			MemoryReadable body_stream(body, location->second.length - RECORD_HEADER_LEN);
+			DataReader reader(&body_stream, RECORD_BUFFER_SIZE);
+			reader.read_byte(); // Kind, which is always RecordKind::Listing for indexed records.
+			reader.read_utf8_string(); // Path.
+
+			StoredListing listing;
+			listing.dir_write_time = reader.read_u64();
+			DirEntryReader dir_reader(reader);
+			ResponseStatus entry_status;
+			std::string name;
+			FileStat stat;
+			while (dir_reader.read_entry(entry_status, name, stat)) {
+				listing.entries.emplace_back(name, stat);
+			}
+
+			location->second.taken = true;
+			return listing;
+		}
+		catch (const std::exception& ex)
+		{
+			fail(ex);
+			return std::nullopt;
+		}
+	}
+
+	void MetadataStore::store_listing(const std::string& dir_path,
+		uint64_t dir_write_time,
+		const std::vector<std::pair<std::string, FileStat>>& entries) {
+		std::lock_guard lock(store_mutex);
+		// Forgets queued before this listing must be applied first, otherwise they would remove it once applied.
+		apply_pending_forgets();
+		if (!ensure_loaded() || file_len >= MAX_STORE_LEN) {
+			return;
+		}
+
+		MemoryWritable body;
+		{
+			DataWriter writer(&body, RECORD_BUFFER_SIZE);
+			writer.write_byte(static_cast<uint8_t>(RecordKind::Listing));
+			writer.write_utf8_string(dir_path);
+			writer.write_u64(dir_write_time);
+			DirEntryWriter dir_writer(writer);
+			for (const auto& [name, stat] : entries) {
+				dir_writer.write_entry(name, stat);
+			}
+			dir_writer.finish();
+			writer.flush();
+		}
+
+		try
+		{
+			RecordLocation location = append_record(body.data);
+			// A listing stored during this session came from the device, so there is no need for it to be taken.
+			location.taken = true;
+
+			auto existing = index.find(dir_path);
+			if (existing != index.end()) {
+				live_len -= existing->second.length;
+			}
+			index[dir_path] = location;
+			live_len += location.length;
+		}
+		catch (const std::exception& ex)
+		{
+			fail(ex);
+		}
+	}
+
+	void MetadataStore::forget(const std::string& dir_path) {
+		{
+			std::lock_guard lock(pending_mutex);
+			pending_forgets.push_back(PendingForget{ dir_path, false });
+		}
+		pending_cv.notify_one();
+	}
+
+	void MetadataStore::forget_tree(const std::string& path) {
+		{
+			std::lock_guard lock(pending_mutex);
+			pending_forgets.push_back(PendingForget{ path, true });
+		}
+		pending_cv.notify_one();
+	}
+
+	void MetadataStore::forget_entry_point() {
+		while (true) {
+			{
+				std::unique_lock lock(pending_mutex);
+				pending_cv.wait(lock, [this] { return stopping || !pending_forgets.empty(); });
+				if (stopping) {
+					return;
+				}
+			}
+
+			std::lock_guard lock(store_mutex);
+			apply_pending_forgets();
+		}
+	}
+
+	void MetadataStore::apply_pending_forgets() {
+		std::vector<PendingForget> forgets;
+		{
+			std::lock_guard lock(pending_mutex);
+			forgets.swap(pending_forgets);
+		}
+
+		for (const PendingForget& forget : forgets) {
+			forget_now(forget.path, forget.tree);
+		}
+	}
+
+	void MetadataStore::forget_now(const std::string& path, bool tree) {
+		if (!ensure_loaded()) {
+			return;
+		}
+
+		std::vector<std::string> to_forget;
+		if (tree) {
+			std::string prefix = path + "/";
+			for (const auto& [dir_path, location] : index) {
+				if (dir_path == path || dir_path.starts_with(prefix)) {
+					to_forget.push_back(dir_path);
+				}
+			}
+		}
+		else if (index.contains(path))
+		{
+			to_forget.push_back(path);
+		}
+
+		try
+		{
+			for (const std::string& dir_path : to_forget) {
+				append_forget(dir_path);
+			}
+		}
+		catch (const std::exception& ex)
+		{
+			fail(ex);
+		}
+	}
+
+	bool MetadataStore::ensure_loaded() {
+		if (failed) {
+			return false;
+		}
+		if (loaded) {
+			return true;
+		}
+
+		try
+		{
+			open_file();
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(file, &size)) {
+				throw std::runtime_error(std::format("Failed to get size of store: error {}", GetLastError()));
+			}
+			file_len = size.QuadPart;
+
+			bool valid_header = false;
+			if (file_len >= HEADER_LEN) {
+				map_file();
+				uint32_t header[2];
+				memcpy(header, mapped_data, HEADER_LEN);
+				valid_header = header[0] == STORE_MAGIC && header[1] == STORE_VERSION;
+			}
+
+			if (!valid_header) {
+				truncate_file(0);
+				map_file();
+			}
+
+			uint64_t valid_len = build_index();
+			if (valid_len < file_len) {
+				logger.warn("store was cut short after {} of {} bytes, discarding the rest", valid_len, file_len);
+				truncate_file(valid_len);
+				map_file();
+			}
+
+			if (file_len >= MIN_COMPACT_LEN && (live_len < file_len / 2 || live_len > MAX_STORE_LEN / 2)) {
+				compact();
+			}
+
+			logger.debug("loaded {} stored listings, {} bytes", index.size(), file_len);
+			loaded = true;
+			return true;
+		}
+		catch (const std::exception& ex)
+		{
+			fail(ex);
+			return false;
+		}
+	}
+
+	void MetadataStore::open_file() {
+		// Nothing else should write to the store while it is in use.
+		file = CreateFileW(file_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE) {
+			throw std::runtime_error(std::format("Failed to open store: error {}", GetLastError()));
+		}
+	}
+
+	void MetadataStore::map_file() {
+		unmap_file();
+
+		mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!mapping) {
+			throw std::runtime_error(std::format("Failed to create mapping of store: error {}", GetLastError()));
+		}
+
+		mapped_data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+		if (!mapped_data) {
+			DWORD error = GetLastError();
+			CloseHandle(mapping);
+			mapping = nullptr;
+			throw std::runtime_error(std::format("Failed to map store: error {}", error));
+		}
+		mapped_len = file_len;
+	}
+
+	void MetadataStore::unmap_file() {
+		if (mapped_data) {
+			UnmapViewOfFile(mapped_data);
+			mapped_data = nullptr;
+		}
+		if (mapping) {
+			CloseHandle(mapping);
+			mapping = nullptr;
+		}
+		mapped_len = 0;
+	}
+
+	void MetadataStore::truncate_file(uint64_t len) {
+		// The file cannot be made shorter while it is mapped.
+		unmap_file();
+
+		LARGE_INTEGER position;
+		position.QuadPart = len;
+		if (!SetFilePointerEx(file, position, nullptr, FILE_BEGIN) || !SetEndOfFile(file)) {
+			throw std::runtime_error(std::format("Failed to truncate store: error {}", GetLastError()));
+		}
+		file_len = len;
+
+		if (len == 0) {
+			uint32_t header[2] = { STORE_MAGIC, STORE_VERSION };
+			write_to_end(reinterpret_cast<uint8_t*>(header), HEADER_LEN);
+		}
+	}
+
+	void MetadataStore::write_to_end(const uint8_t* data, size_t len) {
+		LARGE_INTEGER position;
+		position.QuadPart = file_len;
+		DWORD written;
+		if (!SetFilePointerEx(file, position, nullptr, FILE_BEGIN)
+			|| !WriteFile(file, data, static_cast<DWORD>(len), &written, nullptr)
+			|| written != len) {
+			throw std::runtime_error(std::format("Failed to write to store: error {}", GetLastError()));
+		}
+		file_len += len;
+	}
+
+	uint64_t MetadataStore::build_index() {
+		index.clear();
+		live_len = 0;
+
+		uint64_t offset = HEADER_LEN;
+		while (mapped_len - offset >= RECORD_HEADER_LEN) {
+			uint32_t body_len;
+			uint64_t checksum;
+			memcpy(&body_len, mapped_data + offset, sizeof(body_len));
+			memcpy(&checksum, mapped_data + offset + sizeof(body_len), sizeof(checksum));
+			if (body_len > mapped_len - offset - RECORD_HEADER_LEN) {
+				break;
+			}
+
+			const uint8_t* body = mapped_data + offset + RECORD_HEADER_LEN;
+			Xxh3Hasher hasher;
+			hasher.update(body, body_len);
+			if (hasher.digest() != checksum) {
+				break;
+			}
+
+			RecordKind kind;
+			std::string dir_path;
+			try
+			{
+				MemoryReadable body_stream(body, body_len);
+				DataReader reader(&body_stream, RECORD_BUFFER_SIZE);
+				kind = static_cast<RecordKind>(reader.read_byte());
+				dir_path = reader.read_utf8_string();
+			}
+			catch (const EOFException&)
+			{
+				break;
+			}
+
+			uint32_t record_len = static_cast<uint32_t>(RECORD_HEADER_LEN + body_len);
+			auto existing = index.find(dir_path);
+			if (existing != index.end()) {
+				live_len -= existing->second.length;
+				index.erase(existing);
+			}
+			if (kind == RecordKind::Listing) {
+				index[dir_path] = RecordLocation{ offset, record_len, false };
+				live_len += record_len;
+			}
+
+			offset += record_len;
+		}
+
+		return offset;
+	}
+
+	void MetadataStore::compact() {
+		std::vector<std::pair<std::string, RecordLocation>> live(index.begin(), index.end());
+		// Records later in the file were stored more recently, so are kept in preference to earlier ones.
+		std::sort(live.begin(), live.end(), [](const auto& a, const auto& b) {
+			return a.second.offset < b.second.offset;
+		});
+
+		size_t first_kept = 0;
+		uint64_t kept_len = live_len;
+		while (kept_len > MAX_STORE_LEN / 2) {
+			kept_len -= live[first_kept].second.length;
+			first_kept++;
+		}
+
+		std::vector<uint8_t> compacted;
+		compacted.reserve(HEADER_LEN + kept_len);
+		uint32_t header[2] = { STORE_MAGIC, STORE_VERSION };
+		compacted.insert(compacted.end(), reinterpret_cast<uint8_t*>(header), reinterpret_cast<uint8_t*>(header) + HEADER_LEN);
+
+		std::unordered_map<std::string, RecordLocation> compacted_index;
+		for (size_t i = first_kept; i < live.size(); i++) {
+			RecordLocation& location = live[i].second;
+			const uint8_t* record = mapped_data + location.offset;
+			compacted_index[live[i].first] = RecordLocation{ compacted.size(), location.length, false };
+			compacted.insert(compacted.end(), record, record + location.length);
+		}
+
+		// Write the compacted records to a separate file first, so that the store is never left half written.
+		std::wstring temp_path = file_path + L".tmp";
+		HANDLE temp_file = CreateFileW(temp_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (temp_file == INVALID_HANDLE_VALUE) {
+			throw std::runtime_error(std::format("Failed to create compacted store: error {}", GetLastError()));
+		}
+		DWORD written;
+		bool success = WriteFile(temp_file, compacted.data(), static_cast<DWORD>(compacted.size()), &written, nullptr)
+			&& written == compacted.size()
+			&& FlushFileBuffers(temp_file);
+		DWORD error = GetLastError();
+		CloseHandle(temp_file);
+		if (!success) {
+			DeleteFileW(temp_path.c_str());
+			throw std::runtime_error(std::format("Failed to write compacted store: error {}", error));
+		}
+
+		unmap_file();
+		CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+		if (!MoveFileExW(temp_path.c_str(), file_path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+			throw std::runtime_error(std::format("Failed to replace store with compacted store: error {}", GetLastError()));
+		}
+		logger.debug("compacted store from {} to {} bytes", file_len, compacted.size());
+
+		open_file();
+		file_len = compacted.size();
+		index = std::move(compacted_index);
+		live_len = kept_len;
+		map_file();
+	}
+
+	MetadataStore::RecordLocation MetadataStore::append_record(const std::vector<uint8_t>& body) {
+		Xxh3Hasher hasher;
+		hasher.update(body.data(), body.size());
+		uint32_t body_len = static_cast<uint32_t>(body.size());
+		uint64_t checksum = hasher.digest();
+
+		// The record is written with a single write, so that it is less likely to be cut short.
+		std::vector<uint8_t> record(RECORD_HEADER_LEN + body.size());
+		memcpy(record.data(), &body_len, sizeof(body_len));
+		memcpy(record.data() + sizeof(body_len), &checksum, sizeof(checksum));
+		memcpy(record.data() + RECORD_HEADER_LEN, body.data(), body.size());
+
+		RecordLocation location{ file_len, static_cast<uint32_t>(record.size()), false };
+		write_to_end(record.data(), record.size());
+		return location;
+	}
+
+	void MetadataStore::append_forget(const std::string& dir_path) {
+		MemoryWritable body;
+		{
+			DataWriter writer(&body, RECORD_BUFFER_SIZE);
+			writer.write_byte(static_cast<uint8_t>(RecordKind::Forget));
+			writer.write_utf8_string(dir_path);
+			writer.flush();
+		}
+		append_record(body.data);
+
+		auto existing = index.find(dir_path);
+		if (existing != index.end()) {
+			live_len -= existing->second.length;
+			index.erase(existing);
+		}
+	}
+
+	void MetadataStore::fail(const std::exception& ex) {
+		logger.warn("failed to use stored metadata, continuing without it: {}", ex.what());
+		failed = true;
+		index.clear();
+		unmap_file();
+		if (file != INVALID_HANDLE_VALUE) {
+			CloseHandle(file);
+			file = INVALID_HANDLE_VALUE;
+		}
+	}
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dokan_no_winsock.h"
+#include "responses.hpp"
+#include "Logger.hpp"
+
+namespace nandroidfs {
+	// A directory listing loaded from a MetadataStore.
+	struct StoredListing {
+		// The write time of the directory when it was listed.
+		uint64_t dir_write_time;
+		std::vector<std::pair<std::string, FileStat>> entries;
+	};
+
+	// Keeps the directory listings of a device in a file on disk, so that they are not lost when the device is unmounted.
+	// Used to make the first listing of each directory after mounting a familiar device fast.
+	//
+	// The file is a log of records, each of which is appended whenever a listing is stored or forgotten, and is memory mapped for reading.
+	// It is opened and indexed lazily, the first time the store is used, and is compacted at the same time if most of it has been superseded.
+	// A record with a bad checksum, e.g. one that was being written when the process ended, ends the log.
+	//
+	// Listings are only hints, since the device may have changed while it was unmounted, and must be checked against the device before use.
+	// If the file cannot be used, the store acts as if it is empty.
+	// Listings are forgotten on a thread of the store's own, since forgetting is done for change notifications,
+	// which must not wait for the file to be loaded or written.
+	// This class is thread safe.
+	class MetadataStore {
+	public:
+		// Creates a store that keeps its listings in the file at `file_path`. The file is not opened until the store is first used.
+		// Starts the thread that forgets listings.
+		MetadataStore(std::wstring file_path, ContextLogger& parent_logger);
+		~MetadataStore();
+
+		// Gets the path of the file used to store the listings of the device with the given serial number.
+		// Returns nullopt if there is nowhere suitable to store them.
+		static std::optional<std::wstring> get_path_for_device(const std::string& device_serial);
+
+		// Gets the stored listing of the directory at `dir_path`.
+		// Each listing is only given out once for each instance of the store, since later listings of the directory should come from the device.
+		// Returns nullopt if no listing is stored, or it has already been given out.
+		std::optional<StoredListing> take_listing(const std::string& dir_path);
+		// Stores a listing of the directory at `dir_path`, replacing any stored listing of it.
+		// `dir_write_time` must be the write time of the directory at the time it was listed.
+		void store_listing(const std::string& dir_path, uint64_t dir_write_time, const std::vector<std::pair<std::string, FileStat>>& entries);
+		// Forgets the stored listing of the directory at `dir_path`, if there is one.
+		// The listing is forgotten on the store's thread, so this never waits for the file, but it is never given out after this returns.
+		void forget(const std::string& dir_path);
+		// Forgets the stored listings of the directory at `path` and every directory within it, in the same way as `forget`.
+		void forget_tree(const std::string& path);
+	private:
+		// Where the latest record for a directory is within the file.
+		struct RecordLocation {
+			uint64_t offset;
+			uint32_t length;
+			// Whether the listing has already been given out by `take_listing`.
+			bool taken;
+		};
+
+		ContextLogger logger;
+		std::wstring file_path;
+		std::mutex store_mutex;
+
+		// Whether the file has been opened and indexed.
+		bool loaded = false;
+		// Set if the file could not be used, after which the store is empty.
+		bool failed = false;
+
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+		const uint8_t* mapped_data = nullptr;
+		uint64_t mapped_len = 0;
+		uint64_t file_len = 0;
+		// The total length of the latest record of each stored directory.
+		uint64_t live_len = 0;
+
+		std::unordered_map<std::string, RecordLocation> index;
+
+		// A call to `forget` or `forget_tree` that has not yet been applied to the file.
+		struct PendingForget {
+			std::string path;
+			// Whether the directories within `path` are also forgotten.
+			bool tree;
+		};
+		// Protects `pending_forgets` and `stopping`. Never held while the file is used, so forgetting never waits for the file.
+		std::mutex pending_mutex;
+		std::condition_variable pending_cv;
+		std::vector<PendingForget> pending_forgets;
+		// Set once the store is being destroyed, to stop `forget_thread`.
+		bool stopping = false;
+		std::thread forget_thread;
+
+		// Entry point for the thread that applies the pending forgets.
+		void forget_entry_point();
+
+		// None of the following lock `store_mutex`, so the caller must lock.
+
+		// Applies every pending forget, so that the index is up to date.
+		// Must be called before anything that reads or adds to the index.
+		void apply_pending_forgets();
+		// Forgets the listing of the directory at `dir_path`, and those within it if `tree` is true.
+		void forget_now(const std::string& dir_path, bool tree);
+
+		// Opens the file and indexes the records within it, unless this has already been done or has failed.
+		// Returns false if the file cannot be used.
+		bool ensure_loaded();
+		// Opens `file`, creating the file if it does not exist.
+		void open_file();
+		// Maps the whole of the file into memory, replacing any existing mapping.
+		void map_file();
+		void unmap_file();
+		// Cuts the file down to `len` bytes. If `len` is 0, a new header is written.
+		void truncate_file(uint64_t len);
+		// Writes `data` to the end of the file.
+		void write_to_end(const uint8_t* data, size_t len);
+		// Reads through the records of the file, adding the latest listing of each directory to `index`.
+		// Returns the length of the file up to the end of the last valid record.
+		uint64_t build_index();
+		// Rewrites the file with only the latest listing of each directory.
+		// The oldest listings are left out if they would take up more than half of MAX_STORE_LEN.
+		void compact();
+		// Appends a record with the given body to the file, and returns its location.
+		RecordLocation append_record(const std::vector<uint8_t>& body);
+		// Appends a record that forgets the listing of the directory at `dir_path`, and removes it from the index.
+		void append_forget(const std::string& dir_path);
+		// Gives up on using the file after an error, so that the store is empty from now on.
+		void fail(const std::exception& ex);
+	};
+}
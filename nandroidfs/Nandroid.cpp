@@ -99,7 +99,7 @@ namespace nandroidfs
 		}
 
 		// Initialise the TCP connection with the agent, which will carry out a brief handshake to ensure the connection is working.
-		this->connection = new Connection(std::string("localhost"), port_num, logger);
+		this->connection = new Connection(std::string("localhost"), port_num, device_serial, logger);
 		
 		// Now the connection is established, we can make an attempt to mount the drive.
 		mount_filesystem();
@@ -0,0 +1,68 @@
+#include "ReadAhead.hpp"
+#include <algorithm>
+#include <string>
+
+namespace nandroidfs {
+	void ReadAhead::before_read(Connection& conn, LPCWSTR path, FILE_HANDLE file_handle, const FileStat& file_stat, uint64_t offset, uint32_t length) {
+		std::lock_guard lock(mutex);
+		uint64_t end = offset + length;
+
+		// A read at offset 0 is not counted as sequential, otherwise every file that only has its header read would be prefetched.
+		if (offset == next_offset && offset != 0) {
+			window = window == 0 ? MIN_READAHEAD_WINDOW : std::min(window * 2, MAX_READAHEAD_WINDOW);
+		}
+		else
+		{
+			window = 0;
+			prefetched_end = 0;
+		}
+		next_offset = end;
+
+		if (in_flight.valid()) {
+			bool finished = in_flight.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+			// Wait for the readahead if it contains any of the data being read, rather than reading the data again.
+			if (finished || (offset < in_flight_end && end > in_flight_start)) {
+				in_flight.get();
+			}
+			else
+			{
+				// Only one readahead is in progress at a time.
+				return;
+			}
+		}
+
+		// Start the next readahead once less than half a window of prefetched data is left ahead of this read.
+		if (window == 0 || prefetched_end >= end + window / 2) {
+			return;
+		}
+
+		// The block containing the end of the read is fetched by the read itself.
+		uint64_t start = end;
+		if (start % BlockCache::BLOCK_SIZE != 0) {
+			start += BlockCache::BLOCK_SIZE - start % BlockCache::BLOCK_SIZE;
+		}
+		start = std::max(start, prefetched_end);
+
+		in_flight_start = start;
+		in_flight_end = start + window;
+		prefetched_end = in_flight_end;
+
+		std::wstring path_copy(path);
+		uint32_t readahead_len = window;
+		in_flight = std::async(std::launch::async, [&conn, path_copy, file_handle, file_stat, start, readahead_len]() {
+			try {
+				conn.req_prefetch(path_copy.c_str(), file_handle, file_stat, start, readahead_len);
+			}
+			catch (std::exception&) {
+				// If the readahead fails, the data will be read when it is requested instead.
+			}
+		});
+	}
+
+	void ReadAhead::wait() {
+		std::lock_guard lock(mutex);
+		if (in_flight.valid()) {
+			in_flight.get();
+		}
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <future>
+#include <mutex>
+
+#include "Connection.hpp"
+
+namespace nandroidfs {
+	// The size of the first readahead issued once a file is found to be read sequentially.
+	const uint32_t MIN_READAHEAD_WINDOW = BlockCache::BLOCK_SIZE * 2;
+	// The readahead window doubles with each sequential read, up to this size.
+	const uint32_t MAX_READAHEAD_WINDOW = 8 * 1024 * 1024;
+
+	// Detects when a file handle is being read sequentially, and prefetches the data ahead of the reads into the block cache in the background.
+	// This keeps the connection busy while windows processes each chunk of data, rather than leaving it idle until the next read.
+	// This class is thread safe.
+	class ReadAhead {
+	public:
+		// Must be called before each read of `length` bytes at `offset` from the file, which has the stat `file_stat` as known to the handle.
+		// Waits for any readahead containing the data to finish, so that the read can be served from the block cache,
+		// then starts the next readahead if the file is being read sequentially.
+		void before_read(Connection& conn, LPCWSTR path, FILE_HANDLE file_handle, const FileStat& file_stat, uint64_t offset, uint32_t length);
+		// Waits for the readahead in progress, if any. Must be called before the file handle is closed.
+		void wait();
+	private:
+		std::mutex mutex;
+		// The offset that the next read will start at if the file is being read sequentially.
+		uint64_t next_offset = 0;
+		// The length of the next readahead, or 0 if the file is not being read sequentially.
+		uint32_t window = 0;
+		// The end of the data prefetched so far in the current sequential stream.
+		uint64_t prefetched_end = 0;
+
+		// The readahead in progress, which prefetches the data from `in_flight_start` to `in_flight_end`.
+		std::future<void> in_flight;
+		uint64_t in_flight_start = 0;
+		uint64_t in_flight_end = 0;
+	};
+}
@@ -7,6 +7,7 @@
 #include <string>
 #include <iostream>
 #include <format>
+#include <functional>
 
 namespace nandroidfs {
 	typedef std::chrono::milliseconds ms_duration;
@@ -25,6 +26,8 @@ namespace nandroidfs {
 		struct CachedData {
 			T data;
 			std::chrono::time_point<std::chrono::steady_clock> fetched_at;
+			// How long after it was fetched the data is valid for.
+			ms_duration valid_for;
 		};
 
 		ms_duration cache_scan_interval;
@@ -50,7 +53,7 @@ namespace nandroidfs {
 			for (auto current = cached_data.begin(), last = cached_data.end(); current != last;) {
 				CachedData& cached_datum = current->second;
 				// If a cached datum is out of date, remove it.
-				if ((now - cached_datum.fetched_at) > cached_item_valid_for) {
+				if ((now - cached_datum.fetched_at) > cached_datum.valid_for) {
 					current = cached_data.erase(current);
 					removed++;
 				}
@@ -78,7 +81,7 @@ namespace nandroidfs {
 				auto now = std::chrono::steady_clock::now();
 
 				CachedData& cached = cached_data[file_path];
-				if ((now - cached.fetched_at) <= cached_item_valid_for) {
+				if ((now - cached.fetched_at) <= cached.valid_for) {
 					total_cache_hits++;
 					return cached.data;
 				}
@@ -87,14 +90,36 @@ namespace nandroidfs {
 			return std::nullopt;
 		}
 
+		// Calls `use` with the cached data for the given file while the cache is locked, rather than copying the data.
+		// Returns false, without calling `use`, if there is no cached data. `use` must not call any other methods of the cache.
+		bool use_cached(std::string& file_path, std::function<void(const T& data)> use) {
+			std::shared_lock lock(cache_mutex);
+			total_data_fetched++;
+
+			auto cached = cached_data.find(file_path);
+			if (cached == cached_data.end() || (std::chrono::steady_clock::now() - cached->second.fetched_at) > cached->second.valid_for) {
+				return false;
+			}
+
+			total_cache_hits++;
+			use(cached->second.data);
+			return true;
+		}
+
 		// Adds a cached data for the file with the given path.
 		void cache(std::string file_path, T datum) {
+			cache(std::move(file_path), std::move(datum), cached_item_valid_for);
+		}
+
+		// Adds a cached data for the file with the given path, which is valid for `valid_for` rather than the usual period.
+		void cache(std::string file_path, T datum, ms_duration valid_for) {
 			std::unique_lock lock(cache_mutex);
 			auto now = std::chrono::steady_clock::now();
 
 			//std::cout << "Adding cached stat for " << file_path << std::endl;
 			CachedData cached_datum;
 			cached_datum.fetched_at = now;
+			cached_datum.valid_for = valid_for;
 			cached_datum.data = datum;
 			cached_data[file_path] = cached_datum;
 
@@ -121,6 +146,22 @@ namespace nandroidfs {
 			cached_data.erase(file_path);
 		}
 
+		// Invalidates the cached data for the given path and every path within it.
+		void invalidate_tree(std::string& path) {
+			std::string prefix = path + "/";
+
+			std::unique_lock lock(cache_mutex);
+			std::erase_if(cached_data, [&](auto& cached) {
+				return cached.first == path || cached.first.starts_with(prefix);
+			});
+		}
+
+		// Invalidates all of the cached data.
+		void invalidate_all() {
+			std::unique_lock lock(cache_mutex);
+			cached_data.clear();
+		}
+
 		CacheStatistics get_cache_statistics() {
 			CacheStatistics ret;
 			ret.total_cache_hits = total_cache_hits.load();
@@ -0,0 +1,109 @@
+#include "WriteBuffer.hpp"
+
+namespace nandroidfs {
+	void WriteBuffer::send_write(Connection& conn, LPCWSTR path, FILE_HANDLE file_handle, uint64_t offset, const uint8_t* data, uint32_t length) {
+		{
+			std::unique_lock lock(ack_mutex);
+			// A single write longer than the limit is still allowed once nothing else is in flight.
+			ack_cv.wait(lock, [this, length] {
+				return unacknowledged_len == 0 || unacknowledged_len + length <= MAX_UNACKNOWLEDGED_WRITE_LEN;
+			});
+			unacknowledged_len += length;
+		}
+
+		try {
+			conn.req_write_to_file_async(path, file_handle, offset, data, length, [this, length](ResponseStatus status) {
+				std::lock_guard lock(ack_mutex);
+				unacknowledged_len -= length;
+				if (status != ResponseStatus::Success && first_error == ResponseStatus::Success) {
+					first_error = status;
+				}
+				ack_cv.notify_all();
+			});
+		}
+		catch (std::exception&) {
+			// The write was never sent, so there is nothing to wait for.
+			std::lock_guard lock(ack_mutex);
+			unacknowledged_len -= length;
+			ack_cv.notify_all();
+			throw;
+		}
+	}
+
+	void WriteBuffer::send_buffer(Connection& conn, LPCWSTR path, FILE_HANDLE file_handle) {
+		if (buffer.empty()) {
+			return;
+		}
+
+		send_write(conn, path, file_handle, buffer_offset, buffer.data(), static_cast<uint32_t>(buffer.size()));
+		buffer_offset += buffer.size();
+		buffer.clear();
+	}
+
+	void WriteBuffer::wait_for_writes() {
+		std::unique_lock lock(ack_mutex);
+		ack_cv.wait(lock, [this] { return unacknowledged_len == 0; });
+	}
+
+	ResponseStatus WriteBuffer::take_error() {
+		std::lock_guard lock(ack_mutex);
+		ResponseStatus status = first_error;
+		first_error = ResponseStatus::Success;
+		return status;
+	}
+
+	ResponseStatus WriteBuffer::write(Connection& conn,
+		LPCWSTR path,
+		FILE_HANDLE file_handle,
+		uint64_t offset,
+		const uint8_t* data,
+		uint32_t length) {
+		std::lock_guard lock(mutex);
+
+		if (offset != buffer_offset + buffer.size()) {
+			// This write may overlap a write that is still in flight, so that write must complete first.
+			send_buffer(conn, path, file_handle);
+			wait_for_writes();
+			buffer_offset = offset;
+		}
+		else if (buffer.size() + length > WRITE_BUFFER_SIZE)
+		{
+			send_buffer(conn, path, file_handle);
+		}
+
+		if (buffer.empty() && length >= WRITE_BUFFER_SIZE) {
+			// Nothing to gain from buffering a write this long.
+			send_write(conn, path, file_handle, offset, data, length);
+			buffer_offset += length;
+		}
+		else
+		{
+			buffer.insert(buffer.end(), data, data + length);
+			if (buffer.size() >= WRITE_BUFFER_SIZE) {
+				send_buffer(conn, path, file_handle);
+			}
+		}
+
+		return take_error();
+	}
+
+	ResponseStatus WriteBuffer::flush(Connection& conn, LPCWSTR path, FILE_HANDLE file_handle) {
+		std::lock_guard lock(mutex);
+		send_buffer(conn, path, file_handle);
+		wait_for_writes();
+		return take_error();
+	}
+
+	ResponseStatus WriteBuffer::flush_into(CompoundRequest& compound, LPCWSTR path, FILE_HANDLE file_handle, bool continue_on_failure) {
+		std::lock_guard lock(mutex);
+		wait_for_writes();
+		if (!buffer.empty()) {
+			uint64_t length = buffer.size();
+			compound.write_to_file(path, file_handle, buffer_offset, std::move(buffer), continue_on_failure);
+			buffer_offset += length;
+			buffer.clear();
+		}
+
+		return take_error();
+	}
+}
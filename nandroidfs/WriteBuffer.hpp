@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#include "Connection.hpp"
+
+namespace nandroidfs {
+	// The maximum amount of data collected by a WriteBuffer before it is written to the file.
+	// Writes at least this long are sent straight to the file.
+	const uint32_t WRITE_BUFFER_SIZE = 1024 * 1024;
+	// The maximum number of bytes written through a WriteBuffer that the daemon has not yet acknowledged.
+	// Once this is reached, further writes wait for earlier ones to complete.
+	const uint64_t MAX_UNACKNOWLEDGED_WRITE_LEN = 8 * 1024 * 1024;
+
+	// Collects small writes to adjacent parts of a file so that they can be sent to the device in a single request.
+	// Writes are sent without waiting for the previous ones to complete, so that a stream of writes keeps the connection busy.
+	// If a write fails, the failure is reported by the next call to `write` or `flush`.
+	// The buffer must be flushed before any operation that depends on the contents or length of the file.
+	// This class is thread safe.
+	class WriteBuffer {
+	public:
+		// Writes `length` bytes of `data` at `offset` in the file.
+		// If the write carries on from the end of the previous write, it is added to the buffer,
+		// otherwise all previous writes are completed first, since writes in flight at the same time may be applied in any order.
+		// `path` must be the path the handle was opened with.
+		// Returns the status of the first write that failed since the last call to `write` or `flush`, or Success.
+		ResponseStatus write(Connection& conn, LPCWSTR path, FILE_HANDLE file_handle, uint64_t offset, const uint8_t* data, uint32_t length);
+		// Writes any buffered data to the file and waits for all writes to complete.
+		// Returns the status of the first write that failed since the last call to `write` or `flush`, or Success.
+		ResponseStatus flush(Connection& conn, LPCWSTR path, FILE_HANDLE file_handle);
+		// Adds the buffered data to `compound` as a write step, so that it is written in the same round trip as the steps after it,
+		// and waits for all writes already sent to complete. Nothing is added if the buffer is empty.
+		// Returns the status of the first write that failed since the last call to `write` or `flush`, or Success.
+		// The status of the added step is given by the results of the compound request.
+		ResponseStatus flush_into(CompoundRequest& compound, LPCWSTR path, FILE_HANDLE file_handle, bool continue_on_failure);
+	private:
+		// Held while writing, so that writes are sent in order.
+		std::mutex mutex;
+		std::vector<uint8_t> buffer;
+		// The offset in the file of the first byte in `buffer`.
+		// If `buffer` is empty, this is the offset just after the last write.
+		uint64_t buffer_offset = 0;
+
+		// Protects the following state, which is updated on the connection's response thread as writes complete.
+		// This is separate from `mutex` so that acknowledgements are never held up by a thread that is sending a write.
+		std::mutex ack_mutex;
+		std::condition_variable ack_cv;
+		uint64_t unacknowledged_len = 0;
+		// The status of the first write that failed since the failure was last reported.
+		ResponseStatus first_error = ResponseStatus::Success;
+
+		// Sends a write without waiting for it to complete, once there is space for it within MAX_UNACKNOWLEDGED_WRITE_LEN.
+		void send_write(Connection& conn, LPCWSTR path, FILE_HANDLE file_handle, uint64_t offset, const uint8_t* data, uint32_t length);
+		// Sends the buffered data and clears the buffer.
+		// Does not lock `mutex`, caller must lock.
+		void send_buffer(Connection& conn, LPCWSTR path, FILE_HANDLE file_handle);
+		// Waits for all writes to complete.
+		void wait_for_writes();
+		// Gets the status of the first failed write, and resets it so it is only reported once.
+		ResponseStatus take_error();
+	};
+}
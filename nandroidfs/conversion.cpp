@@ -17,6 +17,8 @@ namespace nandroidfs {
             return STATUS_OBJECT_NAME_COLLISION;
         case ResponseStatus::NotADirectory:
             return STATUS_NOT_A_DIRECTORY;
+        case ResponseStatus::NotAFile:
+            return STATUS_FILE_IS_A_DIRECTORY;
         case ResponseStatus::DirectoryNotEmpty:
             return STATUS_DIRECTORY_NOT_EMPTY;
         default:
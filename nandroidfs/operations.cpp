@@ -3,6 +3,7 @@
 #include "FileContext.hpp"
 #include "conversion.hpp"
 #include <iostream>
+#include <optional>
 
 #define NAN_CTX reinterpret_cast<::nandroidfs::Nandroid*>(file_info->DokanOptions->GlobalContext)
 // Utility macro to get the connection from the dokan context.
@@ -58,7 +59,9 @@ namespace nandroidfs {
     static NTSTATUS handle_create_file(LPCWSTR path,
         Connection& conn,
         DWORD creation_disposition,
-        bool file_exists,
+        // Whether an entry exists at the path, or nullopt if this is not known without opening the file.
+        std::optional<bool> file_exists,
+        AccessHint hint,
         ContextLogger& logger,
         FileContext* ctx) {
         OpenMode mode;
@@ -74,19 +77,19 @@ namespace nandroidfs {
                 // If no read access or write access has been specified and the file already exists:
                 // This call will leave the existing file umodified, so no changes have been made whatsoever to the filesystem.
                 // There is therefore no need to actually call `open` from Android, as we do not need to make any changes.
-                if (!ctx->read_access && !ctx->write_access && file_exists) {
+                if (!ctx->read_access && !ctx->write_access && file_exists == true) {
                     return STATUS_SUCCESS;
                 }
 
                 break;
             case OPEN_EXISTING:
                 // As before, this call will not require a file descriptor to be opened if not asking for read or write access.
-                if ((!ctx->read_access && !ctx->write_access && file_exists)) {
+                if ((!ctx->read_access && !ctx->write_access && file_exists == true)) {
                     return STATUS_SUCCESS;
                 }
 
                 // Early check - if the file does not exist, no need to send a request to the daemon to try and open the file.
-                if (!file_exists) {
+                if (file_exists == false) {
                     return STATUS_OBJECT_NAME_NOT_FOUND;
                 }
 
@@ -109,10 +112,13 @@ namespace nandroidfs {
         
         //std::wcout << "Opening file through ADB: " << path << " mode : " << creation_disposition <<
         //    " read_access: " << ctx->read_access << " write_access: " << ctx->write_access << std::endl;
-        ResponseStatus status = conn.req_open_file(path, mode, ctx->read_access, ctx->write_access, ctx->handle);
+        bool existed;
+        FileStat stat;
+        ResponseStatus status = conn.req_open_file(path, mode, ctx->read_access, ctx->write_access, hint, ctx->handle, existed, stat);
         if (status == ResponseStatus::Success) {
+            ctx->stat = stat;
             // Check if the file existed already and give the correct status if so.
-            if (file_exists && (creation_disposition == OPEN_ALWAYS || creation_disposition == CREATE_ALWAYS)) {
+            if (existed && (creation_disposition == OPEN_ALWAYS || creation_disposition == CREATE_ALWAYS)) {
                 return STATUS_OBJECT_NAME_COLLISION;
             }
             else
@@ -156,9 +162,35 @@ namespace nandroidfs {
 
         file_info->Context = reinterpret_cast<ULONG64>(context);
 
-        // First of all, stat the file to get its initial status
         Connection& conn = NAN_CONN;
+        // Pass on the access pattern the caller asked for, so that the device can manage its page cache to suit it.
+        AccessHint hint = AccessHint::Normal;
+        if (create_options & FILE_SEQUENTIAL_ONLY) {
+            hint = AccessHint::Sequential;
+        }
+        else if (create_options & FILE_RANDOM_ACCESS)
+        {
+            hint = AccessHint::Random;
+        }
+        else if (create_options & FILE_NO_INTERMEDIATE_BUFFERING)
+        {
+            hint = AccessHint::NoReuse;
+        }
+
+        // Opening a file gives its stat, so a file opened for reading or writing is opened straight away rather than statted first.
+        // Directories are never opened on the device, so anything that may be a directory is statted first as usual.
         FileStat stat;
+        bool may_be_directory = file_info->IsDirectory || (create_options & FILE_DIRECTORY_FILE)
+            || (conn.get_cached_stat(file_name, stat) && (file_attributes_from_st_mode(stat.mode) & FILE_ATTRIBUTE_DIRECTORY));
+        if ((context->read_access || context->write_access) && !may_be_directory) {
+            NTSTATUS open_status = handle_create_file(file_name, conn, creation_disposition, std::nullopt, hint, NAN_LOGGER, context);
+            // Otherwise, the path is a directory, which is handled below.
+            if (open_status != STATUS_FILE_IS_A_DIRECTORY) {
+                return open_status;
+            }
+        }
+
+        // Stat the entry to find whether it exists, and whether it is a directory.
         ResponseStatus status = conn.req_stat_file(file_name, stat);
         bool entry_exists; // Whether or not an entry with the specified path already exists.
         if (status == ResponseStatus::Success) {
@@ -190,7 +222,7 @@ namespace nandroidfs {
         }
         else
         {
-            return handle_create_file(file_name, conn, creation_disposition, entry_exists, NAN_LOGGER, context);
+            return handle_create_file(file_name, conn, creation_disposition, entry_exists, hint, NAN_LOGGER, context);
         }
 
         NAN_HANDLER_END;
@@ -201,16 +233,32 @@ namespace nandroidfs {
         NAN_HANDLER_START;
 
         Connection& conn = NAN_CONN;
+        FileContext* ctx = NAN_FILE_CTX;
+        // Make sure the data written is on the device once the caller has closed its handle.
+        // The buffered data is written in the same round trip as removing the entry, if it is to be removed.
+        CompoundRequest compound;
+        ResponseStatus flush_status = ctx->write_buffer.flush_into(compound, file_name, ctx->handle, true);
+        bool has_write_step = !compound.empty();
+
         if (file_info->DeleteOnClose) {
             if (file_info->IsDirectory) {
-                conn.req_remove_directory(file_name);
+                compound.remove_directory(file_name);
             }
             else
             {
-                conn.req_remove_file(file_name);
+                compound.remove_file(file_name);
             }
         }
 
+        std::vector<CompoundStepResult> results;
+        conn.req_compound(compound, results);
+        if (flush_status == ResponseStatus::Success && has_write_step && !results.empty()) {
+            flush_status = results[0].status;
+        }
+        if (flush_status != ResponseStatus::Success) {
+            NAN_LOGGER.error("failed to write buffered data on close: {}", (int) flush_status);
+        }
+
         NAN_HANDLER_END_VOID;
     }
 
@@ -220,6 +268,10 @@ namespace nandroidfs {
         FileContext* ctx = NAN_FILE_CTX;
         Connection& conn = NAN_CONN;
         if (ctx->handle != -1) {
+            // Nothing should be left to write, since the buffer is flushed when the handle is cleaned up.
+            ctx->write_buffer.flush(conn, file_name, ctx->handle);
+            // The readahead must not use the handle after it is closed.
+            ctx->read_ahead.wait();
             //std::cout << "Closing ADB file descriptor " << ctx->handle << std::endl;
             conn.req_close_file(ctx->handle);
         }
@@ -245,8 +297,19 @@ namespace nandroidfs {
         }
         else
         {
+            // The data read must include anything written through this handle.
+            ResponseStatus flush_status = context->write_buffer.flush(conn, file_name, context->handle);
+            if (flush_status != ResponseStatus::Success) {
+                return ntstatus_from_respstatus(flush_status);
+            }
+            // The stat of the handle is used to check the cached data, rather than statting the file again.
+            FileStat stat = context->get_stat();
+            context->read_ahead.before_read(conn, file_name, context->handle, stat, offset, buffer_len);
+
             int bytes_read;
-            ResponseStatus status = conn.req_read_from_file(context->handle,
+            ResponseStatus status = conn.req_read_from_file(file_name,
+                context->handle,
+                stat,
                 offset,
                 reinterpret_cast<uint8_t*>(buffer),
                 buffer_len,
@@ -280,12 +343,15 @@ namespace nandroidfs {
         }
         else
         {
-            ResponseStatus status = conn.req_write_to_file(context->handle,
+            ResponseStatus status = context->write_buffer.write(conn,
+                file_name,
+                context->handle,
                 offset,
                 reinterpret_cast<const uint8_t*>(buffer),
                 number_of_bytes_to_write);
 
             if (status == ResponseStatus::Success) {
+                context->update_stat_after_write(offset + number_of_bytes_to_write);
                 *number_of_bytes_written = number_of_bytes_to_write;
                 return STATUS_SUCCESS;
             }
@@ -298,10 +364,33 @@ namespace nandroidfs {
         NAN_HANDLER_END;
     }
 
-    // We do not maintain a buffer for each file, so this callback does nothing
     static NTSTATUS DOKAN_CALLBACK flush_file_buffers(LPCWSTR file_name,
         PDOKAN_FILE_INFO file_info) {
-        return STATUS_SUCCESS;
+        NAN_HANDLER_START;
+
+        FileContext* ctx = NAN_FILE_CTX;
+        return ntstatus_from_respstatus(ctx->write_buffer.flush(NAN_CONN, file_name, ctx->handle));
+
+        NAN_HANDLER_END;
+    }
+
+    // Gets the current stat of the file or directory that a Dokan handle was opened for.
+    // The stat comes from the stat cache, so that changes made on the device or through other handles are seen,
+    // once anything buffered by the handle has been written.
+    static ResponseStatus stat_handle_file(Connection& conn, LPCWSTR file_name, FileContext* ctx, FileStat& out_stat) {
+        if (ctx->handle != -1) {
+            ResponseStatus flush_status = ctx->write_buffer.flush(conn, file_name, ctx->handle);
+            if (flush_status != ResponseStatus::Success) {
+                return flush_status;
+            }
+        }
+
+        ResponseStatus status = conn.req_stat_file(file_name, out_stat);
+        if (status == ResponseStatus::Success && ctx->handle != -1) {
+            // Reads through the handle check the cached blocks against the latest stat.
+            ctx->set_stat(out_stat);
+        }
+        return status;
     }
 
     static NTSTATUS DOKAN_CALLBACK get_file_information(LPCWSTR filename,
@@ -310,9 +399,10 @@ namespace nandroidfs {
         NAN_HANDLER_START;
 
         Connection& conn = NAN_CONN;
+        FileContext* ctx = NAN_FILE_CTX;
         FileStat stat;
         //std::wcout << L"Statting file " << filename << " thread ID: " << GetCurrentThreadId() << std::endl;
-        ResponseStatus status = conn.req_stat_file(filename, stat);
+        ResponseStatus status = stat_handle_file(conn, filename, ctx, stat);
         if (status != ResponseStatus::Success) {
             return ntstatus_from_respstatus(status);
         }
@@ -367,11 +457,11 @@ namespace nandroidfs {
         // Obviously FILE_ATTRIBUTE_DIRECTORY has a *nix equivalent but this actually can't be set by set_file_attributes.
         // This method is implemented to return a success as long as the provided file attributes match the existing file, otherwise it fails.
         Connection& conn = NAN_CONN;
+        FileContext* ctx = NAN_FILE_CTX;
 
         // First of all get the file statistics.
         FileStat stat;
-        ResponseStatus stat_status = conn.req_stat_file(file_name, stat);
-
+        ResponseStatus stat_status = stat_handle_file(conn, file_name, ctx, stat);
         if (stat_status != ResponseStatus::Success) {
             return ntstatus_from_respstatus(stat_status);
         }
@@ -416,13 +506,29 @@ namespace nandroidfs {
         NAN_HANDLER_START;
 
         Connection& conn = NAN_CONN;
+        FileContext* ctx = NAN_FILE_CTX;
+        // Buffered data must be written first, otherwise writing it would overwrite the new write time.
+        // It is written in the same round trip as setting the time.
+        CompoundRequest compound;
+        ResponseStatus flush_status = ctx->write_buffer.flush_into(compound, file_name, ctx->handle, false);
+        if (flush_status != ResponseStatus::Success) {
+            return ntstatus_from_respstatus(flush_status);
+        }
         // Check each pointer for null before dereferencing it to get the time.
 
         // Convert the file times into their unix equivalents and then send a request to the daemon to set the file time.
-        ResponseStatus status = conn.req_set_file_time(file_name, 
-            signed_time_from_ptr(last_access_time),
-            signed_time_from_ptr(last_write_time));
+        int64_t access_time = signed_time_from_ptr(last_access_time);
+        int64_t write_time = signed_time_from_ptr(last_write_time);
+        compound.set_file_time(file_name, access_time, write_time);
+        std::vector<CompoundStepResult> results;
+        ResponseStatus status = conn.req_compound(compound, results);
+        if (status == ResponseStatus::Success) {
+            status = get_first_failure(results);
+        }
         // (Creation time is not supported, as the Android filesystem doesn't support it.)
+        if (status == ResponseStatus::Success) {
+            ctx->update_stat_times(access_time, write_time);
+        }
 
         return ntstatus_from_respstatus(status);
         NAN_HANDLER_END;
@@ -454,7 +560,22 @@ namespace nandroidfs {
         NAN_HANDLER_START;
 
         Connection& conn = NAN_CONN;
-        return ntstatus_from_respstatus(conn.req_move_entry(file_name, new_file_name, replace_if_existing));
+        FileContext* ctx = NAN_FILE_CTX;
+        // Flush while the file still has its old path, so that the cached data for that path is invalidated.
+        // The buffered data is written in the same round trip as the move.
+        CompoundRequest compound;
+        ResponseStatus flush_status = ctx->write_buffer.flush_into(compound, file_name, ctx->handle, false);
+        if (flush_status != ResponseStatus::Success) {
+            return ntstatus_from_respstatus(flush_status);
+        }
+
+        compound.move_entry(file_name, new_file_name, replace_if_existing);
+        std::vector<CompoundStepResult> results;
+        ResponseStatus status = conn.req_compound(compound, results);
+        if (status == ResponseStatus::Success) {
+            status = get_first_failure(results);
+        }
+        return ntstatus_from_respstatus(status);
 
         NAN_HANDLER_END;
     }
@@ -467,7 +588,23 @@ namespace nandroidfs {
         FileContext* ctx = NAN_FILE_CTX;
 
         if (ctx->write_access) {
-            ResponseStatus status = conn.req_set_file_len(ctx->handle, byte_offset);
+            // Buffered data must be written first, otherwise it could extend the file again after it is truncated.
+            // It is written in the same round trip as setting the length.
+            CompoundRequest compound;
+            ResponseStatus status = ctx->write_buffer.flush_into(compound, file_name, ctx->handle, false);
+            if (status != ResponseStatus::Success) {
+                return ntstatus_from_respstatus(status);
+            }
+
+            compound.set_file_len(file_name, ctx->handle, byte_offset);
+            std::vector<CompoundStepResult> results;
+            status = conn.req_compound(compound, results);
+            if (status == ResponseStatus::Success) {
+                status = get_first_failure(results);
+            }
+            if (status == ResponseStatus::Success) {
+                ctx->update_stat_after_truncate(byte_offset);
+            }
             return ntstatus_from_respstatus(status);
         }
         else